@@ -0,0 +1,568 @@
+/*
+ * Microbenchmarks for the encoder and decoder.
+ *
+ * Run this program with no arguments to run every benchmark,
+ * or name the benchmarks to run. Costs are reported per symbol,
+ * as the mean over enough repetitions to take a measurable time.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <eci.h>
+#include <qr.h>
+
+#include "internal.h"
+#include "xalloc.h"
+
+#include "encode.c"
+#include "decode.c"
+
+#define ARRAY_LENGTH(name)  (sizeof(name) / sizeof(name[0]))
+
+/* minimum time to spend measuring each case, in seconds */
+#define BENCH_MIN_TIME 0.05
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		perror("clock_gettime");
+		exit(EXIT_FAILURE);
+	}
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Returns the mean wall-clock time in microseconds per call of f(opaque),
+ * repeating until at least BENCH_MIN_TIME has elapsed.
+ */
+static double
+measure(void (*f)(void *opaque), void *opaque)
+{
+	unsigned long n, reps;
+	double start, end;
+
+	f(opaque); /* warm caches */
+
+	for (reps = 1; ; reps *= 2) {
+		start = now();
+		for (n = 0; n < reps; n++) {
+			f(opaque);
+		}
+		end = now();
+
+		if (end - start >= BENCH_MIN_TIME) {
+			break;
+		}
+	}
+
+	return (end - start) * 1e6 / reps;
+}
+
+/*
+ * The bit-serial Reed-Solomon encoder this library used before switching to
+ * log/exp tables, kept here as the baseline for comparison. The generator
+ * polynomial was recomputed on every call to append_ecl().
+ */
+
+static uint8_t
+bitserial_mul(uint8_t x, uint8_t y)
+{
+	uint8_t z = 0;
+
+	for (int i = 7; i >= 0; i--) {
+		z = (z << 1) ^ ((z >> 7) * 0x11D);
+		z ^= ((y >> i) & 1) * x;
+	}
+
+	return z;
+}
+
+static void
+bitserial_append_ecl(uint8_t *p, unsigned ver, enum qr_ecl ecl)
+{
+	int numBlocks = NUM_ERROR_CORRECTION_BLOCKS[ver][ecl];
+	int blockEccLen = ECL_CODEWORDS_PER_BLOCK[ver][ecl];
+	int rawCodewords = count_data_bits(ver) / 8;
+	int dataLen = rawCodewords - blockEccLen * numBlocks;
+	int numShortBlocks = numBlocks - rawCodewords % numBlocks;
+	int shortBlockDataLen = rawCodewords / numBlocks - blockEccLen;
+
+	uint8_t generator[30];
+	memset(generator, 0, blockEccLen);
+	generator[blockEccLen - 1] = 1;
+	uint8_t root = 1;
+	for (int i = 0; i < blockEccLen; i++) {
+		for (int j = 0; j < blockEccLen; j++) {
+			generator[j] = bitserial_mul(generator[j], root);
+			if (j + 1 < blockEccLen) {
+				generator[j] ^= generator[j + 1];
+			}
+		}
+		root = bitserial_mul(root, 0x02);
+	}
+
+	for (int i = 0, j = dataLen, k = 0; i < numBlocks; i++) {
+		int blockLen = shortBlockDataLen + (i >= numShortBlocks);
+		uint8_t *r = &p[j];
+
+		memset(r, 0, blockEccLen);
+		for (int l = 0; l < blockLen; l++) {
+			uint8_t factor = p[k + l] ^ r[0];
+			memmove(&r[0], &r[1], blockEccLen - 1);
+			r[blockEccLen - 1] = 0;
+			for (int m = 0; m < blockEccLen; m++) {
+				r[m] ^= bitserial_mul(generator[m], factor);
+			}
+		}
+
+		j += blockEccLen;
+		k += blockLen;
+	}
+}
+
+struct ecc_case {
+	unsigned ver;
+	enum qr_ecl ecl;
+	uint8_t data[QR_BUF_LEN_MAX];
+	uint8_t result[QR_BUF_LEN_MAX];
+};
+
+static void
+ecc_before(void *opaque)
+{
+	struct ecc_case *c = opaque;
+
+	bitserial_append_ecl(c->data, c->ver, c->ecl);
+}
+
+static void
+ecc_after(void *opaque)
+{
+	struct ecc_case *c = opaque;
+
+	append_ecl(c->data, c->ver, c->ecl, NULL, c->result);
+}
+
+/*
+ * Reed-Solomon ECC generation per symbol, summed over all four ECLs.
+ */
+static void
+bench_ecc(void)
+{
+	struct ecc_case c;
+
+	printf("ecc: Reed-Solomon ECC generation per symbol (all four ECLs), us\n");
+	printf("%4s %10s %10s %8s\n", "ver", "bitserial", "current", "speedup");
+
+	for (c.ver = QR_VER_MIN; c.ver <= QR_VER_MAX; c.ver++) {
+		double before = 0, after = 0;
+
+		for (c.ecl = QR_ECL_LOW; c.ecl <= QR_ECL_HIGH; c.ecl++) {
+			for (size_t i = 0; i < sizeof c.data; i++) {
+				c.data[i] = rand() % 256;
+			}
+
+			before += measure(ecc_before, &c);
+			after  += measure(ecc_after,  &c);
+		}
+
+		printf("%4u %10.2f %10.2f %7.1fx\n", c.ver, before, after, before / after);
+	}
+}
+
+struct rs_case {
+	unsigned ver;
+	enum rs_kernel kernel; /* or RS_KERNEL_AUTO for the scalar kernel */
+	uint8_t data[QR_BUF_LEN_MAX];
+};
+
+/*
+ * The block loop from append_ecl() for all four ECLs,
+ * dividing by each generator with the given kernel.
+ */
+static void
+rs_blocks(void *opaque)
+{
+	struct rs_case *c = opaque;
+	enum qr_ecl ecl;
+
+	for (ecl = QR_ECL_LOW; ecl <= QR_ECL_HIGH; ecl++) {
+		int numBlocks = NUM_ERROR_CORRECTION_BLOCKS[c->ver][ecl];
+		int blockEccLen = ECL_CODEWORDS_PER_BLOCK[c->ver][ecl];
+		int rawCodewords = count_data_bits(c->ver) / 8;
+		int dataLen = rawCodewords - blockEccLen * numBlocks;
+		int numShortBlocks = numBlocks - rawCodewords % numBlocks;
+		int shortBlockDataLen = rawCodewords / numBlocks - blockEccLen;
+		const uint8_t *generator = reed_solomon_generator(blockEccLen);
+		struct rs_encoder e;
+
+		if (c->kernel != RS_KERNEL_AUTO) {
+			(void) rs_encoder_init(&e, generator, blockEccLen, c->kernel);
+		}
+
+		for (int i = 0, j = dataLen, k = 0; i < numBlocks; i++) {
+			int blockLen = shortBlockDataLen + (i >= numShortBlocks);
+
+			if (c->kernel == RS_KERNEL_AUTO) {
+				reed_solomon_remainder(&c->data[k], blockLen, generator, blockEccLen, &c->data[j]);
+			} else {
+				e.remainder(&e, &c->data[k], blockLen, &c->data[j]);
+			}
+
+			j += blockEccLen;
+			k += blockLen;
+		}
+	}
+}
+
+/*
+ * Reed-Solomon remainder kernels per symbol, summed over all four ECLs,
+ * including building each kernel's tables. Unsupported kernels show "-".
+ */
+static void
+bench_rs(void)
+{
+	static const struct {
+		const char *name;
+		enum rs_kernel kernel;
+	} k[] = {
+		{ "scalar", RS_KERNEL_AUTO  },
+		{ "word",   RS_KERNEL_WORD  },
+		{ "ssse3",  RS_KERNEL_SSSE3 },
+		{ "avx2",   RS_KERNEL_AVX2  }
+	};
+
+	struct rs_case c;
+	size_t i;
+
+	printf("rs: Reed-Solomon remainder kernels per symbol (all four ECLs), us\n");
+	printf("%4s", "ver");
+	for (i = 0; i < ARRAY_LENGTH(k); i++) {
+		printf(" %8s", k[i].name);
+	}
+	printf("\n");
+
+	for (size_t j = 0; j < sizeof c.data; j++) {
+		c.data[j] = rand() % 256;
+	}
+
+	for (c.ver = QR_VER_MIN; c.ver <= QR_VER_MAX; c.ver++) {
+		printf("%4u", c.ver);
+
+		for (i = 0; i < ARRAY_LENGTH(k); i++) {
+			struct rs_encoder e;
+
+			c.kernel = k[i].kernel;
+			if (c.kernel != RS_KERNEL_AUTO && !rs_encoder_init(&e, RS_GENERATOR[1], 1, c.kernel)) {
+				printf(" %8s", "-");
+				continue;
+			}
+
+			printf(" %8.2f", measure(rs_blocks, &c));
+		}
+
+		printf("\n");
+	}
+}
+
+/* worker threads for the pool benchmark, in addition to the caller */
+#define BENCH_THREADS 3
+
+struct pool_case {
+	unsigned ver;
+	struct qr_pool *pool;
+	struct qr_options opt;
+	struct qr q;
+	uint8_t map[QR_BUF_LEN_MAX];
+	uint8_t data[QR_BUF_LEN_MAX];
+	uint8_t result[QR_BUF_LEN_MAX];
+};
+
+static void
+pool_ecc(void *opaque)
+{
+	struct pool_case *c = opaque;
+
+	append_ecl(c->data, c->ver, QR_ECL_HIGH, c->pool, c->result);
+}
+
+static void
+pool_decode(void *opaque)
+{
+	struct pool_case *c = opaque;
+	struct qr_data data;
+	struct qr_stats stats;
+	uint8_t tmp[QR_BUF_LEN_MAX];
+
+	if (qr_decode_opt(&c->q, &c->opt, &data, &stats, tmp) != QR_SUCCESS) {
+		fprintf(stderr, "decode failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	qr_data_free(&data);
+}
+
+/*
+ * Reed-Solomon blocks at ECL H, serially and on a thread pool.
+ * Small symbols do not use the pool; see ECL_POOL_MIN and ECC_POOL_MIN.
+ */
+static void
+bench_pool(void)
+{
+	struct qr_pool *pool;
+	struct qr_segment *a[1];
+	struct pool_case c;
+	uint8_t tmp[QR_BUF_LEN_MAX];
+
+	pool = qr_pool_create(BENCH_THREADS);
+	if (pool == NULL) {
+		perror("qr_pool_create");
+		exit(EXIT_FAILURE);
+	}
+
+	a[0] = qr_make_any("HELLO");
+	c.q.map = c.map;
+	c.opt = (struct qr_options) { NULL };
+
+	printf("pool: ECL H blocks, serial and with %u threads, us\n", BENCH_THREADS + 1);
+	printf("%4s %6s %8s %8s %8s %8s\n", "ver", "blocks", "ecc", "pool", "decode", "pool");
+
+	for (c.ver = QR_VER_MIN; c.ver <= QR_VER_MAX; c.ver++) {
+		double t[4];
+
+		for (size_t i = 0; i < sizeof c.data; i++) {
+			c.data[i] = rand() % 256;
+		}
+
+		if (!qr_encode(a, 1, QR_ECL_HIGH, c.ver, c.ver, QR_MASK_AUTO, false, tmp, &c.q)) {
+			fprintf(stderr, "encode failed\n");
+			exit(EXIT_FAILURE);
+		}
+
+		// Some damage, so that decoding has something to correct
+		qr_set_module(&c.q, c.q.size - 1, c.q.size - 1, !qr_get_module(&c.q, c.q.size - 1, c.q.size - 1));
+
+		c.pool = NULL; c.opt.pool = NULL;
+		t[0] = measure(pool_ecc, &c);
+		t[2] = measure(pool_decode, &c);
+
+		c.pool = pool; c.opt.pool = pool;
+		t[1] = measure(pool_ecc, &c);
+		t[3] = measure(pool_decode, &c);
+
+		printf("%4u %6d %8.2f %8.2f %8.2f %8.2f\n", c.ver, NUM_ERROR_CORRECTION_BLOCKS[c.ver][QR_ECL_HIGH],
+			t[0], t[1], t[2], t[3]);
+	}
+
+	seg_free(a[0]);
+	qr_pool_destroy(pool);
+}
+
+struct codec_case {
+	unsigned ver;
+	struct qr_segment *a[1];
+	struct qr q;
+	uint8_t map[QR_BUF_LEN_MAX];
+	uint8_t init[QR_BUF_LEN_MAX]; /* function modules only, from draw_init() */
+	uint8_t data[QR_BUF_LEN_MAX];
+	uint8_t raw[QR_BUF_LEN_MAX];
+	size_t bits;
+	char payload[QR_PAYLOAD_MAX];
+	struct qr_segment_view v[QR_SEGMENTS_MAX];
+};
+
+static void
+codec_encode(void *opaque)
+{
+	struct codec_case *c = opaque;
+	uint8_t tmp[QR_BUF_LEN_MAX];
+
+	if (!qr_encode(c->a, 1, QR_ECL_LOW, c->ver, c->ver, QR_MASK_AUTO, false, tmp, &c->q)) {
+		fprintf(stderr, "encode failed\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+codec_decode(void *opaque)
+{
+	struct codec_case *c = opaque;
+	struct qr_data data;
+	struct qr_stats stats;
+	uint8_t tmp[QR_BUF_LEN_MAX];
+
+	if (qr_decode(&c->q, &data, &stats, tmp) != QR_SUCCESS) {
+		fprintf(stderr, "decode failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	qr_data_free(&data);
+}
+
+static void
+codec_decode_views(void *opaque)
+{
+	struct codec_case *c = opaque;
+	struct qr_views views = { .payload = c->payload, .payload_max = sizeof c->payload,
+		.a = c->v, .max = QR_SEGMENTS_MAX };
+	struct qr_stats stats;
+	uint8_t tmp[QR_BUF_LEN_MAX];
+
+	if (qr_decode_views(&c->q, NULL, &views, &stats, tmp) != QR_SUCCESS) {
+		fprintf(stderr, "decode failed\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+codec_place(void *opaque)
+{
+	struct codec_case *c = opaque;
+
+	memcpy(c->map, c->init, QR_BUF_LEN(c->ver));
+	draw_codewords(c->data, count_data_bits(c->ver) / 8, &c->q);
+}
+
+static void
+codec_place_walk(void *opaque)
+{
+	struct codec_case *c = opaque;
+	struct place pl = { c->data, count_data_bits(c->ver) / 8 * 8, &c->q };
+
+	memcpy(c->map, c->init, QR_BUF_LEN(c->ver));
+	placement_walk(c->ver, place_bit, &pl);
+}
+
+static void
+codec_read(void *opaque)
+{
+	struct codec_case *c = opaque;
+
+	read_data(&c->q, c->raw, &c->bits);
+}
+
+static void
+walk_bit(void *opaque, size_t i, size_t module)
+{
+	struct codec_case *c = opaque;
+
+	(void) i;
+
+	append_bit(BM_GET(c->q.map, module), c->raw, &c->bits);
+}
+
+static void
+codec_read_walk(void *opaque)
+{
+	struct codec_case *c = opaque;
+
+	c->bits = 0;
+	placement_walk(c->ver, walk_bit, c);
+}
+
+/*
+ * Encoding (automatic mask) and decoding of a whole symbol at ECL L,
+ * decoding to segments and to views, and codeword placement and extraction alone, by the placement tables
+ * and by walking the zigzag.
+ */
+static void
+bench_codec(void)
+{
+	static struct codec_case c;
+	char s[QR_PAYLOAD_MAX];
+
+	c.q.map = c.map;
+
+	printf("codec: encode and decode (segments/views) at ECL L, and codeword placement (table/walk), us\n");
+	printf("%4s %8s %8s %8s %8s %8s %8s %8s\n", "ver", "encode", "decode", "views", "place", "walk", "read", "walk");
+
+	for (c.ver = QR_VER_MIN; c.ver <= QR_VER_MAX; c.ver++) {
+		double t[7];
+
+		for (size_t i = 0; i < sizeof c.data; i++) {
+			c.data[i] = rand() % 256;
+		}
+
+		// Enough alphanumeric data to need this version
+		size_t n = (count_data_bits(c.ver) / 8 - ECL_CODEWORDS_PER_BLOCK[c.ver][QR_ECL_LOW]
+			* NUM_ERROR_CORRECTION_BLOCKS[c.ver][QR_ECL_LOW]) * 8 / 11 * 2 - 8;
+		for (size_t i = 0; i < n; i++) {
+			s[i] = ALNUM_CHARSET[rand() % (sizeof ALNUM_CHARSET - 1)];
+		}
+		s[n] = '\0';
+
+		c.a[0] = qr_make_any(s);
+
+		draw_init(c.ver, &c.q);
+		memcpy(c.init, c.map, QR_BUF_LEN(c.ver));
+
+		t[0] = measure(codec_encode, &c);
+		t[1] = measure(codec_decode, &c);
+		t[2] = measure(codec_decode_views, &c);
+		t[3] = measure(codec_place, &c);
+		t[4] = measure(codec_place_walk, &c);
+		t[5] = measure(codec_read, &c);
+		t[6] = measure(codec_read_walk, &c);
+
+		printf("%4u %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f\n", c.ver, t[0], t[1], t[2], t[3], t[4], t[5], t[6]);
+
+		seg_free(c.a[0]);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct {
+		const char *name;
+		void (*f)(void);
+	} a[] = {
+		{ "ecc",   bench_ecc   },
+		{ "rs",    bench_rs    },
+		{ "pool",  bench_pool  },
+		{ "codec", bench_codec }
+	};
+
+	size_t i;
+	int j;
+
+	srand(0);
+
+	if (argc <= 1) {
+		for (i = 0; i < ARRAY_LENGTH(a); i++) {
+			a[i].f();
+		}
+
+		return 0;
+	}
+
+	for (j = 1; j < argc; j++) {
+		for (i = 0; i < ARRAY_LENGTH(a); i++) {
+			if (0 == strcmp(a[i].name, argv[j])) {
+				break;
+			}
+		}
+
+		if (i == ARRAY_LENGTH(a)) {
+			fprintf(stderr, "unrecognised benchmark '%s'\n", argv[j]);
+			exit(EXIT_FAILURE);
+		}
+
+		a[i].f();
+	}
+
+	return 0;
+}
@@ -88,33 +88,247 @@ append_bits(uint32_t v, size_t n, void *buf, size_t *count)
 	}
 }
 
+/* stores the first (n + 7) / 8 bytes of w, most significant first */
+static void
+store_bytes(uint8_t *p, uint64_t w, size_t n)
+{
+	for (size_t i = 0; i < (n + 7) / 8; i++) {
+		p[i] = w >> (56 - 8 * i);
+	}
+}
+
+void
+bit_writer_init(struct bit_writer *w, void *buf)
+{
+	assert(w != NULL);
+	assert(buf != NULL);
+
+	w->buf = buf;
+	w->pos = 0;
+	w->acc = 0;
+	w->n   = 0;
+}
+
+void
+bit_writer_put(struct bit_writer *w, uint32_t v, size_t n)
+{
+	assert(w != NULL);
+	assert(n <= CHAR_BIT * sizeof v);
+	assert((uint64_t) v >> n == 0);
+	assert(w->n < 64);
+
+	size_t room = 64 - w->n;
+
+	if (n == 0) {
+		return;
+	}
+
+	if (n < room) {
+		w->acc |= (uint64_t) v << (room - n);
+		w->n += n;
+		return;
+	}
+
+	/* fill the word, store it, and keep the rest of v */
+	w->acc |= (uint64_t) v >> (n - room);
+	store_bytes(w->buf + w->pos, w->acc, 64);
+	w->pos += 8;
+
+	w->n   = n - room;
+	w->acc = w->n == 0 ? 0 : (uint64_t) v << (64 - w->n);
+}
+
+void
+bit_writer_span(struct bit_writer *w, const void *src, size_t bits)
+{
+	const uint8_t *p = src;
+	size_t i;
+
+	assert(w != NULL);
+	assert(src != NULL || bits == 0);
+
+	if (w->n % 8 == 0) {
+		/* byte-aligned: store what is pending, then copy whole bytes */
+		store_bytes(w->buf + w->pos, w->acc, w->n);
+		w->pos += w->n / 8;
+		w->acc = 0;
+		w->n   = 0;
+
+		memcpy(w->buf + w->pos, p, bits / 8);
+		w->pos += bits / 8;
+		i = bits / 8;
+	} else {
+		for (i = 0; i + 4 <= bits / 8; i += 4) {
+			bit_writer_put(w, (uint32_t) p[i] << 24 | (uint32_t) p[i + 1] << 16
+				| (uint32_t) p[i + 2] << 8 | p[i + 3], 32);
+		}
+
+		for ( ; i < bits / 8; i++) {
+			bit_writer_put(w, p[i], 8);
+		}
+	}
+
+	if (bits % 8 != 0) {
+		bit_writer_put(w, p[i] >> (8 - bits % 8), bits % 8);
+	}
+}
+
+size_t
+bit_writer_flush(struct bit_writer *w)
+{
+	assert(w != NULL);
+
+	store_bytes(w->buf + w->pos, w->acc, w->n);
+
+	return w->pos * 8 + w->n;
+}
+
+static void
+bit_reader_refill(struct bit_reader *r)
+{
+	while (r->n <= 56 && r->next < BM_LEN(r->bits)) {
+		r->cache |= (uint64_t) r->buf[r->next++] << (56 - r->n);
+		r->n += 8;
+	}
+}
+
+void
+bit_reader_init(struct bit_reader *r, const void *buf, size_t bits, size_t pos)
+{
+	assert(r != NULL);
+	assert(buf != NULL || bits == 0);
+	assert(pos <= bits);
+
+	r->buf   = buf;
+	r->bits  = bits;
+	r->pos   = pos;
+	r->next  = pos / 8;
+	r->cache = 0;
+	r->n     = 0;
+
+	bit_reader_refill(r);
+
+	/* drop the bits of the first byte before pos */
+	if (pos % 8 != 0) {
+		r->cache <<= pos % 8;
+		r->n -= pos % 8;
+	}
+}
+
+uint32_t
+bit_reader_take(struct bit_reader *r, size_t n)
+{
+	uint32_t v;
+
+	assert(r != NULL);
+	assert(n <= 32);
+
+	if (n > r->bits - r->pos) {
+		n = r->bits - r->pos;
+	}
+
+	if (n == 0) {
+		return 0;
+	}
+
+	if (r->n < n) {
+		bit_reader_refill(r);
+	}
+
+	assert(r->n >= n);
+
+	v = r->cache >> (64 - n);
+	r->cache <<= n;
+	r->n   -= n;
+	r->pos += n;
+
+	return v;
+}
+
+void
+bit_reader_span(struct bit_reader *r, void *dst, size_t bits)
+{
+	uint8_t *p = dst;
+	size_t i;
+
+	assert(r != NULL);
+	assert(dst != NULL || bits == 0);
+	assert(bits <= r->bits - r->pos);
+
+	if (r->pos % 8 == 0) {
+		/* byte-aligned: copy whole bytes straight from the stream */
+		memcpy(p, r->buf + r->pos / 8, bits / 8);
+		bit_reader_init(r, r->buf, r->bits, r->pos + bits / 8 * 8);
+		i = bits / 8;
+	} else {
+		for (i = 0; i + 4 <= bits / 8; i += 4) {
+			uint32_t v = bit_reader_take(r, 32);
+
+			p[i + 0] = v >> 24;
+			p[i + 1] = v >> 16;
+			p[i + 2] = v >>  8;
+			p[i + 3] = v;
+		}
+
+		for ( ; i < bits / 8; i++) {
+			p[i] = bit_reader_take(r, 8);
+		}
+	}
+
+	if (bits % 8 != 0) {
+		p[i] = bit_reader_take(r, bits % 8) << (8 - bits % 8);
+	}
+}
+
+struct gather {
+	const struct qr *q;
+	void *buf;
+	size_t *bits;
+};
+
+static void
+gather_bit(void *opaque, size_t i, size_t module)
+{
+	struct gather *g = opaque;
+
+	(void) i;
+
+	append_bit(BM_GET(g->q->map, module), g->buf, g->bits);
+}
+
 void
 read_data(const struct qr *q,
 	void *buf, size_t *bits)
 {
-	int y = q->size - 1;
-	int x = q->size - 1;
-	int dir = -1;
+	const unsigned ver = QR_VER(q->size);
+	const uint16_t *t;
+	uint8_t *p = buf;
+	size_t n;
 
 	*bits = 0;
 
-	while (x > 0) {
-		if (x == 6)
-			x--;
+	t = placement(ver);
+	if (t == NULL) {
+		struct gather g = { q, buf, bits };
+		placement_walk(ver, gather_bit, &g);
+		return;
+	}
 
-		if (!reserved_module(q, y, x))
-			append_bit(qr_get_module(q, x, y), buf, bits);
+	n = count_data_bits(ver);
 
-		if (!reserved_module(q, y, x - 1))
-			append_bit(qr_get_module(q, x - 1, y), buf, bits);
+	for (size_t i = 0; i < n; i += 8) {
+		unsigned b = 0;
 
-		y += dir;
-		if (y < 0 || y >= (int) q->size) {
-			dir = -dir;
-			x -= 2;
-			y += dir;
+		for (unsigned j = 0; j < 8; j++) {
+			b <<= 1;
+			if (i + j < n)
+				b |= BM_GET(q->map, t[i + j]);
 		}
+
+		p[i / 8] = b;
 	}
+
+	*bits = n;
 }
 
 int
@@ -8,6 +8,63 @@ append_bit(bool v, void *buf, size_t *bits);
 void
 append_bits(uint32_t v, size_t n, void *buf, size_t *count);
 
+/*
+ * Appends bits to a byte-based buffer, most significant first like
+ * append_bits(), a word at a time. Bits are held in .acc until a whole
+ * word has accumulated. The buffer is written a byte at a time from its
+ * start, so it need not be zeroed; call bit_writer_flush() before reading
+ * it. The last byte flushed is padded with zero bits.
+ */
+struct bit_writer {
+	uint8_t *buf;
+	size_t pos;   /* bytes stored */
+	uint64_t acc; /* pending bits, most significant first */
+	size_t n;     /* number of pending bits, less than 64 */
+};
+
+void
+bit_writer_init(struct bit_writer *w, void *buf);
+
+/* appends the low n bits of v, for n <= 32 */
+void
+bit_writer_put(struct bit_writer *w, uint32_t v, size_t n);
+
+/* appends the first bits of src, which are packed most significant first */
+void
+bit_writer_span(struct bit_writer *w, const void *src, size_t bits);
+
+/* stores any pending bits, returning the number of bits written so far */
+size_t
+bit_writer_flush(struct bit_writer *w);
+
+/*
+ * Reads bits from a byte-based buffer, most significant first like
+ * take_bits(), through a cache of up to 64 bits which is refilled
+ * a byte at a time. Bits are read from .pos until .bits.
+ */
+struct bit_reader {
+	const uint8_t *buf;
+	size_t bits;    /* length of the stream */
+	size_t pos;     /* bits read */
+	size_t next;    /* the next byte to load into .cache */
+	uint64_t cache; /* the bits from .pos on, most significant first */
+	size_t n;       /* number of bits in .cache */
+};
+
+void
+bit_reader_init(struct bit_reader *r, const void *buf, size_t bits, size_t pos);
+
+/*
+ * Reads n <= 32 bits. As for take_bits(), fewer are read if the stream ends,
+ * and the result is then those bits alone.
+ */
+uint32_t
+bit_reader_take(struct bit_reader *r, size_t n);
+
+/* copies the next bits to dst, packed most significant first, zero-padded */
+void
+bit_reader_span(struct bit_reader *r, void *dst, size_t bits);
+
 void
 read_data(const struct qr *q,
 	void *buf, size_t *bits);
@@ -15,7 +15,9 @@
  */
 
 #include <assert.h>
+#include <limits.h>
 #include <string.h>
+#include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -25,6 +27,7 @@
 
 #include "internal.h"
 #include "datastream.h"
+#include "seg.h"
 
 #define MAX_POLY       64
 
@@ -38,92 +41,6 @@ struct galois_field {
 	const uint8_t *exp;
 };
 
-static const uint8_t gf16_exp[16] = {
-	0x01, 0x02, 0x04, 0x08, 0x03, 0x06, 0x0c, 0x0b,
-	0x05, 0x0a, 0x07, 0x0e, 0x0f, 0x0d, 0x09, 0x01
-};
-
-static const uint8_t gf16_log[16] = {
-	0x00, 0x0f, 0x01, 0x04, 0x02, 0x08, 0x05, 0x0a,
-	0x03, 0x0e, 0x09, 0x07, 0x06, 0x0d, 0x0b, 0x0c
-};
-
-static const struct galois_field gf16 = {
-	.p = 15,
-	.log = gf16_log,
-	.exp = gf16_exp
-};
-
-static const uint8_t gf256_exp[256] = {
-	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
-	0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26,
-	0x4c, 0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9,
-	0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0,
-	0x9d, 0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35,
-	0x6a, 0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23,
-	0x46, 0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0,
-	0x5d, 0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1,
-	0x5f, 0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc,
-	0x65, 0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0,
-	0xfd, 0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f,
-	0xfe, 0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2,
-	0xd9, 0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88,
-	0x0d, 0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce,
-	0x81, 0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93,
-	0x3b, 0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc,
-	0x85, 0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9,
-	0x4f, 0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54,
-	0xa8, 0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa,
-	0x49, 0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73,
-	0xe6, 0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e,
-	0xfc, 0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff,
-	0xe3, 0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4,
-	0x95, 0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41,
-	0x82, 0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e,
-	0x1c, 0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6,
-	0x51, 0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef,
-	0xc3, 0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09,
-	0x12, 0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5,
-	0xf7, 0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16,
-	0x2c, 0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83,
-	0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01
-};
-
-static const uint8_t gf256_log[256] = {
-	0x00, 0xff, 0x01, 0x19, 0x02, 0x32, 0x1a, 0xc6,
-	0x03, 0xdf, 0x33, 0xee, 0x1b, 0x68, 0xc7, 0x4b,
-	0x04, 0x64, 0xe0, 0x0e, 0x34, 0x8d, 0xef, 0x81,
-	0x1c, 0xc1, 0x69, 0xf8, 0xc8, 0x08, 0x4c, 0x71,
-	0x05, 0x8a, 0x65, 0x2f, 0xe1, 0x24, 0x0f, 0x21,
-	0x35, 0x93, 0x8e, 0xda, 0xf0, 0x12, 0x82, 0x45,
-	0x1d, 0xb5, 0xc2, 0x7d, 0x6a, 0x27, 0xf9, 0xb9,
-	0xc9, 0x9a, 0x09, 0x78, 0x4d, 0xe4, 0x72, 0xa6,
-	0x06, 0xbf, 0x8b, 0x62, 0x66, 0xdd, 0x30, 0xfd,
-	0xe2, 0x98, 0x25, 0xb3, 0x10, 0x91, 0x22, 0x88,
-	0x36, 0xd0, 0x94, 0xce, 0x8f, 0x96, 0xdb, 0xbd,
-	0xf1, 0xd2, 0x13, 0x5c, 0x83, 0x38, 0x46, 0x40,
-	0x1e, 0x42, 0xb6, 0xa3, 0xc3, 0x48, 0x7e, 0x6e,
-	0x6b, 0x3a, 0x28, 0x54, 0xfa, 0x85, 0xba, 0x3d,
-	0xca, 0x5e, 0x9b, 0x9f, 0x0a, 0x15, 0x79, 0x2b,
-	0x4e, 0xd4, 0xe5, 0xac, 0x73, 0xf3, 0xa7, 0x57,
-	0x07, 0x70, 0xc0, 0xf7, 0x8c, 0x80, 0x63, 0x0d,
-	0x67, 0x4a, 0xde, 0xed, 0x31, 0xc5, 0xfe, 0x18,
-	0xe3, 0xa5, 0x99, 0x77, 0x26, 0xb8, 0xb4, 0x7c,
-	0x11, 0x44, 0x92, 0xd9, 0x23, 0x20, 0x89, 0x2e,
-	0x37, 0x3f, 0xd1, 0x5b, 0x95, 0xbc, 0xcf, 0xcd,
-	0x90, 0x87, 0x97, 0xb2, 0xdc, 0xfc, 0xbe, 0x61,
-	0xf2, 0x56, 0xd3, 0xab, 0x14, 0x2a, 0x5d, 0x9e,
-	0x84, 0x3c, 0x39, 0x53, 0x47, 0x6d, 0x41, 0xa2,
-	0x1f, 0x2d, 0x43, 0xd8, 0xb7, 0x7b, 0xa4, 0x76,
-	0xc4, 0x17, 0x49, 0xec, 0x7f, 0x0c, 0x6f, 0xf6,
-	0x6c, 0xa1, 0x3b, 0x52, 0x29, 0x9d, 0x55, 0xaa,
-	0xfb, 0x60, 0x86, 0xb1, 0xbb, 0xcc, 0x3e, 0x5a,
-	0xcb, 0x59, 0x5f, 0xb0, 0x9c, 0xa9, 0xa0, 0x51,
-	0x0b, 0xf5, 0x16, 0xeb, 0x7a, 0x75, 0x2c, 0xd7,
-	0x4f, 0xae, 0xd5, 0xe9, 0xe6, 0xe7, 0xad, 0xe8,
-	0x74, 0xd6, 0xf4, 0xea, 0xa8, 0x50, 0x58, 0xaf
-};
-
 static const struct galois_field gf256 = {
 	.p = 255,
 	.log = gf256_log,
@@ -143,6 +60,7 @@ qr_strerror(enum qr_decode err)
 	case QR_ERROR_DATA_ECC:          return "ECC failure";
 	case QR_ERROR_DATA_OVERFLOW:     return "Data overflow";
 	case QR_ERROR_DATA_UNDERFLOW:    return "Data underflow";
+	case QR_ERROR_VERSION_MISMATCH:  return "Grid size does not match version information";
 
 	default:
 		return "Unknown error";
@@ -176,34 +94,14 @@ poly_add(uint8_t *dst, const uint8_t *src, uint8_t c,
 	}
 }
 
-static uint8_t
-poly_eval(const uint8_t *s, uint8_t x,
-	const struct galois_field *gf)
-{
-	int i;
-	uint8_t sum = 0;
-	uint8_t log_x = gf->log[x];
-
-	if (!x)
-		return s[0];
-
-	for (i = 0; i < MAX_POLY; i++) {
-		uint8_t c = s[i];
-
-		if (!c)
-			continue;
-
-		sum ^= gf->exp[(gf->log[c] + log_x * i) % gf->p];
-	}
-
-	return sum;
-}
-
 /************************************************************************
  * Berlekamp-Massey algorithm for finding error locator polynomials.
+ *
+ * Returns the number of errors L that sigma locates;
+ * sigma has degree L if they are correctable.
  */
 
-static void
+static int
 berlekamp_massey(const uint8_t *s, int N,
 	const struct galois_field *gf,
 	uint8_t *sigma)
@@ -254,6 +152,8 @@ berlekamp_massey(const uint8_t *s, int N,
 	}
 
 	memcpy(sigma, C, MAX_POLY);
+
+	return L;
 }
 
 /************************************************************************
@@ -262,43 +162,74 @@ berlekamp_massey(const uint8_t *s, int N,
  * Generator polynomial for GF(2^8) is x^8 + x^4 + x^3 + x^2 + 1
  */
 
+/*
+ * Syndromes s[i] = r(a^i) for i < npar of the received block r(x),
+ * whose highest-degree coefficient is data[0]. Each is evaluated by
+ * Horner's rule, s[i] = s[i] * a^i + c, and all npar are stepped together
+ * per byte so the block is read once. gf256_exp[] is doubled, so log + i
+ * needs no reduction.
+ */
 static int
 block_syndromes(const uint8_t *data, int bs, int npar, uint8_t *s)
 {
 	int nonzero = 0;
-	int i;
+	int i, j;
 
 	memset(s, 0, MAX_POLY);
 
-	for (i = 0; i < npar; i++) {
-		int j;
-
-		for (j = 0; j < bs; j++) {
-			uint8_t c = data[bs - j - 1];
+	for (j = 0; j < bs; j++) {
+		const uint8_t c = data[j];
 
-			if (!c)
-				continue;
+		for (i = 0; i < npar; i++) {
+			const uint8_t v = s[i];
 
-			s[i] ^= gf256_exp[((int) gf256_log[c] + i * j) % 255];
+			s[i] = (v ? gf256_exp[gf256_log[v] + i] : 0) ^ c;
 		}
+	}
 
-		if (s[i])
-			nonzero = 1;
+	for (i = 0; i < npar; i++) {
+		nonzero |= s[i];
 	}
 
-	return nonzero;
+	return nonzero != 0;
 }
 
+/*
+ * Remove a correction of e at x^pos from the syndromes, s[i] ^= e * a^(i * pos).
+ * Syndromes are linear in the received block, so after applying every
+ * correction they are those of the corrected block.
+ */
+static void
+syndromes_update(uint8_t *s, int npar, int pos, uint8_t e)
+{
+	int log_e = gf256_log[e];
+	int i;
+
+	if (!e)
+		return;
+
+	for (i = 0; i < npar; i++) {
+		s[i] ^= gf256_exp[log_e];
+
+		log_e += pos;
+		if (log_e >= 255)
+			log_e -= 255;
+	}
+}
+
+/*
+ * The error evaluator omega = s * sigma mod x^n.
+ */
 static void
 eloc_poly(uint8_t *omega,
 	const uint8_t *s, const uint8_t *sigma,
-	int npar)
+	int n)
 {
 	int i;
 
 	memset(omega, 0, MAX_POLY);
 
-	for (i = 0; i < npar; i++) {
+	for (i = 0; i < n; i++) {
 		const uint8_t a = sigma[i];
 		const uint8_t log_a = gf256_log[a];
 		int j;
@@ -306,30 +237,63 @@ eloc_poly(uint8_t *omega,
 		if (!a)
 			continue;
 
-		for (j = 0; j + 1 < MAX_POLY; j++) {
-			const uint8_t b = s[j + 1];
-
-			if (i + j >= npar)
-				break;
+		for (j = 0; i + j < n; j++) {
+			const uint8_t b = s[j];
 
 			if (!b)
 				continue;
 
-			omega[i + j] ^=
-			    gf256_exp[(log_a + gf256_log[b]) % 255];
+			omega[i + j] ^= gf256_exp[log_a + gf256_log[b]];
 		}
 	}
 }
 
+/*
+ * Evaluate p[0] + p[1] x + ... + p[n - 1] x^(n - 1) at x = a^log_x
+ * by Horner's rule, for log_x < 255.
+ */
+static uint8_t
+poly_eval_log(const uint8_t *p, int n, int log_x)
+{
+	uint8_t v = 0;
+	int k;
+
+	for (k = n - 1; k >= 0; k--)
+		v = (v ? gf256_exp[gf256_log[v] + log_x] : 0) ^ p[k];
+
+	return v;
+}
+
+/*
+ * Correct a block of ecc_bs codewords in place, ecc_dw of which are data.
+ * If erased is non-NULL, its nonzero bytes mark codewords known to be
+ * unreliable. These erasures are located in advance and cost one parity
+ * codeword each to correct, rather than two for errors found by searching:
+ * the block is correctable when 2 * errors + erasures <= ecc_bs - ecc_dw.
+ *
+ * The last spare parity codewords are kept unused, only to check the
+ * result, for guesses which would otherwise decode to a wrong codeword
+ * too often.
+ */
 static enum qr_decode
-correct_block(uint8_t *data, int ecc_bs, int ecc_dw, unsigned *corrections)
+correct_block(uint8_t *data, const uint8_t *erased,
+	int ecc_bs, int ecc_dw, int spare, unsigned *corrections)
 {
 	int npar = ecc_bs - ecc_dw;
+	int budget = npar - spare;
 	uint8_t s[MAX_POLY];
+	uint8_t t[MAX_POLY];
+	uint8_t gamma[MAX_POLY];
+	uint8_t lambda[MAX_POLY];
 	uint8_t sigma[MAX_POLY];
 	uint8_t sigma_deriv[MAX_POLY];
 	uint8_t omega[MAX_POLY];
-	int i;
+	int lg[MAX_POLY];
+	int pos[MAX_POLY];
+	uint8_t err[MAX_POLY];
+	int found;
+	int f, L, n;
+	int i, k;
 
 	*corrections = 0;
 
@@ -337,101 +301,185 @@ correct_block(uint8_t *data, int ecc_bs, int ecc_dw, unsigned *corrections)
 	if (!block_syndromes(data, ecc_bs, npar, s))
 		return QR_SUCCESS;
 
-	berlekamp_massey(s, npar, &gf256, sigma);
+	/*
+	 * Erasure locator gamma = prod (1 + a^pos x) over the erased codewords,
+	 * at x^pos counting from the end of the block. With more erasures
+	 * than the parity allows they locate nothing, and the block is
+	 * corrected for errors only.
+	 */
+	memset(gamma, 0, MAX_POLY);
+	gamma[0] = 1;
+	f = 0;
+	for (i = 0; erased != NULL && i < ecc_bs; i++) {
+		if (!erased[ecc_bs - i - 1])
+			continue;
+
+		if (++f > budget) {
+			memset(gamma, 0, MAX_POLY);
+			gamma[0] = 1;
+			f = 0;
+			break;
+		}
+
+		memcpy(t, gamma, MAX_POLY);
+		poly_add(gamma, t, gf256_exp[i], 1, &gf256);
+	}
+
+	/*
+	 * Forney syndromes: the coefficients from x^f of s * gamma, in which
+	 * the erasures cancel, leave npar - f syndromes of the errors alone.
+	 * The full locator sigma is the product of the two.
+	 */
+	if (f > 0) {
+		memset(t, 0, MAX_POLY);
+		for (i = 0; i <= f; i++)
+			poly_add(t, s, gamma[i], i, &gf256);
+
+		L = berlekamp_massey(t + f, npar - f, &gf256, lambda);
+		if (L * 2 > budget - f)
+			return QR_ERROR_DATA_ECC;
+
+		memset(sigma, 0, MAX_POLY);
+		for (i = 0; i <= L; i++)
+			poly_add(sigma, gamma, lambda[i], i, &gf256);
+	} else {
+		L = berlekamp_massey(s, npar, &gf256, sigma);
+		if (L * 2 > budget)
+			return QR_ERROR_DATA_ECC;
+	}
+
+	n = L + f;
 
 	/* Compute derivative of sigma */
 	memset(sigma_deriv, 0, MAX_POLY);
-	for (i = 0; i + 1 < MAX_POLY; i += 2)
+	for (i = 0; i + 1 <= n; i += 2)
 		sigma_deriv[i] = sigma[i + 1];
 
-	/* Compute error evaluator polynomial */
-	eloc_poly(omega, s, sigma, npar - 1);
+	/* Compute error evaluator polynomial, which has degree < n */
+	eloc_poly(omega, s, sigma, n);
 
-	/* Find error locations and magnitudes */
-	for (i = 0; i < ecc_bs; i++) {
-		uint8_t xinv = gf256_exp[255 - i];
+	/*
+	 * Chien search for the roots a^-i of sigma. Each term sigma[k] a^(-ik)
+	 * is kept as its logarithm and stepped by -k per position,
+	 * stopping once all n roots are found.
+	 */
+	for (k = 1; k <= n; k++)
+		lg[k] = gf256_log[sigma[k]];
 
-		if (!poly_eval(sigma, xinv, &gf256)) {
-			uint8_t sd_x = poly_eval(sigma_deriv, xinv, &gf256);
-			uint8_t omega_x = poly_eval(omega, xinv, &gf256);
-			uint8_t error = gf256_exp[(255 - gf256_log[sd_x] +
-						   gf256_log[omega_x]) % 255];
+	found = 0;
+	for (i = 0; i < ecc_bs && found < n; i++) {
+		uint8_t v = sigma[0];
 
-			(*corrections)++;
-			data[ecc_bs - i - 1] ^= error;
+		for (k = 1; k <= n; k++) {
+			if (!sigma[k])
+				continue;
+
+			v ^= gf256_exp[lg[k]];
+
+			lg[k] -= k;
+			if (lg[k] < 0)
+				lg[k] += 255;
 		}
+
+		if (!v)
+			pos[found++] = i;
 	}
 
-	if (block_syndromes(data, ecc_bs, npar, s))
+	/* A locator without n distinct roots in the block is uncorrectable */
+	if (found != n)
 		return QR_ERROR_DATA_ECC;
 
-	return QR_SUCCESS;
-}
+	/*
+	 * Forney: the magnitude at x^pos is a^pos omega(a^-pos) / sigma'(a^-pos),
+	 * evaluating only up to the degree n - 1. An erased codeword which
+	 * was read correctly has magnitude zero.
+	 */
+	for (k = 0; k < found; k++) {
+		int log_x = (255 - pos[k]) % 255;
+		uint8_t sd_x = poly_eval_log(sigma_deriv, n, log_x);
+		uint8_t omega_x = poly_eval_log(omega, n, log_x);
+		int log_e;
 
-/************************************************************************
- * Format value error correction
- *
- * Generator polynomial for GF(2^4) is x^4 + x + 1
- */
+		if (!sd_x)
+			return QR_ERROR_DATA_ECC;
 
-#define FORMAT_MAX_ERROR        3
-#define FORMAT_SYNDROMES        (FORMAT_MAX_ERROR * 2)
-#define FORMAT_BITS             15
+		if (!omega_x) {
+			err[k] = 0;
+			continue;
+		}
 
-static int
-format_syndromes(uint16_t u, uint8_t *s)
-{
-	int i;
-	int nonzero = 0;
+		log_e = gf256_log[omega_x] + pos[k];
+		if (log_e >= 255)
+			log_e -= 255;
 
-	memset(s, 0, MAX_POLY);
+		err[k] = gf256_exp[log_e + 255 - gf256_log[sd_x]];
+	}
 
-	for (i = 0; i < FORMAT_SYNDROMES; i++) {
-		int j;
+	for (k = 0; k < found; k++) {
+		if (!err[k])
+			continue;
 
-		s[i] = 0;
-		for (j = 0; j < FORMAT_BITS; j++)
-			if (u & (1 << j))
-				s[i] ^= gf16_exp[((i + 1) * j) % 15];
+		data[ecc_bs - pos[k] - 1] ^= err[k];
+		syndromes_update(s, npar, pos[k], err[k]);
+		(*corrections)++;
+	}
 
+	for (i = 0; i < npar; i++) {
 		if (s[i])
-			nonzero = 1;
+			return QR_ERROR_DATA_ECC;
 	}
 
-	return nonzero;
+	return QR_SUCCESS;
 }
 
-static enum qr_decode
-correct_format(uint16_t *f_ret, unsigned *corrections)
-{
-	uint16_t u = *f_ret;
-	int i;
-	uint8_t s[MAX_POLY];
-	uint8_t sigma[MAX_POLY];
+/************************************************************************
+ * Format and version information
+ *
+ * These are BCH codes of only 32 and 34 codewords, so rather than
+ * correcting them algebraically, the decoder takes the codeword nearest
+ * to what was read.
+ */
 
-	*corrections = 0;
+#define FORMAT_MAX_ERROR        3 /* BCH(15,5) has distance 7 */
+#define VERSION_MAX_ERROR       3 /* BCH(18,6) has distance 8 */
 
-	/* Evaluate U (received codeword) at each of alpha_1 .. alpha_6
-	 * to get S_1 .. S_6 (but we index them from 0).
-	 */
-	if (!format_syndromes(u, s))
-		return QR_SUCCESS;
+/* format bits before masking with 0x5412, indexed by their 5 data bits */
+static const uint32_t format_codewords[32] = {
+	0x0000, 0x0537, 0x0A6E, 0x0F59, 0x11EB, 0x14DC, 0x1B85, 0x1EB2,
+	0x23D6, 0x26E1, 0x29B8, 0x2C8F, 0x323D, 0x370A, 0x3853, 0x3D64,
+	0x429B, 0x47AC, 0x48F5, 0x4DC2, 0x5370, 0x5647, 0x591E, 0x5C29,
+	0x614D, 0x647A, 0x6B23, 0x6E14, 0x70A6, 0x7591, 0x7AC8, 0x7FFF
+};
 
-	berlekamp_massey(s, FORMAT_SYNDROMES, &gf16, sigma);
+/* version information for versions 7 to 40 */
+static const uint32_t version_codewords[QR_VER_MAX - 6] = {
+	0x07C94, 0x085BC, 0x09A99, 0x0A4D3, 0x0BBF6, 0x0C762, 0x0D847,
+	0x0E60D, 0x0F928, 0x10B78, 0x1145D, 0x12A17, 0x13532, 0x149A6,
+	0x15683, 0x168C9, 0x177EC, 0x18EC4, 0x191E1, 0x1AFAB, 0x1B08E,
+	0x1CC1A, 0x1D33F, 0x1ED75, 0x1F250, 0x209D5, 0x216F0, 0x228BA,
+	0x2379F, 0x24B0B, 0x2542E, 0x26A64, 0x27541, 0x28C69
+};
 
-	/* Now, find the roots of the polynomial */
-	for (i = 0; i < 15; i++) {
-		if (!poly_eval(sigma, gf16_exp[15 - i], &gf16)) {
-			(*corrections)++;
-			u ^= (1 << i);
+/*
+ * The index of the codeword nearest to u, and its Hamming distance.
+ */
+static size_t
+nearest_codeword(uint32_t u, const uint32_t *a, size_t n, unsigned *distance)
+{
+	size_t i, best = 0;
+
+	*distance = UINT_MAX;
+
+	for (i = 0; i < n; i++) {
+		unsigned d = popcount64(u ^ a[i]);
+
+		if (d < *distance) {
+			*distance = d;
+			best = i;
 		}
 	}
 
-	if (format_syndromes(u, s))
-		return QR_ERROR_FORMAT_ECC;
-
-	*f_ret = u;
-	return QR_SUCCESS;
+	return best;
 }
 
 /************************************************************************
@@ -453,14 +501,11 @@ ecl_decode(int e)
 	}
 }
 
-static enum qr_decode
-read_format(const struct qr *q,
-	struct qr_data *data, struct qr_stats *stats, int which)
+static uint16_t
+format_word(const struct qr *q, int which)
 {
-	int i;
 	uint16_t format = 0;
-	uint16_t fdata;
-	enum qr_decode err;
+	int i;
 
 	if (which) {
 		for (i = 0; i < 7; i++)
@@ -481,29 +526,268 @@ read_format(const struct qr *q,
 			format = (format << 1) | qr_get_module(q, xs[i], ys[i]);
 	}
 
-	format ^= 0x5412;
+	return format ^ 0x5412;
+}
 
-	stats->format_raw[which] = format;
+/*
+ * Read both copies of the format information, and take the one nearer
+ * to a valid format.
+ */
+static enum qr_decode
+read_format(const struct qr *q,
+	enum qr_ecl *ecl, enum qr_mask *mask, struct qr_stats *stats)
+{
+	unsigned d[2];
+	size_t fdata[2];
+	int which, best;
+
+	for (which = 0; which < 2; which++) {
+		stats->format_raw[which] = format_word(q, which);
+		fdata[which] = nearest_codeword(stats->format_raw[which],
+			format_codewords, 32, &d[which]);
+		stats->format_corrected[which] = format_codewords[fdata[which]];
+	}
 
-	err = correct_format(&format, &stats->format_corrections);
-	if (err)
-		return err;
+	best = d[1] < d[0];
+	stats->format_corrections = d[best];
 
-	stats->format_corrected[which] = format;
+	if (d[best] > FORMAT_MAX_ERROR)
+		return QR_ERROR_FORMAT_ECC;
 
-	fdata = format >> 10;
-	data->ecl = ecl_decode(fdata >> 3);
-	data->mask = fdata & 7;
+	*ecl = ecl_decode(fdata[best] >> 3);
+	*mask = fdata[best] & 7;
 
 	return QR_SUCCESS;
 }
 
+/*
+ * Read both copies of the version information of version 7 and up,
+ * as draw_white_function_modules() draws them, the least significant bit
+ * first. Returns the version nearer to either, or 0 if neither is within
+ * VERSION_MAX_ERROR bits of a valid version. Where both are equally near,
+ * a version matching the grid size is preferred.
+ */
+static unsigned
+read_version(const struct qr *q, struct qr_stats *stats)
+{
+	unsigned d[2];
+	size_t v[2];
+	int which, best;
+
+	stats->version_raw[0] = stats->version_raw[1] = 0;
+	stats->version_corrected[0] = stats->version_corrected[1] = 0;
+	stats->version_corrections = 0;
+
+	if (q->size < QR_SIZE(7))
+		return 0;
+
+	for (which = 0; which < 2; which++) {
+		uint32_t u = 0;
+		int i, j;
+
+		for (i = 5; i >= 0; i--) {
+			for (j = 2; j >= 0; j--) {
+				unsigned k = q->size - 11 + j;
+
+				u = (u << 1) | (which ? qr_get_module(q, i, k) : qr_get_module(q, k, i));
+			}
+		}
+
+		stats->version_raw[which] = u;
+		v[which] = nearest_codeword(u, version_codewords, QR_VER_MAX - 6, &d[which]);
+		stats->version_corrected[which] = version_codewords[v[which]];
+	}
+
+	best = d[1] < d[0] || (d[1] == d[0] && 7 + v[1] == QR_VER(q->size));
+	stats->version_corrections = d[best];
+
+	if (d[best] > VERSION_MAX_ERROR)
+		return 0;
+
+	return 7 + v[best];
+}
+
+/* the most blocks in any symbol (version 40-H) */
+#define ECC_BLOCKS_MAX 81
+
+/* fewest blocks for which codestream_ecc() uses a thread pool */
+#define ECC_POOL_MIN 8
+
+/* least reliable codewords per block which soft decoding tries flipping */
+#define CHASE_FLIPS 3
+
+/* parity codewords per block which soft decoding keeps to check its guesses */
+#define SOFT_SPARE 2
+
+/*
+ * Per raw codeword, how far its least reliable module's sample is from the
+ * threshold, and the bit of that module, 0 being the most significant.
+ */
+struct soft {
+	uint8_t conf[QR_BUF_LEN_MAX];
+	uint8_t weak[QR_BUF_LEN_MAX];
+};
+
+/*
+ * The blocks of one symbol, for correcting them independently.
+ */
+struct ecc_blocks {
+	const uint8_t *raw;
+	const uint8_t *erased; /* codewords aligned with raw, or NULL */
+	const struct soft *soft; /* or NULL */
+	uint8_t *corrected;
+	int bc;
+	int numShortBlocks;
+	int shortBlockDataLen;
+	int ecc_bs;
+	int ecc_offset;
+
+	unsigned corrections[ECC_BLOCKS_MAX];
+	enum qr_decode err[ECC_BLOCKS_MAX];
+};
+
+/*
+ * Deinterleave block i from the codewords src, aligned with the raw stream.
+ */
+static void
+block_gather(const struct ecc_blocks *b, int i, const uint8_t *src, uint8_t *dst)
+{
+	const int lb = i >= b->numShortBlocks;
+	const int dw = b->shortBlockDataLen + lb;
+	const int num_ec = b->ecc_bs - b->shortBlockDataLen;
+	int j;
+
+	/* The extra data byte of each long block follows the last full row */
+	for (j = 0; j < b->shortBlockDataLen; j++)
+		dst[j] = src[j * b->bc + i];
+	if (lb)
+		dst[j] = src[j * b->bc + i - b->numShortBlocks];
+	for (j = 0; j < num_ec; j++)
+		dst[dw + j] = src[b->ecc_offset + j * b->bc + i];
+}
+
+/*
+ * After correct_block() fails, guess at the errors of a block from the
+ * reliability of its codewords, and correct again: first a Chase-style list
+ * flipping the weakest bit of each combination of the CHASE_FLIPS least
+ * reliable codewords, then erasing successively fewer of the least reliable
+ * codewords (generalised minimum distance decoding). Each guess keeps
+ * SOFT_SPARE parity codewords to check it.
+ */
 static enum qr_decode
-codestream_ecc(struct qr_data *data, struct qr_stats *stats)
+correct_soft(uint8_t *data, const uint8_t *erased,
+	const uint8_t *conf, const uint8_t *weak,
+	int ecc_bs, int ecc_dw, unsigned *corrections)
 {
-	const int blockEccLen = ECL_CODEWORDS_PER_BLOCK[stats->ver][data->ecl];
+	const int npar = ecc_bs - ecc_dw;
+	int order[MAX_POLY];
+	uint8_t guess[256];
+	uint8_t e[256];
+	unsigned c;
+	int i, j, h, f;
+
+	assert(npar >= CHASE_FLIPS && npar < MAX_POLY);
+
+	/* The npar least reliable codewords, least first */
+	for (i = 0; i < npar; i++) {
+		int k = -1;
+
+		for (j = 0; j < ecc_bs; j++) {
+			int l;
+
+			for (l = 0; l < i; l++) {
+				if (order[l] == j)
+					break;
+			}
+
+			if (l < i)
+				continue;
+
+			if (k == -1 || conf[j] < conf[k])
+				k = j;
+		}
+
+		order[i] = k;
+	}
+
+	for (h = 1; h < 1 << CHASE_FLIPS; h++) {
+		memcpy(guess, data, ecc_bs);
+		for (i = 0; i < CHASE_FLIPS; i++) {
+			if (h & (1 << i))
+				guess[order[i]] ^= 0x80 >> weak[order[i]];
+		}
+
+		if (!correct_block(guess, erased, ecc_bs, ecc_dw, SOFT_SPARE, &c))
+			goto found;
+	}
+
+	for (f = npar - SOFT_SPARE; f > 0; f -= 2) {
+		if (erased != NULL)
+			memcpy(e, erased, ecc_bs);
+		else
+			memset(e, 0, ecc_bs);
+		for (i = 0; i < f; i++)
+			e[order[i]] = 1;
+
+		memcpy(guess, data, ecc_bs);
+		if (!correct_block(guess, e, ecc_bs, ecc_dw, SOFT_SPARE, &c))
+			goto found;
+	}
+
+	return QR_ERROR_DATA_ECC;
+
+found:
+
+	*corrections = 0;
+	for (i = 0; i < ecc_bs; i++) {
+		if (guess[i] != data[i])
+			(*corrections)++;
+	}
+
+	memcpy(data, guess, ecc_bs);
+
+	return QR_SUCCESS;
+}
+
+static void
+ecc_block(void *opaque, size_t n)
+{
+	struct ecc_blocks *b = opaque;
+	const int i = n;
+	const int lb = i >= b->numShortBlocks;
+	const int dw = b->shortBlockDataLen + lb;
+	const int bs = b->ecc_bs + lb;
+	uint8_t block[256];
+	uint8_t erased[256];
+
+	block_gather(b, i, b->raw, block);
+	if (b->erased != NULL)
+		block_gather(b, i, b->erased, erased);
+
+	b->err[i] = correct_block(block, b->erased != NULL ? erased : NULL,
+		bs, dw, 0, &b->corrections[i]);
+
+	if (b->err[i] && b->soft != NULL) {
+		uint8_t conf[256];
+		uint8_t weak[256];
+
+		block_gather(b, i, b->soft->conf, conf);
+		block_gather(b, i, b->soft->weak, weak);
+
+		b->err[i] = correct_soft(block, b->erased != NULL ? erased : NULL,
+			conf, weak, bs, dw, &b->corrections[i]);
+	}
+
+	memcpy(b->corrected + i * b->shortBlockDataLen + (lb ? i - b->numShortBlocks : 0), block, dw);
+}
+
+static enum qr_decode
+codestream_ecc(enum qr_ecl ecl, struct qr_stats *stats, const uint8_t *erased,
+	const struct soft *soft, struct qr_pool *pool)
+{
+	const int blockEccLen = ECL_CODEWORDS_PER_BLOCK[stats->ver][ecl];
 	const int rawCodewords = count_data_bits(stats->ver) / 8;
-	const int numBlocks = NUM_ERROR_CORRECTION_BLOCKS[stats->ver][data->ecl];
+	const int numBlocks = NUM_ERROR_CORRECTION_BLOCKS[stats->ver][ecl];
 	const int numShortBlocks = numBlocks - rawCodewords % numBlocks;
 	const int ecc_bs = rawCodewords / numBlocks;
 	const int shortBlockDataLen = ecc_bs - blockEccLen;
@@ -511,52 +795,43 @@ codestream_ecc(struct qr_data *data, struct qr_stats *stats)
 	const int lb_count = numBlocks - numShortBlocks;
 	const int bc = lb_count + numShortBlocks;
 	const int ecc_offset = shortBlockDataLen * bc + lb_count;
-	int dst_offset = 0;
+	struct ecc_blocks b;
 	int i;
 
+	assert(bc <= ECC_BLOCKS_MAX);
+
 	stats->ecc.bits = stats->raw.bits - ecc_offset * 8;
 	memcpy(stats->ecc.data, stats->raw.data + ecc_offset, BM_LEN(stats->ecc.bits));
 
-	struct qr_rs_params {
-		int bs; /* Small block size */
-		int dw; /* Small data words */
-	};
+	b.raw = stats->raw.data;
+	b.erased = erased;
+	b.soft = soft;
+	b.corrected = stats->corrected.data;
+	b.bc = bc;
+	b.numShortBlocks = numShortBlocks;
+	b.shortBlockDataLen = shortBlockDataLen;
+	b.ecc_bs = ecc_bs;
+	b.ecc_offset = ecc_offset;
 
-	struct qr_rs_params sb_ecc;
-	sb_ecc.bs = ecc_bs;
-	sb_ecc.dw = shortBlockDataLen;
-
-	struct qr_rs_params lb_ecc;
-	lb_ecc.bs = ecc_bs + 1;
-	lb_ecc.dw = shortBlockDataLen + 1;
+	/* Waking the pool costs more than correcting the blocks of small symbols */
+	qr_pool_run(bc >= ECC_POOL_MIN ? pool : NULL, bc, ecc_block, &b);
 
+	stats->codeword_corrections = 0;
 	for (i = 0; i < bc; i++) {
-		uint8_t *dst = stats->corrected.data + dst_offset;
-		const struct qr_rs_params *ecc = (i < numShortBlocks) ? &sb_ecc : &lb_ecc;
-		const int num_ec = ecc_bs - ecc->dw;
-		enum qr_decode err;
-		int j;
-
-		for (j = 0; j < ecc->dw; j++)
-			dst[j] = stats->raw.data[j * bc + i];
-		for (j = 0; j < num_ec; j++)
-			dst[ecc->dw + j] = stats->raw.data[ecc_offset + j * bc + i];
-
-		err = correct_block(dst, ecc->bs, ecc->dw, &stats->codeword_corrections);
-		if (err)
-			return err;
+		if (b.err[i])
+			return b.err[i];
 
-		dst_offset += ecc->dw;
+		stats->codeword_corrections += b.corrections[i];
 	}
 
-	stats->corrected.bits = dst_offset * 8;
+	stats->corrected.bits = ecc_offset * 8;
 
 	return QR_SUCCESS;
 }
 
 static int
 tuple(char *s,
-	struct qr_bytes *ds, size_t *ds_ptr,
+	struct bit_reader *r,
 	size_t bits, int digits,
 	const char *charset)
 {
@@ -569,10 +844,10 @@ tuple(char *s,
 
 	n = strlen(charset);
 
-	if (ds->bits - *ds_ptr < bits)
+	if (r->bits - r->pos < bits)
 		return -1;
 
-	tuple = take_bits(ds->data, ds->bits, bits, ds_ptr);
+	tuple = bit_reader_take(r, bits);
 
 	for (i = 0; i < digits; i++) {
 		s[digits - i - 1] = charset[tuple % n];
@@ -582,57 +857,60 @@ tuple(char *s,
 	return 0;
 }
 
+/*
+ * Each of the decoders below reads the character count and characters of one
+ * segment, writing the characters to s[0 : cap] (without a terminating nul)
+ * and their number of bytes to *len.
+ */
+
 static enum qr_decode
-decode_numeric(unsigned ver, struct qr_segment *seg,
-	struct qr_bytes *ds, size_t *ds_ptr)
+decode_numeric(unsigned ver, char *s, size_t cap, size_t *len,
+	struct bit_reader *r)
 {
 	static const char *numeric_map =
 		"0123456789";
 
 	size_t bits = 14;
 	size_t count;
-	size_t len;
 
 	if (ver < 10)
 		bits = 10;
 	else if (ver < 27)
 		bits = 12;
 
-	count = take_bits(ds->data, ds->bits, bits, ds_ptr);
-	if ((size_t) count > sizeof seg->u.s - 1)
+	count = bit_reader_take(r, bits);
+	if ((size_t) count > cap)
 		return QR_ERROR_DATA_OVERFLOW;
 
-	len = 0;
+	*len = 0;
 
 	while (count >= 3) {
-		if (tuple(seg->u.s + len, ds, ds_ptr, 10, 3, numeric_map) < 0)
+		if (tuple(s + *len, r, 10, 3, numeric_map) < 0)
 			return QR_ERROR_DATA_UNDERFLOW;
-		len += 3;
+		*len += 3;
 		count -= 3;
 	}
 
 	if (count >= 2) {
-		if (tuple(seg->u.s + len, ds, ds_ptr, 7, 2, numeric_map) < 0)
+		if (tuple(s + *len, r, 7, 2, numeric_map) < 0)
 			return QR_ERROR_DATA_UNDERFLOW;
-		len += 2;
+		*len += 2;
 		count -= 2;
 	}
 
 	if (count) {
-		if (tuple(seg->u.s + len, ds, ds_ptr, 4, 1, numeric_map) < 0)
+		if (tuple(s + *len, r, 4, 1, numeric_map) < 0)
 			return QR_ERROR_DATA_UNDERFLOW;
-		len += 1;
+		*len += 1;
 		count--;
 	}
 
-	seg->u.s[len] = '\0';
-
 	return QR_SUCCESS;
 }
 
 static enum qr_decode
-decode_alnum(unsigned ver, struct qr_segment *seg,
-	struct qr_bytes *ds, size_t *ds_ptr)
+decode_alnum(unsigned ver, char *s, size_t cap, size_t *len,
+	struct bit_reader *r)
 {
 	static const char *alpha_map =
 		"0123456789"
@@ -641,88 +919,79 @@ decode_alnum(unsigned ver, struct qr_segment *seg,
 
 	size_t bits = 13;
 	size_t count;
-	size_t len;
 
 	if (ver < 10)
 		bits = 9;
 	else if (ver < 27)
 		bits = 11;
 
-	count = take_bits(ds->data, ds->bits, bits, ds_ptr);
-	if ((size_t) count > sizeof seg->u.s - 1)
+	count = bit_reader_take(r, bits);
+	if ((size_t) count > cap)
 		return QR_ERROR_DATA_OVERFLOW;
 
-	len = 0;
+	*len = 0;
 
 	while (count >= 2) {
-		if (tuple(seg->u.s + len, ds, ds_ptr, 11, 2, alpha_map) < 0)
+		if (tuple(s + *len, r, 11, 2, alpha_map) < 0)
 			return QR_ERROR_DATA_UNDERFLOW;
-		len += 2;
+		*len += 2;
 		count -= 2;
 	}
 
 	if (count) {
-		if (tuple(seg->u.s + len, ds, ds_ptr, 6, 1, alpha_map) < 0)
+		if (tuple(s + *len, r, 6, 1, alpha_map) < 0)
 			return QR_ERROR_DATA_UNDERFLOW;
-		len += 1;
+		*len += 1;
 		count--;
 	}
 
-	seg->u.s[len] = '\0';
-
 	return QR_SUCCESS;
 }
 
 static enum qr_decode
-decode_byte(unsigned ver, struct qr_segment *seg,
-	struct qr_bytes *ds, size_t *ds_ptr)
+decode_byte(unsigned ver, char *s, size_t cap, size_t *len,
+	struct bit_reader *r)
 {
 	size_t bits = 16;
-	size_t count, i;
-	size_t len;
+	size_t count;
 
 	if (ver < 10)
 		bits = 8;
 
-	count = take_bits(ds->data, ds->bits, bits, ds_ptr);
-	if ((size_t) count > sizeof seg->u.m.data)
+	count = bit_reader_take(r, bits);
+	if ((size_t) count > cap)
 		return QR_ERROR_DATA_OVERFLOW;
-	if (ds->bits - *ds_ptr < count * 8)
+	if (r->bits - r->pos < count * 8)
 		return QR_ERROR_DATA_UNDERFLOW;
 
-	len = 0;
-
-	for (i = 0; i < count; i++)
-		seg->u.m.data[len++] = take_bits(ds->data, ds->bits, 8, ds_ptr);
-
-	seg->u.m.bits = len * 8;
+	bit_reader_span(r, s, count * 8);
+	*len = count;
 
 	return QR_SUCCESS;
 }
 
 static enum qr_decode
-decode_kanji(unsigned ver, struct qr_segment *seg,
-	struct qr_bytes *ds, size_t *ds_ptr)
+decode_kanji(unsigned ver, char *s, size_t cap, size_t *len,
+	struct bit_reader *r)
 {
 	size_t bits = 12;
 	size_t count, i;
-	size_t len;
 
 	if (ver < 10)
 		bits = 8;
 	else if (ver < 27)
 		bits = 10;
 
-	count = take_bits(ds->data, ds->bits, bits, ds_ptr);
-	if ((size_t) count * 2 > sizeof seg->u.s - 1)
+	count = bit_reader_take(r, bits);
+	if ((size_t) count * 2 > cap)
 		return QR_ERROR_DATA_OVERFLOW;
-	if (ds->bits - *ds_ptr < count * 13)
+	if (r->bits - r->pos < count * 13)
 		return QR_ERROR_DATA_UNDERFLOW;
 
-	len = 0;
+	*len = 0;
 
 	for (i = 0; i < count; i++) {
-		int d = take_bits(ds->data, ds->bits, 13, ds_ptr);
+		int d = bit_reader_take(r, 13);
 		int msB = d / 0xc0;
 		int lsB = d % 0xc0;
 		int intermediate = (msB << 8) | lsB;
@@ -736,137 +1005,246 @@ decode_kanji(unsigned ver, struct qr_segment *seg,
 			sjw = intermediate + 0xc140;
 		}
 
-		seg->u.s[len++] = sjw >> 8;
-		seg->u.s[len++] = sjw & 0xff;
+		s[(*len)++] = sjw >> 8;
+		s[(*len)++] = sjw & 0xff;
 	}
 
-	seg->u.s[len] = '\0';
-
 	return QR_SUCCESS;
 }
 
 static enum qr_decode
-decode_eci(struct qr_segment *seg,
-	struct qr_bytes *ds, size_t *ds_ptr)
+decode_eci(enum eci *eci,
+	struct bit_reader *r)
 {
-	unsigned eci;
+	unsigned v;
 
-	if (ds->bits - *ds_ptr < 8)
+	if (r->bits - r->pos < 8)
 		return QR_ERROR_DATA_UNDERFLOW;
 
-	eci = take_bits(ds->data, ds->bits, 8, ds_ptr);
+	v = bit_reader_take(r, 8);
 
-	if ((eci & 0xc0) == 0x80) {
-		if (ds->bits - *ds_ptr < 8)
+	if ((v & 0xc0) == 0x80) {
+		if (r->bits - r->pos < 8)
 			return QR_ERROR_DATA_UNDERFLOW;
 
-		eci = (eci << 8) | take_bits(ds->data, ds->bits, 8, ds_ptr);
-	} else if ((eci & 0xe0) == 0xc0) {
-		if (ds->bits - *ds_ptr < 16)
+		v = ((v & 0x3f) << 8) | bit_reader_take(r, 8);
+	} else if ((v & 0xe0) == 0xc0) {
+		if (r->bits - r->pos < 16)
 			return QR_ERROR_DATA_UNDERFLOW;
 
-		eci = (eci << 16) | take_bits(ds->data, ds->bits, 16, ds_ptr);
+		v = ((v & 0x1f) << 16) | bit_reader_take(r, 16);
 	}
 
-	seg->u.eci = eci;
+	*eci = v;
 
 	return QR_SUCCESS;
 }
 
+/*
+ * Decodes the next segment into seg, with its characters written
+ * to s[0 : cap]. A mode of 0 is the terminator, which ends the segments.
+ * seg->offset is left for the caller.
+ */
+static enum qr_decode
+decode_segment(unsigned ver, struct qr_segment_view *seg, char *s, size_t cap,
+	struct bit_reader *r)
+{
+	seg->mode = bit_reader_take(r, 4);
+	seg->eci  = ECI_DEFAULT;
+	seg->len  = 0;
+
+	if (seg->mode == 0x0)
+		return QR_SUCCESS;
+
+	switch (seg->mode) {
+	case QR_MODE_NUMERIC: return decode_numeric(ver, s, cap, &seg->len, r);
+	case QR_MODE_ALNUM:   return decode_alnum  (ver, s, cap, &seg->len, r);
+	case QR_MODE_BYTE:    return decode_byte   (ver, s, cap, &seg->len, r);
+	case QR_MODE_KANJI:   return decode_kanji  (ver, s, cap, &seg->len, r);
+	case QR_MODE_ECI:     return decode_eci    (&seg->eci, r);
+
+	default:
+		return QR_ERROR_INVALID_MODE;
+	}
+}
+
+/*
+ * Checks the bits after the terminator: zeros up to a byte boundary,
+ * followed by the alternating pad bytes.
+ */
+static enum qr_decode
+decode_padding(struct bit_reader *r, struct qr_bytes *padding)
+{
+	padding->bits = 0;
+
+	/* pad up to a byte with zero bits */
+	while ((r->pos & 7) != 0) {
+		int z;
+
+		z = bit_reader_take(r, 1);
+		if (z != 0)
+			return QR_ERROR_INVALID_PADDING;
+
+		append_bit(z, padding->data, &padding->bits);
+	}
+
+	/* pad with alternating bytes */
+	for (uint8_t padByte = 0xEC; r->pos < r->bits; padByte ^= 0xEC ^ 0x11) {
+		int z;
+
+		z = bit_reader_take(r, 8);
+		if (z != padByte)
+			return QR_ERROR_INVALID_PADDING;
+
+		append_bits(z, 8, padding->data, &padding->bits);
+	}
+
+	return QR_SUCCESS;
+}
+
+/*
+ * Frees the segments of a successful qr_decode().
+ */
+void
+qr_data_free(struct qr_data *data)
+{
+	for (size_t i = 0; i < data->n; i++)
+		free(data->a[i]);
+	free(data->a);
+
+	data->n = 0;
+	data->a = NULL;
+}
+
+/*
+ * Decodes the segments to a newly-allocated struct qr_segment each.
+ */
 static enum qr_decode
 decode_payload(struct qr_data *data, unsigned ver,
-	struct qr_bytes *ds, struct qr_bytes *padding, size_t *ds_ptr)
+	const struct qr_bytes *ds, struct qr_bytes *padding)
 {
+	struct bit_reader r;
+	enum qr_decode err;
+
+	bit_reader_init(&r, ds->data, ds->bits, 0);
+
 	data->n = 0;
 	data->a = NULL;
 
-	while (ds->bits - *ds_ptr >= 4) {
+	while (r.bits - r.pos >= 4) {
+		char s[QR_PAYLOAD_MAX];
+		struct qr_segment_view v;
+		struct qr_segment *seg;
+		size_t start;
 		void *tmp;
 
-		enum qr_decode err = QR_SUCCESS;
-		enum qr_mode mode = take_bits(ds->data, ds->bits, 4, ds_ptr);
+		start = r.pos;
 
-		/* XXX */
-		tmp = realloc(data->a, sizeof *data->a * (data->n + 1));
-		if (tmp == NULL) {
-			free(data->a);
-			return QR_ERROR_DATA_OVERFLOW; // XXX
-		}
-		data->a = tmp;
+		err = decode_segment(ver, &v, s, sizeof s, &r);
+		if (err)
+			goto error;
 
-		size_t i = data->n;
+		if (v.mode == 0)
+			break;
 
-		data->a[i] = malloc(sizeof *data->a[i]);
-		if (data->a[i] == NULL) {
-			free(data->a);
-			return QR_ERROR_DATA_OVERFLOW; // XXX
+		/* the encoded data follows the mode and character count indicators */
+		start += 4 + count_char_bits(v.mode, ver);
+
+		seg = seg_alloc(v.mode, v.len, r.pos - start);
+		if (seg == NULL) {
+			err = QR_ERROR_DATA_OVERFLOW; // XXX
+			goto error;
 		}
 
-		data->a[i]->mode   = mode;
-		(void) data->a[i]->m.data; // TODO: populate from ds
-		data->a[i]->m.bits = 0;    // TODO: populate from ds
+		seg->eci = v.eci;
+		memcpy(seg->s, s, v.len);
+
+		struct bit_reader c;
+		bit_reader_init(&c, ds->data, ds->bits, start);
+		bit_reader_span(&c, QR_SEG_DATA(seg), seg->bits);
 
-		if (mode == 0x0) {
-			goto done;
+		tmp = realloc(data->a, sizeof *data->a * (data->n + 1));
+		if (tmp == NULL) {
+			free(seg);
+			err = QR_ERROR_DATA_OVERFLOW; // XXX
+			goto error;
 		}
+		data->a = tmp;
 
-		switch (mode) {
-		case QR_MODE_NUMERIC: err = decode_numeric(ver, data->a[i], ds, ds_ptr); break;
-		case QR_MODE_ALNUM:   err = decode_alnum  (ver, data->a[i], ds, ds_ptr); break;
-		case QR_MODE_BYTE:    err = decode_byte   (ver, data->a[i], ds, ds_ptr); break;
-		case QR_MODE_KANJI:   err = decode_kanji  (ver, data->a[i], ds, ds_ptr); break;
-		case QR_MODE_ECI:     err = decode_eci    (     data->a[i], ds, ds_ptr); break;
+		data->a[data->n++] = seg;
+	}
 
-		default:
-			free(data->a);
-			return QR_ERROR_INVALID_MODE; // XXX
-		}
+	err = decode_padding(&r, padding);
+	if (err)
+		goto error;
 
-		if (err)
-			return err;
+	return QR_SUCCESS;
 
-		data->n++;
-	}
+error:
 
-done:
+	qr_data_free(data);
 
-	padding->bits = 0;
+	return err;
+}
 
-	/* pad up to a byte with zero bits */
-	while ((*ds_ptr & 7) != 0) {
-		int z;
+/*
+ * Decodes the segments to views into the caller's storage.
+ */
+static enum qr_decode
+decode_views(struct qr_views *views, unsigned ver,
+	const struct qr_bytes *ds, struct qr_bytes *padding)
+{
+	struct bit_reader r;
+	enum qr_decode err;
 
-		z = take_bits(ds->data, ds->bits, 1, ds_ptr);
-		if (z != 0) {
-			free(data->a);
-			return QR_ERROR_INVALID_PADDING; // XXX
-		}
+	bit_reader_init(&r, ds->data, ds->bits, 0);
 
-		append_bit(z, padding->data, &padding->bits);
-	}
+	views->n = 0;
+	views->payload_len = 0;
 
-	/* pad with alternating bytes */
-	for (uint8_t padByte = 0xEC; *ds_ptr < ds->bits; padByte ^= 0xEC ^ 0x11) {
-		int z;
+	while (r.bits - r.pos >= 4) {
+		struct qr_segment_view v;
 
-		z = take_bits(ds->data, ds->bits, 8, ds_ptr);
-		if (z != padByte) {
-			free(data->a);
-			return QR_ERROR_INVALID_PADDING; // XXX
-		}
+		err = decode_segment(ver, &v,
+			views->payload + views->payload_len, views->payload_max - views->payload_len,
+			&r);
+		if (err)
+			return err;
 
-		append_bits(z, 8, padding->data, &padding->bits);
+		if (v.mode == 0)
+			break;
+
+		if (views->n == views->max)
+			return QR_ERROR_DATA_OVERFLOW;
+
+		v.offset = views->payload_len;
+		views->payload_len += v.len;
+		views->a[views->n++] = v;
 	}
 
-	return QR_SUCCESS;
+	return decode_padding(&r, padding);
 }
 
 enum qr_decode
 qr_decode(const struct qr *q,
 	struct qr_data *data, struct qr_stats *stats,
 	void *tmp)
+{
+	return qr_decode_opt(q, NULL, data, stats, tmp);
+}
+
+/*
+ * Everything up to the corrected data codewords in stats->corrected.
+ * With soft non-NULL, blocks which fail to correct are retried by guessing
+ * from the reliability of their codewords; see correct_soft().
+ */
+static enum qr_decode
+decode_codewords(const struct qr *q, const struct qr_options *opt,
+	const struct soft *soft, enum qr_ecl *ecl, enum qr_mask *mask, struct qr_stats *stats,
+	void *tmp)
 {
 	enum qr_decode err;
+	unsigned v;
 
 	if ((q->size - 17) % 4)
 		return QR_ERROR_INVALID_GRID_SIZE;
@@ -876,10 +1254,17 @@ qr_decode(const struct qr *q,
 	if (stats->ver < QR_VER_MIN || stats->ver > QR_VER_MAX)
 		return QR_ERROR_INVALID_VERSION;
 
-	/* Read format information -- try both locations */
-	err = read_format(q, data, stats, 0);
-	if (err)
-		err = read_format(q, data, stats, 1);
+	/*
+	 * The version blocks lie against the finder patterns, so they read
+	 * the same when a grid is sampled at the wrong size. Rather than
+	 * failing later with ECC errors, report the mismatch, and the version
+	 * to sample at instead is in stats->version_corrected[].
+	 */
+	v = read_version(q, stats);
+	if (v != 0 && v != stats->ver)
+		return QR_ERROR_VERSION_MISMATCH;
+
+	err = read_format(q, ecl, mask, stats);
 	if (err)
 		return err;
 
@@ -888,18 +1273,146 @@ qr_decode(const struct qr *q,
 	qtmp.map  = tmp;
 	qtmp.size = q->size;
 	memcpy(tmp, q->map, QR_BUF_LEN(stats->ver));
-	qr_apply_mask(&qtmp, data->mask); // Undoes the mask due to XOR
+	qr_apply_mask(&qtmp, *mask); // Undoes the mask due to XOR
 
 	read_data(&qtmp, stats->raw.data, &stats->raw.bits);
-	err = codestream_ecc(data, stats);
+
+	if (opt == NULL)
+		return codestream_ecc(*ecl, stats, NULL, soft, NULL);
+
+	if (opt->erasures == NULL)
+		return codestream_ecc(*ecl, stats, NULL, soft, opt->pool);
+
+	/*
+	 * The erasure bitmap is read in the same order as the modules, so that
+	 * each codeword with any marked module comes out nonzero.
+	 */
+	uint8_t erased[QR_BUF_LEN_MAX];
+	size_t bits;
+
+	qtmp.map = (uint8_t *) opt->erasures;
+	read_data(&qtmp, erased, &bits);
+
+	return codestream_ecc(*ecl, stats, erased, soft, opt->pool);
+}
+
+/*
+ * As qr_decode(), with the given options, which may be NULL.
+ */
+enum qr_decode
+qr_decode_opt(const struct qr *q, const struct qr_options *opt,
+	struct qr_data *data, struct qr_stats *stats,
+	void *tmp)
+{
+	enum qr_decode err;
+
+	data->n = 0;
+	data->a = NULL;
+
+	err = decode_codewords(q, opt, NULL, &data->ecl, &data->mask, stats, tmp);
 	if (err)
 		return err;
 
-	size_t ds_ptr = 0;
-	err = decode_payload(data, stats->ver, &stats->corrected, &stats->padding, &ds_ptr);
+	return decode_payload(data, stats->ver, &stats->corrected, &stats->padding);
+}
+
+/*
+ * As qr_decode_opt(), but decoding into the caller's storage in views
+ * instead of allocating segments; see struct qr_views. This does not
+ * allocate memory.
+ */
+enum qr_decode
+qr_decode_views(const struct qr *q, const struct qr_options *opt,
+	struct qr_views *views, struct qr_stats *stats,
+	void *tmp)
+{
+	enum qr_decode err;
+
+	assert(views != NULL);
+	assert(views->payload != NULL || views->payload_max == 0);
+	assert(views->a != NULL || views->max == 0);
+
+	views->n = 0;
+	views->payload_len = 0;
+
+	err = decode_codewords(q, opt, NULL, &views->ecl, &views->mask, stats, tmp);
 	if (err)
 		return err;
 
-	return QR_SUCCESS;
+	return decode_views(views, stats->ver, &stats->corrected, &stats->padding);
 }
 
+struct soft_walk {
+	const uint8_t *y;
+	size_t stride;
+	size_t size;
+	struct soft *soft;
+};
+
+static void
+soft_bit(void *opaque, size_t i, size_t module)
+{
+	struct soft_walk *w = opaque;
+	const uint8_t v = w->y[module / w->size * w->stride + module % w->size];
+	const uint8_t c = v >= 128 ? v - 128 : 127 - v;
+
+	if (c < w->soft->conf[i / 8]) {
+		w->soft->conf[i / 8] = c;
+		w->soft->weak[i / 8] = i % 8;
+	}
+}
+
+/*
+ * As qr_decode_opt(), but from an 8-bit sample of each module, in size rows
+ * of size samples each stride bytes apart, where 255 is a dark module and 0
+ * a light one, as for the luma plane from qr_yv12(). Samples are read as
+ * dark from 128. Reed-Solomon blocks which do not correct are then retried,
+ * guessing at their errors from the codewords whose samples are nearest the
+ * threshold, so that marginal captures can decode in one pass.
+ */
+enum qr_decode
+qr_decode_soft(const uint8_t *y, size_t stride, size_t size,
+	const struct qr_options *opt,
+	struct qr_data *data, struct qr_stats *stats,
+	void *tmp)
+{
+	struct soft soft;
+	struct qr q;
+	uint8_t map[QR_BUF_LEN_MAX];
+	enum qr_decode err;
+	size_t i, j;
+
+	assert(y != NULL);
+	assert(stride >= size);
+
+	data->n = 0;
+	data->a = NULL;
+
+	if ((size - 17) % 4)
+		return QR_ERROR_INVALID_GRID_SIZE;
+
+	if (QR_VER(size) < QR_VER_MIN || QR_VER(size) > QR_VER_MAX)
+		return QR_ERROR_INVALID_VERSION;
+
+	q.size = size;
+	q.map = map;
+	memset(map, 0, QR_BUF_LEN(QR_VER(size)));
+
+	for (i = 0; i < size; i++) {
+		for (j = 0; j < size; j++) {
+			if (y[i * stride + j] >= 128)
+				BM_SET(map, i * size + j);
+		}
+	}
+
+	struct soft_walk w = { y, stride, size, &soft };
+
+	memset(soft.conf, 0xff, sizeof soft.conf);
+	placement_walk(QR_VER(size), soft_bit, &w);
+
+	err = decode_codewords(&q, opt, &soft, &data->ecl, &data->mask, stats, tmp);
+	if (err)
+		return err;
+
+	return decode_payload(data, stats->ver, &stats->corrected, &stats->padding);
+}
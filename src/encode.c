@@ -26,7 +26,9 @@
  *   Software.
  */
 
+#ifndef _POSIX_C_SOURCE
 #define _POSIX_C_SOURCE 2
+#endif
 
 #include <unistd.h>
 
@@ -44,6 +46,7 @@
 #include <qr.h>
 
 #include "internal.h"
+#include "datastream.h"
 #include "seg.h"
 
 static inline unsigned
@@ -85,7 +88,7 @@ count_data_bits(unsigned ver)
  * Returns the number of 8-bit codewords that can be used for storing data (not ECL),
  * for the given version number and error correction level. The result is in the range [9, 2956].
  */
-static int
+int
 count_codewords(unsigned ver, enum qr_ecl ecl)
 {
 	assert(QR_VER_MIN <= ver && ver <= QR_VER_MAX);
@@ -102,52 +105,28 @@ count_codewords(unsigned ver, enum qr_ecl ecl)
 /*
  * The product of the two given field elements modulo GF(2^8 / 0x11D).
  * All inputs are valid.
- * This could be implemented as a 256 * 256 lookup table.
  */
-static uint8_t
+static inline uint8_t
 finiteFieldMul(uint8_t x, uint8_t y)
 {
-	uint8_t z = 0;
-
-	/* Russian peasant multiplication */
-	for (int i = 7; i >= 0; i--) {
-		z = (z << 1) ^ ((z >> 7) * 0x11D);
-		z ^= ((y >> i) & 1) * x;
+	if (x == 0 || y == 0) {
+		return 0;
 	}
 
-	return z;
+	return gf256_exp[gf256_log[x] + gf256_log[y]];
 }
 
 /*
- * Calculates the Reed-Solomon generator polynomial of the given degree,
- * storing in r[0 : degree].
+ * Returns the Reed-Solomon generator polynomial of the given degree,
+ * as coefficients [0 : degree] in order of descending powers.
+ * These are precomputed; see RS_GENERATOR[].
  */
-static void
-reed_solomon_generator(int degree, uint8_t *r)
+static const uint8_t *
+reed_solomon_generator(int degree)
 {
 	assert(1 <= degree && degree <= 30);
 
-	// Start with the monomial x^0
-	memset(r, 0, degree);
-	r[degree - 1] = 1;
-
-	/*
-	 * Compute the product polynomial (x - r^0) * (x - r^1) * (x - r^2) * ... * (x - r^{degree-1}),
-	 * drop the highest term, and store the rest of the coefficients in order of descending powers.
-	 * Note that r = 0x02, which is a generator element of this field GF(2^8/0x11D).
-	 */
-	uint8_t root = 1;
-	for (int i = 0; i < degree; i++) {
-		// Multiply the current product by (x - r^i)
-		for (int j = 0; j < degree; j++) {
-			r[j] = finiteFieldMul(r[j], root);
-			if (j + 1 < degree) {
-				r[j] ^= r[j + 1];
-			}
-		}
-
-		root = finiteFieldMul(root, 0x02);
-	}
+	return RS_GENERATOR[degree];
 }
 
 /*
@@ -161,18 +140,69 @@ reed_solomon_remainder(const void *data, size_t dataLen,
 	const uint8_t generator[], size_t degree, uint8_t *r)
 {
 	const uint8_t *p = data;
+	uint8_t glog[30];
 
 	assert(1 <= degree && degree <= 30);
 
-	// Perform polynomial division
+	// Multiplying by a generator coefficient is an addition of logarithms.
+	// No coefficient of a Reed-Solomon generator polynomial is zero.
+	for (size_t j = 0; j < degree; j++) {
+		assert(generator[j] != 0);
+		glog[j] = gf256_log[generator[j]];
+	}
+
+	// Perform polynomial division, shifting the remainder as we go
 	memset(r, 0, degree);
 	for (size_t i = 0; i < dataLen; i++) {
 		uint8_t factor = p[i] ^ r[0];
-		memmove(&r[0], &r[1], degree - 1);
-		r[degree - 1] = 0;
-		for (size_t j = 0; j < degree; j++) {
-			r[j] ^= finiteFieldMul(generator[j], factor);
+
+		if (factor == 0) {
+			memmove(&r[0], &r[1], degree - 1);
+			r[degree - 1] = 0;
+			continue;
+		}
+
+		unsigned lf = gf256_log[factor];
+		for (size_t j = 0; j + 1 < degree; j++) {
+			r[j] = r[j + 1] ^ gf256_exp[glog[j] + lf];
 		}
+		r[degree - 1] = gf256_exp[glog[degree - 1] + lf];
+	}
+}
+
+/*
+ * Fewest data codewords for which append_ecl() uses a thread pool.
+ */
+#define ECL_POOL_MIN 2048
+
+/*
+ * The blocks of one symbol, for computing their ECC independently.
+ * The kernel is NULL for small symbols, which use the scalar loop instead.
+ */
+struct ecl_blocks {
+	uint8_t *p;
+	const uint8_t *generator;
+	const struct rs_encoder *kernel;
+	int blockEccLen;
+	int dataLen;
+	int numShortBlocks;
+	int shortBlockDataLen;
+};
+
+static void
+ecl_block(void *opaque, size_t i)
+{
+	const struct ecl_blocks *b = opaque;
+
+	// Long blocks follow the short blocks, one byte longer each
+	int blockLen = b->shortBlockDataLen + ((int) i >= b->numShortBlocks);
+	int k = (int) i * b->shortBlockDataLen + ((int) i > b->numShortBlocks ? (int) i - b->numShortBlocks : 0);
+	int j = b->dataLen + (int) i * b->blockEccLen;
+
+	if (b->kernel != NULL) {
+		b->kernel->remainder(b->kernel, &b->p[k], blockLen, &b->p[j]);
+	} else {
+		reed_solomon_remainder(&b->p[k], blockLen, b->generator, b->blockEccLen, &b->p[j]);
 	}
 }
 
@@ -181,9 +211,13 @@ reed_solomon_remainder(const void *data, size_t dataLen,
  * from the blocks and stores them in the result array. data[0 : rawCodewords - totalEcc] contains
  * the input data. data[rawCodewords - totalEcc : rawCodewords] is used as a temporary work area
  * and will be clobbered by this function. The final answer is stored in result[0 : rawCodewords].
+ * If pool is non-NULL, the blocks of large symbols are computed concurrently.
+ * If kernel is non-NULL, it divides by the generator for this version and ECL;
+ * otherwise one is built for symbols large enough to be worth it.
  */
 static void
-append_ecl(void *data, unsigned ver, enum qr_ecl ecl, uint8_t result[])
+append_ecl_kernel(void *data, unsigned ver, enum qr_ecl ecl, const struct rs_encoder *kernel,
+	struct qr_pool *pool, uint8_t result[])
 {
 	uint8_t *p = data;
 
@@ -201,18 +235,26 @@ append_ecl(void *data, unsigned ver, enum qr_ecl ecl, uint8_t result[])
 //fprintf(stderr, "\nnumBlocks=%d - numshortBlocks=%d = %d\n", numBlocks, numShortBlocks, numBlocks - numShortBlocks);
 
 	// Split data into blocks and append ECL after all data
-	uint8_t generator[30];
-	reed_solomon_generator(blockEccLen, generator);
-	for (int i = 0, j = dataLen, k = 0; i < numBlocks; i++) {
-		int blockLen = shortBlockDataLen;
-		if (i >= numShortBlocks) {
-			blockLen++;
-		}
-		reed_solomon_remainder(&p[k], blockLen, generator, blockEccLen, &p[j]);
-		j += blockEccLen;
-		k += blockLen;
+	// Building the tables for a kernel in rs.c costs about as much as
+	// dividing a hundred or so bytes here, so small symbols skip it.
+	// RS_KERNEL_AUTO always succeeds, falling back to the portable kernel.
+	struct ecl_blocks b;
+	struct rs_encoder e;
+	b.p = p;
+	b.generator = reed_solomon_generator(blockEccLen);
+	b.kernel = kernel;
+	b.blockEccLen = blockEccLen;
+	b.dataLen = dataLen;
+	b.numShortBlocks = numShortBlocks;
+	b.shortBlockDataLen = shortBlockDataLen;
+	if (kernel == NULL && dataLen >= 128) {
+		(void) rs_encoder_init(&e, b.generator, blockEccLen, RS_KERNEL_AUTO);
+		b.kernel = &e;
 	}
 
+	// Waking the pool costs more than the blocks of all but the largest symbols
+	qr_pool_run(dataLen >= ECL_POOL_MIN ? pool : NULL, numBlocks, ecl_block, &b);
+
 	// Interleave (not concatenate) the bytes from every block into a single sequence
 	for (int i = 0, k = 0; i < numBlocks; i++) {
 		for (int j = 0, l = i; j < shortBlockDataLen; j++, k++, l += numBlocks) {
@@ -232,6 +274,12 @@ append_ecl(void *data, unsigned ver, enum qr_ecl ecl, uint8_t result[])
 	}
 }
 
+static void
+append_ecl(void *data, unsigned ver, enum qr_ecl ecl, struct qr_pool *pool, uint8_t result[])
+{
+	append_ecl_kernel(data, ver, ecl, NULL, pool, result);
+}
+
 /*
  * Calculates the positions of alignment patterns in ascending order
  * for the given version number, storing them to the given array.
@@ -311,7 +359,7 @@ draw_init(unsigned ver, struct qr *q)
  * non-function modules. This does not draw the format bits. This requires all function modules to be previously
  * marked v (namely by draw_init()), because this may skip redrawing v function modules.
  */
-static void
+void
 draw_white_function_modules(struct qr *q, unsigned ver)
 {
 	assert(q != NULL);
@@ -390,16 +438,12 @@ ecl_encode(enum qr_ecl ecl)
 }
 
 /*
- * Draws two copies of the format bits (with its own error correction code) based
- * on the given mask and error correction level. This always draws all modules of
- * the format bits, unlike drawWhiteFunctionModules() which might skip v modules.
+ * The 15 format bits (with their own error correction code) for the given
+ * mask and error correction level.
  */
-static void
-draw_format(enum qr_ecl ecl, enum qr_mask mask, struct qr *q)
+static unsigned
+format_bits(enum qr_ecl ecl, enum qr_mask mask)
 {
-	assert(q != NULL);
-	assert(QR_SIZE(QR_VER_MIN) <= q->size && q->size <= QR_SIZE(QR_VER_MAX));
-
 	// Calculate error correction code and pack bits
 	assert(0 <= mask && mask <= 7);
 	int data = ecl_encode(ecl) << 3 | mask;  // ecl-derived value is uint2, mask is uint3
@@ -410,148 +454,339 @@ draw_format(enum qr_ecl ecl, enum qr_mask mask, struct qr *q)
 	data ^= 0x5412;  // uint15
 	assert(data >> 15 == 0);
 
-	// Draw first copy
-	for (int i = 0; i <= 5; i++)
-		qr_set_module(q, 8, i, (data >> i) & 1);
-	qr_set_module(q, 8, 7, (data >> 6) & 1);
-	qr_set_module(q, 8, 8, (data >> 7) & 1);
-	qr_set_module(q, 7, 8, (data >> 8) & 1);
-	for (int i = 9; i < 15; i++)
-		qr_set_module(q, 14 - i, 8, (data >> i) & 1);
-
-	// Draw second copy
-	for (int i = 0; i <= 7; i++)
-		qr_set_module(q, q->size - 1 - i, 8, (data >> i) & 1);
-	for (int i = 8; i < 15; i++)
-		qr_set_module(q, 8, q->size - 15 + i, (data >> i) & 1);
-	qr_set_module(q, 8, q->size - 8, true);
+	return data;
 }
 
 /*
- * Draws the raw codewords (including data and ECL) onto the given QR Code.
- * This requires the initial state of the QR Code to be v at function modules
- * and white at codeword modules (including unused remainder bits).
+ * The position of format bit i in the given copy (0 or 1) of the format bits.
  */
 static void
-draw_codewords(const void *data, size_t len, struct qr *q)
+format_position(size_t size, int i, int copy, unsigned *x, unsigned *y)
+{
+	assert(0 <= i && i < 15);
+
+	if (copy == 0) {
+		if (i <= 5)      { *x = 8;      *y = i; }
+		else if (i <= 7) { *x = 8;      *y = i + 1; }
+		else if (i == 8) { *x = 7;      *y = 8; }
+		else             { *x = 14 - i; *y = 8; }
+	} else {
+		if (i <= 7)      { *x = size - 1 - i;  *y = 8; }
+		else             { *x = 8; *y = size - 15 + i; }
+	}
+}
+
+/*
+ * Draws two copies of the format bits (with its own error correction code) based
+ * on the given mask and error correction level. This always draws all modules of
+ * the format bits, unlike drawWhiteFunctionModules() which might skip v modules.
+ */
+static void
+draw_format(enum qr_ecl ecl, enum qr_mask mask, struct qr *q)
 {
 	assert(q != NULL);
 	assert(QR_SIZE(QR_VER_MIN) <= q->size && q->size <= QR_SIZE(QR_VER_MAX));
 
-	const uint8_t *p = data;
-	unsigned i = 0;  // Bit index into the data
-
-	// Do the funny zigzag scan
-	for (int right = q->size - 1; right >= 1; right -= 2) {  // Index of right column in each column pair
-		if (right == 6)
-			right = 5;
-
-		for (size_t vert = 0; vert < q->size; vert++) {  // Vertical counter
-			for (int j = 0; j < 2; j++) {
-				unsigned x = right - j;  // Actual x coordinate
-				bool upward = ((right + 1) & 2) == 0;
-				unsigned y = upward ? q->size - 1 - vert : vert;  // Actual y coordinate
-				if (!qr_get_module(q, x, y) && i < len * 8) {
-					bool v = (p[BM_BYTE(i)] >> (7 - BM_BIT(i))) & 1;
-					qr_set_module(q, x, y, v);
-					i++;
-				}
-				// If there are any remainder bits (0 to 7), they are already
-				// set to 0/false/white when the grid of modules was initialized
+	unsigned data = format_bits(ecl, mask);
+
+	for (int copy = 0; copy < 2; copy++) {
+		for (int i = 0; i < 15; i++) {
+			unsigned x, y;
+			format_position(q->size, i, copy, &x, &y);
+			qr_set_module(q, x, y, (data >> i) & 1);
+		}
+	}
+	qr_set_module(q, 8, q->size - 8, true);
+}
+
+/*
+ * Draws the format bits as draw_format() would, onto row y only.
+ */
+static void
+format_row(unsigned data, size_t size, unsigned y, uint64_t row[])
+{
+	if (y > 8 && y < size - 8) {
+		return;
+	}
+
+	for (int copy = 0; copy < 2; copy++) {
+		for (int i = 0; i < 15; i++) {
+			unsigned fx, fy;
+			format_position(size, i, copy, &fx, &fy);
+			if (fy != y) {
+				continue;
 			}
+			row[fx / 64] &= ~(UINT64_C(1) << fx % 64);
+			row[fx / 64] |= (uint64_t) ((data >> i) & 1) << fx % 64;
 		}
 	}
-	assert(i == len * 8);
+	if (y == size - 8) {
+		row[0] |= UINT64_C(1) << 8;
+	}
+}
+
+struct place {
+	const uint8_t *p;
+	size_t bits;
+	struct qr *q;
+};
+
+static void
+place_bit(void *opaque, size_t i, size_t module)
+{
+	struct place *pl = opaque;
+
+	if (i < pl->bits && ((pl->p[BM_BYTE(i)] >> (7 - BM_BIT(i))) & 1)) {
+		BM_SET(pl->q->map, module);
+	}
 }
 
 /*
- * Calculates and returns the penalty score based on state of the given QR Code's current modules.
- * This is used by the automatic mask choice algorithm to find the mask pattern that yields the lowest score.
+ * Draws the raw codewords (including data and ECL) onto the given QR Code.
+ * This requires the initial state of the QR Code to be v at function modules
+ * and white at codeword modules (including unused remainder bits).
  */
-static long
-penalty(const struct qr *q)
+static void
+draw_codewords(const void *data, size_t len, struct qr *q)
 {
 	assert(q != NULL);
 	assert(QR_SIZE(QR_VER_MIN) <= q->size && q->size <= QR_SIZE(QR_VER_MAX));
+	assert(len * 8 <= count_data_bits(QR_VER(q->size)));
+
+	const uint8_t *p = data;
+	const uint16_t *t;
+
+	// If there are any remainder bits (0 to 7), they are already
+	// set to 0/false/white when the grid of modules was initialized
+	t = placement(QR_VER(q->size));
+	if (t == NULL) {
+		struct place pl = { p, len * 8, q };
+		placement_walk(QR_VER(q->size), place_bit, &pl);
+		return;
+	}
+
+	// Set without branching on the data, which is as good as random
+	for (size_t i = 0; i < len; i++) {
+		for (unsigned j = 0; j < 8; j++) {
+			unsigned m = t[i * 8 + j];
+			q->map[BM_BYTE(m)] |= ((p[i] >> (7 - j)) & 1U) << BM_BIT(m);
+		}
+	}
+}
 
 #define PENALTY_N1 3
 #define PENALTY_N2 3
 #define PENALTY_N3 40
 #define PENALTY_N4 10
 
+/*
+ * The modules [64 * i + k : 64 * i + k + 64] of a row of the given
+ * number of words, as one word.
+ */
+static inline uint64_t
+line_bits(const uint64_t *w, size_t words, size_t i, unsigned k)
+{
+	assert(k < 64);
+
+	uint64_t next = i + 1 < words ? w[i + 1] : 0;
+
+	// shifted in two steps, since a shift by 64 is undefined
+	return (w[i] >> k) | (next << 1 << (63 - k));
+}
+
+/*
+ * The positions [64 * i : 64 * i + 64] at which a window of m modules
+ * fits within a row or column of n modules.
+ */
+static inline uint64_t
+line_fits(size_t n, size_t i, unsigned m)
+{
+	size_t end = n + 1 - m;
+
+	if (end <= 64 * i) {
+		return 0;
+	}
+	if (end >= 64 * i + 64) {
+		return UINT64_MAX;
+	}
+
+	return (UINT64_C(1) << (end - 64 * i)) - 1;
+}
+
+/*
+ * Windows of five modules of the same color, b[k] being the modules at an
+ * offset of k along the line from each position in the word.
+ */
+static inline uint64_t
+penalty_five(const uint64_t b[])
+{
+	return ~(b[0] ^ b[1]) & ~(b[1] ^ b[2]) & ~(b[2] ^ b[3]) & ~(b[3] ^ b[4]);
+}
+
+/*
+ * Finder-like patterns, 1:1:3:1:1 dark:light:dark:light:dark with four light
+ * modules on either side, from b[0 : 11] as for penalty_five().
+ * The pattern is its own reverse.
+ */
+static inline uint64_t
+penalty_finder(const uint64_t b[])
+{
+	uint64_t core0 = b[0] & ~b[1] & b[2] & b[3] & b[4] & ~b[5] & b[6];
+	uint64_t core4 = b[4] & ~b[5] & b[6] & b[7] & b[8] & ~b[9] & b[10];
+	uint64_t light0 = ~(b[0] | b[1] | b[2] | b[3]);
+	uint64_t light7 = ~(b[7] | b[8] | b[9] | b[10]);
+
+	return (light0 & core4) | (core0 & light7);
+}
+
+/*
+ * The score for the given windows of five equal modules, where before are
+ * the windows one module earlier along each line.
+ *
+ * A run of L >= 5 modules of the same color scores N1 + (L - 5), and contains
+ * L - 4 windows of five equal modules. So the score is the number of such
+ * windows, plus N1 - 1 for each run, counted by the windows which begin one.
+ */
+static inline long
+penalty_runs(uint64_t five, uint64_t before)
+{
+	return popcount64(five) + (PENALTY_N1 - 1) * popcount64(five & ~before);
+}
+
+/*
+ * The penalties for runs and finder-like patterns along one row of n modules.
+ */
+static long
+penalty_line(const uint64_t *w, size_t n)
+{
+	size_t words = QR_ROW_WORDS(n);
+	uint64_t carry = 0;
 	long result = 0;
 
-	// Adjacent modules in row having same color
-	for (unsigned y = 0; y < q->size; y++) {
-		bool colorX;
-		for (unsigned x = 0, runX; x < q->size; x++) {
-			if (x == 0 || qr_get_module(q, x, y) != colorX) {
-				colorX = qr_get_module(q, x, y);
-				runX = 1;
-			} else {
-				runX++;
-				if (runX == 5)
-					result += PENALTY_N1;
-				else if (runX > 5)
-					result++;
-			}
+	for (size_t i = 0; i < words; i++) {
+		uint64_t b[11];
+
+		for (unsigned k = 0; k < 11; k++) {
+			b[k] = line_bits(w, words, i, k);
 		}
-	}
-	// Adjacent modules in column having same color
-	for (unsigned x = 0; x < q->size; x++) {
-		bool colorY;
-		for (unsigned y = 0, runY; y < q->size; y++) {
-			if (y == 0 || qr_get_module(q, x, y) != colorY) {
-				colorY = qr_get_module(q, x, y);
-				runY = 1;
-			} else {
-				runY++;
-				if (runY == 5)
-					result += PENALTY_N1;
-				else if (runY > 5)
-					result++;
-			}
+
+		uint64_t five = penalty_five(b) & line_fits(n, i, 5);
+		result += penalty_runs(five, (five << 1) | carry);
+		carry = five >> 63;
+
+		uint64_t finder = penalty_finder(b) & line_fits(n, i, 11);
+		if (finder != 0) {
+			result += PENALTY_N3 * popcount64(finder);
 		}
 	}
 
+	return result;
+}
+
+/*
+ * The number of 2*2 blocks of the same color within two adjacent rows.
+ */
+static unsigned
+penalty_blocks(const uint64_t *a, const uint64_t *c, size_t n)
+{
+	size_t words = QR_ROW_WORDS(n);
+	unsigned count = 0;
+
+	for (size_t i = 0; i < words; i++) {
+		uint64_t a0 = a[i], a1 = line_bits(a, words, i, 1);
+		uint64_t c0 = c[i], c1 = line_bits(c, words, i, 1);
+
+		count += popcount64(~(a0 ^ a1) & ~(c0 ^ c1) & ~(a0 ^ c0) & line_fits(n, i, 2));
+	}
+
+	return count;
+}
+
+/*
+ * The penalty score of one symbol, accumulated a row at a time. Rows are
+ * scored 64 modules at a time along each word; columns are scored 64 at
+ * a time down the words of the last eleven rows, which is as far back as
+ * any rule looks.
+ */
+struct penalty {
+	size_t size;
+	uint64_t lines[11][QR_ROW_WORDS_MAX]; /* row y is lines[y % 11] */
+	uint64_t five[QR_ROW_WORDS_MAX];      /* column windows ending at the previous row */
+	long result;
+	unsigned dark;
+};
+
+static void
+penalty_init(struct penalty *p, size_t size)
+{
+	assert(p != NULL);
+	assert(QR_SIZE(QR_VER_MIN) <= size && size <= QR_SIZE(QR_VER_MAX));
+
+	p->size = size;
+	memset(p->five, 0, sizeof p->five);
+	p->result = 0;
+	p->dark = 0;
+}
+
+/* rows must be given in order from y = 0, with bits past the end zero */
+static void
+penalty_row(struct penalty *p, unsigned y, const uint64_t row[])
+{
+	size_t words = QR_ROW_WORDS(p->size);
+
+	assert(y < p->size);
+
+	// Adjacent modules in row having same color, and finder-like patterns
+	p->result += penalty_line(row, p->size);
+
 	// 2*2 blocks of modules having same color
-	for (unsigned y = 0; y < q->size - 1; y++) {
-		for (unsigned x = 0; x < q->size - 1; x++) {
-			bool  color = qr_get_module(q, x, y);
-			if (  color == qr_get_module(q, x + 1, y) &&
-			      color == qr_get_module(q, x, y + 1) &&
-			      color == qr_get_module(q, x + 1, y + 1))
-				result += PENALTY_N2;
-		}
+	if (y > 0) {
+		p->result += PENALTY_N2 * (long) penalty_blocks(p->lines[(y - 1) % 11], row, p->size);
 	}
 
-	// Finder-like pattern in rows
-	for (unsigned y = 0; y < q->size; y++) {
-		for (unsigned x = 0, bits = 0; x < q->size; x++) {
-			bits = ((bits << 1) & 0x7FF) | (qr_get_module(q, x, y) ? 1 : 0);
-			if (x >= 10 && (bits == 0x05D || bits == 0x5D0))  // Needs 11 bits accumulated
-				result += PENALTY_N3;
-		}
+	memcpy(p->lines[y % 11], row, words * sizeof *row);
+
+	// Rows y - 10 to y, of which only those from 0 are valid
+	const uint64_t *h[11];
+	for (unsigned j = 0; j < 11; j++) {
+		h[j] = p->lines[(y + 1 + j) % 11];
 	}
-	// Finder-like pattern in columns
-	for (unsigned x = 0; x < q->size; x++) {
-		for (unsigned y = 0, bits = 0; y < q->size; y++) {
-			bits = ((bits << 1) & 0x7FF) | (qr_get_module(q, x, y) ? 1 : 0);
-			if (y >= 10 && (bits == 0x05D || bits == 0x5D0))  // Needs 11 bits accumulated
-				result += PENALTY_N3;
+
+	for (size_t k = 0; k < words; k++) {
+		uint64_t width = line_fits(p->size, k, 1);
+		uint64_t b[11];
+
+		for (unsigned j = 0; j < 11; j++) {
+			b[j] = h[j][k];
 		}
-	}
 
-	// Balance of v and white modules
-	unsigned v = 0;
-	for (unsigned y = 0; y < q->size; y++) {
-		for (unsigned x = 0; x < q->size; x++) {
-			if (qr_get_module(q, x, y))
-				v++;
+		p->dark += popcount64(row[k]);
+
+		// Adjacent modules in column having same color
+		if (y >= 4) {
+			uint64_t five = penalty_five(&b[6]) & width;
+			p->result += penalty_runs(five, p->five[k]);
+			p->five[k] = five;
+		}
+
+		// Finder-like pattern in columns
+		if (y >= 10) {
+			uint64_t finder = penalty_finder(b) & width;
+			if (finder != 0) {
+				p->result += PENALTY_N3 * popcount64(finder);
+			}
 		}
 	}
+}
 
-	size_t total = q->size * q->size;
+static long
+penalty_end(const struct penalty *p)
+{
+	long result = p->result;
+	unsigned v = p->dark;
+
+	// Balance of dark and light modules
+	size_t total = p->size * p->size;
 	// Find smallest k such that (45-5k)% <= dark/total <= (55+5k)%
 	for (unsigned k = 0; v * 20L < (9L - k) * total || v * 20L > (11L + k) * total; k++) {
 		result += PENALTY_N4;
@@ -560,6 +795,78 @@ penalty(const struct qr *q)
 	return result;
 }
 
+/*
+ * Calculates the penalty score for each of the eight masks, as if the given
+ * QR Code were drawn with that mask's format bits and then masked.
+ * This is used by the automatic mask choice algorithm to find the mask pattern that yields the lowest score.
+ *
+ * The symbol is read once, and each row of all eight candidates is made
+ * and scored in turn, so no masked symbol is materialised.
+ */
+static void
+penalty_masks(const struct qr *q, enum qr_ecl ecl, long score[static 8])
+{
+	assert(q != NULL);
+	assert(QR_SIZE(QR_VER_MIN) <= q->size && q->size <= QR_SIZE(QR_VER_MAX));
+
+	const size_t words = QR_ROW_WORDS(q->size);
+	const uint64_t *plane[8];
+	struct penalty p[8];
+	unsigned format[8];
+	bool cached = true;
+
+	struct qr region;
+
+	for (int i = 0; i < 8; i++) {
+		penalty_init(&p[i], q->size);
+		format[i] = format_bits(ecl, i);
+
+		plane[i] = mask_plane_rows(QR_VER(q->size), i);
+		if (plane[i] == NULL) {
+			cached = false;
+		}
+	}
+
+	// Without the shared planes, each row of each plane is made as needed
+	region.size = q->size;
+	region.map  = (uint8_t *) qr_data_region(QR_VER(q->size));
+
+	for (unsigned y = 0; y < q->size; y++) {
+		uint64_t base[QR_ROW_WORDS_MAX], d[QR_ROW_WORDS_MAX];
+
+		qr_get_row(q, y, base);
+		if (!cached) {
+			qr_get_row(&region, y, d);
+		}
+
+		for (int i = 0; i < 8; i++) {
+			uint64_t m[QR_ROW_WORDS_MAX], row[QR_ROW_WORDS_MAX];
+			const uint64_t *pm;
+
+			if (cached) {
+				pm = &plane[i][y * words];
+			} else {
+				mask_row(i, y, words, m);
+				for (size_t k = 0; k < words; k++) {
+					m[k] &= d[k];
+				}
+				pm = m;
+			}
+
+			for (size_t k = 0; k < words; k++) {
+				row[k] = base[k] ^ pm[k];
+			}
+			format_row(format[i], q->size, y, row);
+
+			penalty_row(&p[i], y, row);
+		}
+	}
+
+	for (int i = 0; i < 8; i++) {
+		score[i] = penalty_end(&p[i]);
+	}
+}
+
 /*
  * Renders a QR Code symbol representing the given data segments
  * with the given encoding parameters.
@@ -615,23 +922,53 @@ qr_encode(struct qr_segment * const a[], size_t n,
 	bool boost_ecl,
 	void *tmp, struct qr *q)
 {
-	assert(a != NULL || n == 0);
-	assert(QR_VER_MIN <= min && min <= max && max <= QR_VER_MAX);
-	assert(0 <= ecl && ecl <= 3);
-	assert(-1 <= mask && mask <= 7);
+	return qr_encode_opt(a, n, ecl, min, max, mask, boost_ecl, NULL, tmp, q);
+}
 
-	// Find the minimal version number to use
-	unsigned ver;
-	int dataUsedBits;
-	for (ver = min; ; ver++) {
-		int dataCapacityBits = count_codewords(ver, ecl) * 8;  // Number of data bits available
-		dataUsedBits = count_total_bits(a, n, ver);
-		if (dataUsedBits != -1 && dataUsedBits <= dataCapacityBits)
-			break;  // This version number is found to be suitable
-		if (ver >= max) {  // All versions in the range could not fit the given data
-			errno = EMSGSIZE;
-			return false;
+/*
+ * The smallest version in [min, max] which fits the given segments,
+ * and the ECL to use, raised if boost_ecl and the data still fits.
+ *
+ * The segments' length depends on the version only through the widths
+ * of the character count fields, which change at versions 10 and 27,
+ * so it is counted once per class of versions. Capacity increases with
+ * the version, so within a class the smallest which fits is found by
+ * binary search.
+ */
+static bool
+encode_version(struct qr_segment * const a[], size_t n,
+	enum qr_ecl *ecl,
+	unsigned min, unsigned max,
+	bool boost_ecl,
+	unsigned *ver_out)
+{
+	static const unsigned class_min[] = {  1, 10, 27 };
+	static const unsigned class_max[] = {  9, 26, 40 };
+
+	unsigned ver = 0;
+	int dataUsedBits = -1;
+	for (size_t c = 0; c < 3 && ver == 0; c++) {
+		unsigned lo = min > class_min[c] ? min : class_min[c];
+		unsigned hi = max < class_max[c] ? max : class_max[c];
+		if (lo > hi)
+			continue;
+
+		dataUsedBits = count_total_bits(a, n, lo);
+		if (dataUsedBits == -1 || dataUsedBits > count_codewords(hi, *ecl) * 8)
+			continue;  // No version in this class fits the data
+
+		while (lo < hi) {
+			unsigned mid = lo + (hi - lo) / 2;
+			if (dataUsedBits <= count_codewords(mid, *ecl) * 8)
+				hi = mid;
+			else
+				lo = mid + 1;
 		}
+		ver = lo;
+	}
+	if (ver == 0) {  // All versions in the range could not fit the given data
+		errno = EMSGSIZE;
+		return false;
 	}
 	assert(dataUsedBits != -1);
 
@@ -639,11 +976,24 @@ qr_encode(struct qr_segment * const a[], size_t n,
 	if (boost_ecl) {
 		for (enum qr_ecl e = 0; e < 4; e++) {
 			if (dataUsedBits <= count_codewords(ver, e) * 8) {
-				ecl = e;
+				*ecl = e;
 			}
 		}
 	}
 
+	*ver_out = ver;
+	return true;
+}
+
+/*
+ * Concatenates the segments, terminator and padding into the data codewords
+ * for the given version and ECL, count_codewords(ver, ecl) bytes at buf.
+ */
+static bool
+encode_data(struct qr_segment * const a[], size_t n,
+	unsigned ver, enum qr_ecl ecl,
+	void *buf)
+{
 	/*
 	 * QR 2005 6.4.8.1 FNC1 in first position
 	 * "... shall only be used once in a symbol ..."
@@ -661,37 +1011,18 @@ qr_encode(struct qr_segment * const a[], size_t n,
 
 	// Create the data bit string by concatenating all segments
 	size_t dataCapacityBits = count_codewords(ver, ecl) * 8;
-	memset(q->map, 0, QR_BUF_LEN(ver));
-	size_t count = 0;
+	struct bit_writer w;
+	bit_writer_init(&w, buf);
 	for (size_t i = 0; i < n; i++) {
-		size_t len;
-
-		switch (a[i]->mode) {
-		case QR_MODE_BYTE:
-			len = BM_LEN(a[i]->u.m.bits);
-			break;
-
-		case QR_MODE_NUMERIC:
-		case QR_MODE_ALNUM:
-		case QR_MODE_KANJI:
-			len = strlen(a[i]->u.s);
-			break;
-
-		case QR_MODE_ECI:
-			len = 0;
+		if (a[i]->mode == QR_MODE_ECI) {
 			return 0;
-
-		default:
-			assert(false);
 		}
 
-		append_bits(a[i]->mode, 4, q->map, &count);
-		append_bits(len, count_char_bits(a[i]->mode, ver), q->map, &count);
-
-		for (size_t j = 0; j < a[i]->m.bits; j++) {
-			append_bits((((const uint8_t *) a[i]->m.data)[BM_BYTE(j)] >> (7 - BM_BIT(j))) & 1, 1, q->map, &count);
-		}
+		bit_writer_put(&w, a[i]->mode, 4);
+		bit_writer_put(&w, seg_chars(a[i]), count_char_bits(a[i]->mode, ver));
+		bit_writer_span(&w, QR_SEG_DATA(a[i]), a[i]->bits);
 	}
+	size_t count = bit_writer_flush(&w);
 
 	/*
 	 * QR 2005 6.4.9 Terminator "The end of data in the symbol is signalled
@@ -704,43 +1035,186 @@ qr_encode(struct qr_segment * const a[], size_t n,
 	int terminatorBits = dataCapacityBits - count;
 	if (terminatorBits > 4)
 		terminatorBits = 4;
-	append_bits(0, terminatorBits, q->map, &count);
-	append_bits(0, (8 - count % 8) % 8, q->map, &count);
+	bit_writer_put(&w, 0, terminatorBits);
+	bit_writer_put(&w, 0, (8 - (count + terminatorBits) % 8) % 8);
+	count = bit_writer_flush(&w);
 
 	/*
 	 * QR 2005 6.4.10 "The message bit stream shall then be extended to fill
 	 * the data capacity ... by adding the Pad Codewords 11101100 and 00010001
 	 * alternately."
 	 */
-	for (uint8_t padByte = 0xEC; count < dataCapacityBits; padByte ^= 0xEC ^ 0x11)
-		append_bits(padByte, 8, q->map, &count);
-	assert(count % 8 == 0);
+	for ( ; count + 16 <= dataCapacityBits; count += 16)
+		bit_writer_put(&w, 0xEC11, 16);
+	if (count < dataCapacityBits)
+		bit_writer_put(&w, 0xEC, 8);
+	count = bit_writer_flush(&w);
+	assert(count == dataCapacityBits);
 
-	// Draw function and data codeword modules
-	append_ecl(q->map, ver, ecl, tmp);
-	draw_init(ver, q);
-	draw_codewords(tmp, count_data_bits(ver) / 8, q);
-	draw_white_function_modules(q, ver);
+	return true;
+}
 
+/*
+ * Chooses the mask if QR_MASK_AUTO, then draws the format bits and applies it.
+ */
+static void
+encode_mask(struct qr *q, enum qr_ecl ecl, int mask)
+{
 	// Handle masking
 	if (mask == QR_MASK_AUTO) {
-		long curr = LONG_MAX;
-		for (int i = 0; i < 8; i++) {
-			draw_format(ecl, i, q);
-			qr_apply_mask(q, i);
-			long w = penalty(q);
-			if (w < curr) {
+		long score[8];
+		penalty_masks(q, ecl, score);
+		mask = 0;
+		for (int i = 1; i < 8; i++) {
+			if (score[i] < score[mask])
 				mask = i;
-				curr = w;
-			}
-			qr_apply_mask(q, i);  // Undoes the mask due to XOR
 		}
 	}
 
 	assert(0 <= (int) mask && (int) mask <= 7);
 	draw_format(ecl, mask, q);
 	qr_apply_mask(q, mask);
+}
+
+/*
+ * As qr_encode(), with the given options, which may be NULL.
+ */
+bool
+qr_encode_opt(struct qr_segment * const a[], size_t n,
+	enum qr_ecl ecl,
+	unsigned min, unsigned max,
+	int mask,
+	bool boost_ecl,
+	const struct qr_options *opt,
+	void *tmp, struct qr *q)
+{
+	assert(a != NULL || n == 0);
+	assert(QR_VER_MIN <= min && min <= max && max <= QR_VER_MAX);
+	assert(0 <= ecl && ecl <= 3);
+	assert(-1 <= mask && mask <= 7);
+
+	unsigned ver;
+	if (!encode_version(a, n, &ecl, min, max, boost_ecl, &ver))
+		return false;
+
+	if (!encode_data(a, n, ver, ecl, q->map))
+		return false;
+
+	// Draw function and data codeword modules
+	append_ecl(q->map, ver, ecl, opt != NULL ? opt->pool : NULL, tmp);
+	q->size = QR_SIZE(ver);
+	memcpy(q->map, qr_function_template(ver), QR_BUF_LEN(ver));
+	draw_codewords(tmp, count_data_bits(ver) / 8, q);
+
+	encode_mask(q, ecl, mask);
 
 	return true;
 }
 
+/* versions whose kernels qr_encode_batch() keeps at once */
+#define BATCH_KERNELS 4
+
+/*
+ * What qr_encode_batch() keeps per version: the Reed-Solomon kernel
+ * for each ECL, made on first use.
+ */
+struct batch_kernels {
+	unsigned ver; /* 0 if unused */
+	bool ready[4];
+	struct rs_encoder kernel[4];
+};
+
+static struct batch_kernels *
+batch_kernels(struct batch_kernels t[], size_t *next, unsigned ver, enum qr_ecl ecl)
+{
+	struct batch_kernels *p;
+	size_t i;
+
+	for (i = 0; i < BATCH_KERNELS; i++) {
+		if (t[i].ver == ver)
+			break;
+	}
+
+	if (i < BATCH_KERNELS) {
+		p = &t[i];
+	} else {
+		p = &t[*next];
+		*next = (*next + 1) % BATCH_KERNELS;
+
+		p->ver = ver;
+		memset(p->ready, 0, sizeof p->ready);
+	}
+
+	if (!p->ready[ecl]) {
+		int degree = ECL_CODEWORDS_PER_BLOCK[ver][ecl];
+
+		(void) rs_encoder_init(&p->kernel[ecl], reed_solomon_generator(degree), degree, RS_KERNEL_AUTO);
+		p->ready[ecl] = true;
+	}
+
+	return p;
+}
+
+/*
+ * Encodes count symbols as qr_encode_opt() would, the segments a[i][0 : n[i]]
+ * into q[i], each of whose .map must have a length of at least QR_BUF_LEN(max).
+ * The Reed-Solomon kernel of each version is made once for the batch,
+ * rather than per symbol, which suits many symbols of a few versions.
+ * Stops at the first symbol which cannot be encoded, and returns the
+ * number encoded; if that is short of count, errno is set as for
+ * qr_encode_opt(), or to ENOMEM.
+ */
+size_t
+qr_encode_batch(struct qr_segment * const * const a[], const size_t n[], size_t count,
+	enum qr_ecl ecl,
+	unsigned min, unsigned max,
+	int mask,
+	bool boost_ecl,
+	const struct qr_options *opt,
+	void *tmp, struct qr q[])
+{
+	struct batch_kernels *t;
+	size_t i, next = 0;
+
+	assert(a != NULL || count == 0);
+	assert(n != NULL || count == 0);
+	assert(QR_VER_MIN <= min && min <= max && max <= QR_VER_MAX);
+	assert(0 <= ecl && ecl <= 3);
+	assert(-1 <= mask && mask <= 7);
+
+	t = malloc(sizeof *t * BATCH_KERNELS);
+	if (t == NULL) {
+		return 0;
+	}
+
+	for (i = 0; i < BATCH_KERNELS; i++) {
+		t[i].ver = 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		const struct batch_kernels *p;
+		enum qr_ecl e = ecl;
+		unsigned ver;
+
+		assert(a[i] != NULL || n[i] == 0);
+
+		if (!encode_version(a[i], n[i], &e, min, max, boost_ecl, &ver))
+			break;
+
+		if (!encode_data(a[i], n[i], ver, e, q[i].map))
+			break;
+
+		p = batch_kernels(t, &next, ver, e);
+
+		append_ecl_kernel(q[i].map, ver, e, &p->kernel[e], opt != NULL ? opt->pool : NULL, tmp);
+		q[i].size = QR_SIZE(ver);
+		memcpy(q[i].map, qr_function_template(ver), QR_BUF_LEN(ver));
+		draw_codewords(tmp, count_data_bits(ver) / 8, &q[i]);
+
+		encode_mask(&q[i], e, mask);
+	}
+
+	free(t);
+
+	return i;
+}
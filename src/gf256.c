@@ -0,0 +1,264 @@
+/* quirc -- QR-code recognition library
+ * Copyright (C) 2010-2012 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <eci.h>
+#include <qr.h>
+
+#include "internal.h"
+
+/*
+ * GF(2^8) with the generator polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11D).
+ *
+ * The exp table is doubled, so that the sum of any two logarithms
+ * may index it directly without reduction modulo 255.
+ */
+
+const uint8_t gf256_exp[512] = {
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+	0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26,
+	0x4c, 0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9,
+	0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0,
+	0x9d, 0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35,
+	0x6a, 0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23,
+	0x46, 0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0,
+	0x5d, 0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1,
+	0x5f, 0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc,
+	0x65, 0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0,
+	0xfd, 0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f,
+	0xfe, 0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2,
+	0xd9, 0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88,
+	0x0d, 0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce,
+	0x81, 0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93,
+	0x3b, 0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc,
+	0x85, 0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9,
+	0x4f, 0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54,
+	0xa8, 0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa,
+	0x49, 0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73,
+	0xe6, 0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e,
+	0xfc, 0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff,
+	0xe3, 0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4,
+	0x95, 0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41,
+	0x82, 0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e,
+	0x1c, 0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6,
+	0x51, 0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef,
+	0xc3, 0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09,
+	0x12, 0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5,
+	0xf7, 0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16,
+	0x2c, 0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83,
+	0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01,
+	0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d,
+	0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26, 0x4c,
+	0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f,
+	0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0, 0x9d,
+	0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35, 0x6a,
+	0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23, 0x46,
+	0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0, 0x5d,
+	0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1, 0x5f,
+	0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc, 0x65,
+	0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0, 0xfd,
+	0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f, 0xfe,
+	0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2, 0xd9,
+	0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0d,
+	0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce, 0x81,
+	0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93, 0x3b,
+	0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc, 0x85,
+	0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9, 0x4f,
+	0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54, 0xa8,
+	0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa, 0x49,
+	0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73, 0xe6,
+	0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e, 0xfc,
+	0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff, 0xe3,
+	0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4, 0x95,
+	0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41, 0x82,
+	0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e, 0x1c,
+	0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6, 0x51,
+	0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef, 0xc3,
+	0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09, 0x12,
+	0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5, 0xf7,
+	0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16, 0x2c,
+	0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83, 0x1b,
+	0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01, 0x02
+};
+
+const uint8_t gf256_log[256] = {
+	0x00, 0xff, 0x01, 0x19, 0x02, 0x32, 0x1a, 0xc6,
+	0x03, 0xdf, 0x33, 0xee, 0x1b, 0x68, 0xc7, 0x4b,
+	0x04, 0x64, 0xe0, 0x0e, 0x34, 0x8d, 0xef, 0x81,
+	0x1c, 0xc1, 0x69, 0xf8, 0xc8, 0x08, 0x4c, 0x71,
+	0x05, 0x8a, 0x65, 0x2f, 0xe1, 0x24, 0x0f, 0x21,
+	0x35, 0x93, 0x8e, 0xda, 0xf0, 0x12, 0x82, 0x45,
+	0x1d, 0xb5, 0xc2, 0x7d, 0x6a, 0x27, 0xf9, 0xb9,
+	0xc9, 0x9a, 0x09, 0x78, 0x4d, 0xe4, 0x72, 0xa6,
+	0x06, 0xbf, 0x8b, 0x62, 0x66, 0xdd, 0x30, 0xfd,
+	0xe2, 0x98, 0x25, 0xb3, 0x10, 0x91, 0x22, 0x88,
+	0x36, 0xd0, 0x94, 0xce, 0x8f, 0x96, 0xdb, 0xbd,
+	0xf1, 0xd2, 0x13, 0x5c, 0x83, 0x38, 0x46, 0x40,
+	0x1e, 0x42, 0xb6, 0xa3, 0xc3, 0x48, 0x7e, 0x6e,
+	0x6b, 0x3a, 0x28, 0x54, 0xfa, 0x85, 0xba, 0x3d,
+	0xca, 0x5e, 0x9b, 0x9f, 0x0a, 0x15, 0x79, 0x2b,
+	0x4e, 0xd4, 0xe5, 0xac, 0x73, 0xf3, 0xa7, 0x57,
+	0x07, 0x70, 0xc0, 0xf7, 0x8c, 0x80, 0x63, 0x0d,
+	0x67, 0x4a, 0xde, 0xed, 0x31, 0xc5, 0xfe, 0x18,
+	0xe3, 0xa5, 0x99, 0x77, 0x26, 0xb8, 0xb4, 0x7c,
+	0x11, 0x44, 0x92, 0xd9, 0x23, 0x20, 0x89, 0x2e,
+	0x37, 0x3f, 0xd1, 0x5b, 0x95, 0xbc, 0xcf, 0xcd,
+	0x90, 0x87, 0x97, 0xb2, 0xdc, 0xfc, 0xbe, 0x61,
+	0xf2, 0x56, 0xd3, 0xab, 0x14, 0x2a, 0x5d, 0x9e,
+	0x84, 0x3c, 0x39, 0x53, 0x47, 0x6d, 0x41, 0xa2,
+	0x1f, 0x2d, 0x43, 0xd8, 0xb7, 0x7b, 0xa4, 0x76,
+	0xc4, 0x17, 0x49, 0xec, 0x7f, 0x0c, 0x6f, 0xf6,
+	0x6c, 0xa1, 0x3b, 0x52, 0x29, 0x9d, 0x55, 0xaa,
+	0xfb, 0x60, 0x86, 0xb1, 0xbb, 0xcc, 0x3e, 0x5a,
+	0xcb, 0x59, 0x5f, 0xb0, 0x9c, 0xa9, 0xa0, 0x51,
+	0x0b, 0xf5, 0x16, 0xeb, 0x7a, 0x75, 0x2c, 0xd7,
+	0x4f, 0xae, 0xd5, 0xe9, 0xe6, 0xe7, 0xad, 0xe8,
+	0x74, 0xd6, 0xf4, 0xea, 0xa8, 0x50, 0x58, 0xaf
+};
+
+/*
+ * Reed-Solomon generator polynomials for the encoder, indexed by degree
+ * (index 0 is for padding). Each is the product (x - r^0) * (x - r^1) * ...
+ * * (x - r^{degree-1}) with r = 0x02, with the highest term dropped and the
+ * remaining coefficients stored in order of descending powers.
+ */
+
+const uint8_t RS_GENERATOR[30 + 1][30] = {
+	{ 0 },
+	{ /* 1 */
+		0x01
+	},
+	{ /* 2 */
+		0x03, 0x02
+	},
+	{ /* 3 */
+		0x07, 0x0e, 0x08
+	},
+	{ /* 4 */
+		0x0f, 0x36, 0x78, 0x40
+	},
+	{ /* 5 */
+		0x1f, 0xc6, 0x3f, 0x93, 0x74
+	},
+	{ /* 6 */
+		0x3f, 0x01, 0xda, 0x20, 0xe3, 0x26
+	},
+	{ /* 7 */
+		0x7f, 0x7a, 0x9a, 0xa4, 0x0b, 0x44, 0x75
+	},
+	{ /* 8 */
+		0xff, 0x0b, 0x51, 0x36, 0xef, 0xad, 0xc8, 0x18
+	},
+	{ /* 9 */
+		0xe2, 0xcf, 0x9e, 0xf5, 0xeb, 0xa4, 0xe8, 0xc5, 0x25
+	},
+	{ /* 10 */
+		0xd8, 0xc2, 0x9f, 0x6f, 0xc7, 0x5e, 0x5f, 0x71, 0x9d, 0xc1
+	},
+	{ /* 11 */
+		0xac, 0x82, 0xa3, 0x32, 0x7b, 0xdb, 0xa2, 0xf8, 0x90, 0x74,
+		0xa0
+	},
+	{ /* 12 */
+		0x44, 0x77, 0x43, 0x76, 0xdc, 0x1f, 0x07, 0x54, 0x5c, 0x7f,
+		0xd5, 0x61
+	},
+	{ /* 13 */
+		0x89, 0x49, 0xe3, 0x11, 0xb1, 0x11, 0x34, 0x0d, 0x2e, 0x2b,
+		0x53, 0x84, 0x78
+	},
+	{ /* 14 */
+		0x0e, 0x36, 0x72, 0x46, 0xae, 0x97, 0x2b, 0x9e, 0xc3, 0x7f,
+		0xa6, 0xd2, 0xea, 0xa3
+	},
+	{ /* 15 */
+		0x1d, 0xc4, 0x6f, 0xa3, 0x70, 0x4a, 0x0a, 0x69, 0x69, 0x8b,
+		0x84, 0x97, 0x20, 0x86, 0x1a
+	},
+	{ /* 16 */
+		0x3b, 0x0d, 0x68, 0xbd, 0x44, 0xd1, 0x1e, 0x08, 0xa3, 0x41,
+		0x29, 0xe5, 0x62, 0x32, 0x24, 0x3b
+	},
+	{ /* 17 */
+		0x77, 0x42, 0x53, 0x78, 0x77, 0x16, 0xc5, 0x53, 0xf9, 0x29,
+		0x8f, 0x86, 0x55, 0x35, 0x7d, 0x63, 0x4f
+	},
+	{ /* 18 */
+		0xef, 0xfb, 0xb7, 0x71, 0x95, 0xaf, 0xc7, 0xd7, 0xf0, 0xdc,
+		0x49, 0x52, 0xad, 0x4b, 0x20, 0x43, 0xd9, 0x92
+	},
+	{ /* 19 */
+		0xc2, 0x08, 0x1a, 0x92, 0x14, 0xdf, 0xbb, 0x98, 0x55, 0x73,
+		0xee, 0x85, 0x92, 0x6d, 0xad, 0x8a, 0x21, 0xac, 0xb3
+	},
+	{ /* 20 */
+		0x98, 0xb9, 0xf0, 0x05, 0x6f, 0x63, 0x06, 0xdc, 0x70, 0x96,
+		0x45, 0x24, 0xbb, 0x16, 0xe4, 0xc6, 0x79, 0x79, 0xa5, 0xae
+	},
+	{ /* 21 */
+		0x2c, 0xf3, 0x0d, 0x83, 0x31, 0x84, 0xc2, 0x43, 0xd6, 0x1c,
+		0x59, 0x7c, 0x52, 0x9e, 0xf4, 0x25, 0xec, 0x8e, 0x52, 0xff,
+		0x59
+	},
+	{ /* 22 */
+		0x59, 0xb3, 0x83, 0xb0, 0xb6, 0xf4, 0x13, 0xbd, 0x45, 0x28,
+		0x1c, 0x89, 0x1d, 0x7b, 0x43, 0xfd, 0x56, 0xda, 0xe6, 0x1a,
+		0x91, 0xf5
+	},
+	{ /* 23 */
+		0xb3, 0x44, 0x9a, 0xa3, 0x8c, 0x88, 0xbe, 0x98, 0x19, 0x55,
+		0x13, 0x03, 0xc4, 0x1b, 0x71, 0xc6, 0x12, 0x82, 0x02, 0x78,
+		0x5d, 0x29, 0x47
+	},
+	{ /* 24 */
+		0x7a, 0x76, 0xa9, 0x46, 0xb2, 0xed, 0xd8, 0x66, 0x73, 0x96,
+		0xe5, 0x49, 0x82, 0x48, 0x3d, 0x2b, 0xce, 0x01, 0xed, 0xf7,
+		0x7f, 0xd9, 0x90, 0x75
+	},
+	{ /* 25 */
+		0xf5, 0x31, 0xe4, 0x35, 0xd7, 0x06, 0xcd, 0xd2, 0x26, 0x52,
+		0x38, 0x50, 0x61, 0x8b, 0x51, 0x86, 0x7e, 0xa8, 0x62, 0xe2,
+		0x7d, 0x17, 0xab, 0xad, 0xc1
+	},
+	{ /* 26 */
+		0xf6, 0x33, 0xb7, 0x04, 0x88, 0x62, 0xc7, 0x98, 0x4d, 0x38,
+		0xce, 0x18, 0x91, 0x28, 0xd1, 0x75, 0xe9, 0x2a, 0x87, 0x44,
+		0x46, 0x90, 0x92, 0x4d, 0x2b, 0x5e
+	},
+	{ /* 27 */
+		0xf0, 0x3d, 0x1d, 0x91, 0x90, 0x75, 0x96, 0x30, 0x3a, 0x8b,
+		0x5e, 0x86, 0xc1, 0x69, 0x21, 0xa9, 0xca, 0x66, 0x7b, 0x71,
+		0xc3, 0x19, 0xd5, 0x06, 0x98, 0xa4, 0xd9
+	},
+	{ /* 28 */
+		0xfc, 0x09, 0x1c, 0x0d, 0x12, 0xfb, 0xd0, 0x96, 0x67, 0xae,
+		0x64, 0x29, 0xa7, 0x0c, 0xf7, 0x38, 0x75, 0x77, 0xe9, 0x7f,
+		0xb5, 0x64, 0x79, 0x93, 0xb0, 0x4a, 0x3a, 0xc5
+	},
+	{ /* 29 */
+		0xe4, 0xc1, 0xc4, 0x30, 0xaa, 0x56, 0x50, 0xd9, 0x36, 0x8f,
+		0x4f, 0x20, 0x58, 0xff, 0x57, 0x18, 0x0f, 0xfb, 0x55, 0x52,
+		0xc9, 0x3a, 0x70, 0xbf, 0x99, 0x6c, 0x84, 0x8f, 0xaa
+	},
+	{ /* 30 */
+		0xd4, 0xf6, 0x4d, 0x49, 0xc3, 0xc0, 0x4b, 0x62, 0x05, 0x46,
+		0x67, 0xb1, 0x16, 0xd9, 0x8a, 0x33, 0xb5, 0xf6, 0x48, 0x19,
+		0x12, 0x2e, 0xe4, 0x4a, 0xd8, 0xc3, 0x0b, 0x6a, 0x82, 0x96
+	}
+};
@@ -11,7 +11,8 @@ enum qr_decode {
 	QR_ERROR_FORMAT_ECC,
 	QR_ERROR_DATA_ECC,
 	QR_ERROR_DATA_OVERFLOW,
-	QR_ERROR_DATA_UNDERFLOW
+	QR_ERROR_DATA_UNDERFLOW,
+	QR_ERROR_VERSION_MISMATCH
 };
 
 static const char ALNUM_CHARSET[] =
@@ -19,9 +20,23 @@ static const char ALNUM_CHARSET[] =
 	"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
 	" $%*+-./:";
 
+/* the number of set bits in w */
+static inline unsigned
+popcount64(uint64_t w)
+{
+	w = w - ((w >> 1) & 0x5555555555555555);
+	w = (w & 0x3333333333333333) + ((w >> 2) & 0x3333333333333333);
+	w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0F;
+
+	return (w * 0x0101010101010101) >> 56;
+}
+
 unsigned
 count_data_bits(unsigned ver);
 
+int
+count_codewords(unsigned ver, enum qr_ecl ecl);
+
 void
 append_bits(unsigned v, size_t n, void *buf, size_t *count);
 
@@ -37,23 +52,127 @@ unsigned
 getAlignmentPatternPositions(unsigned ver, unsigned a[static QR_ALIGN_MAX]);
 void
 draw_init(unsigned ver, struct qr *q);
+void
+draw_white_function_modules(struct qr *q, unsigned ver);
 
 extern const int8_t ECL_CODEWORDS_PER_BLOCK[QR_VER_MAX + 1][4];
 extern const int8_t NUM_ERROR_CORRECTION_BLOCKS[QR_VER_MAX + 1][4];
 
+extern const uint8_t gf256_exp[512];
+extern const uint8_t gf256_log[256];
+
+extern const uint8_t RS_GENERATOR[30 + 1][30];
+
+enum rs_kernel {
+	RS_KERNEL_AUTO,
+	RS_KERNEL_WORD,
+	RS_KERNEL_SSSE3,
+	RS_KERNEL_AVX2
+};
+
+/*
+ * Division by one Reed-Solomon generator polynomial; see rs.c.
+ * t[m][0][x] and t[m][1][x] are x * v[m] and (x << 4) * v[m]
+ * as 32 byte lanes packed into 64-bit words.
+ */
+struct rs_encoder {
+	size_t degree;
+	uint64_t t[8][2][16][4];
+	void (*remainder)(const struct rs_encoder *e,
+		const uint8_t *data, size_t len, uint8_t *r);
+};
+
+bool
+rs_encoder_init(struct rs_encoder *e, const uint8_t generator[], size_t degree,
+	enum rs_kernel kernel);
+
 const char *qr_strerror(enum qr_decode err);
 
 bool
 reserved_module(const struct qr *q, unsigned x, unsigned y);
 
+/*
+ * Calls f(opaque, i, module) for the data modules of a version in the order
+ * codeword bits are placed, i counting from 0 and module being y * size + x.
+ * Returns the number of data modules, count_data_bits(ver).
+ */
+size_t
+placement_walk(unsigned ver, void (*f)(void *opaque, size_t i, size_t module), void *opaque);
+
+/*
+ * The module for each bit of the codewords of a version, as placement_walk()
+ * visits them. Built on first use and shared; NULL if it could not be allocated.
+ */
+const uint16_t *
+placement(unsigned ver);
+
+void
+mask_row(enum qr_mask mask, unsigned y, size_t words, uint64_t row[]);
+
+/*
+ * The given mask's pattern for a version, restricted to modules outside the
+ * function patterns, as a bitmap like struct qr or as rows like struct qr_rows.
+ * These are built on first use and shared; NULL if they could not be allocated.
+ */
+const uint8_t *
+mask_plane(unsigned ver, enum qr_mask mask);
+
+const uint64_t *
+mask_plane_rows(unsigned ver, enum qr_mask mask);
+
+/*
+ * Call f(opaque, i) for each i in [0, n), concurrently if pool is non-NULL.
+ */
+void
+qr_pool_run(struct qr_pool *pool, size_t n,
+	void (*f)(void *opaque, size_t i), void *opaque);
+
 bool
 qr_encode(struct qr_segment * const segs[], size_t len, enum qr_ecl ecl,
 	unsigned min, unsigned max, int mask, bool boost_ecl, void *tmp, struct qr *q);
 
+bool
+qr_encode_opt(struct qr_segment * const segs[], size_t len, enum qr_ecl ecl,
+	unsigned min, unsigned max, int mask, bool boost_ecl,
+	const struct qr_options *opt, void *tmp, struct qr *q);
+
+size_t
+qr_encode_batch(struct qr_segment * const * const segs[], const size_t len[], size_t count,
+	enum qr_ecl ecl, unsigned min, unsigned max, int mask, bool boost_ecl,
+	const struct qr_options *opt, void *tmp, struct qr q[]);
+
+/*
+ * Decodes q's segments to data->a[0 : data->n], each allocated as by the
+ * segment constructors. For a symbol with no segments, data->n is 0 and
+ * data->a may be NULL; qr_data_free() accepts either.
+ */
 enum qr_decode
 qr_decode(const struct qr *q,
 	struct qr_data *data, struct qr_stats *stats,
 	void *tmp);
 
+enum qr_decode
+qr_decode_opt(const struct qr *q, const struct qr_options *opt,
+	struct qr_data *data, struct qr_stats *stats,
+	void *tmp);
+
+/*
+ * Frees data->a and its segments, and leaves data empty. data->a may be
+ * NULL when data->n is 0.
+ */
+void
+qr_data_free(struct qr_data *data);
+
+enum qr_decode
+qr_decode_views(const struct qr *q, const struct qr_options *opt,
+	struct qr_views *views, struct qr_stats *stats,
+	void *tmp);
+
+enum qr_decode
+qr_decode_soft(const uint8_t *y, size_t stride, size_t size,
+	const struct qr_options *opt,
+	struct qr_data *data, struct qr_stats *stats,
+	void *tmp);
+
 #endif
 
@@ -20,6 +20,22 @@ qr_print_pbm4(FILE *f, const struct qr *q, bool invert);
 void
 qr_print_svg(FILE *f, const struct qr *q, bool invert);
 
+/*
+ * Load a P1 or P4 PBM with a light border. The image may be scaled up
+ * by any number of pixels per module, which is measured from the
+ * top-left finder pattern, and each module is read at its centre.
+ * q->map must have room for QR_BUF_LEN_MAX bytes. On error these
+ * return false and set errno; EINVAL for a malformed image.
+ *
+ * qr_load_pbm_buf() parses len bytes in place, and qr_load_pbm_file()
+ * maps the named file to do the same. qr_load_pbm() reads f to EOF.
+ */
+bool
+qr_load_pbm_buf(const void *buf, size_t len, struct qr *q, bool invert);
+
+bool
+qr_load_pbm_file(const char *path, struct qr *q, bool invert);
+
 bool
 qr_load_pbm(FILE *f, struct qr *q, bool invert);
 
@@ -23,133 +23,386 @@
  * libpnmio. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 2
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <ctype.h>
 #include <string.h>
 
 #include <eci.h>
 #include <qr.h>
 #include <io.h>
 
-#define MAXLINE 1024
+/*
+ * A PBM image, parsed in place. Rows are .stride bytes, packed as for P4:
+ * the leftmost pixel in the high bit, and 1 is black.
+ */
+struct pbm {
+	const uint8_t *rows;
+	size_t stride;
+	size_t width, height;
+};
+
+/* the pixel order of a P4 row is the reverse of a QR row word's */
+static uint64_t
+pbm_reverse64(uint64_t w)
+{
+	w = (w & UINT64_C(0x5555555555555555)) << 1  | ((w >> 1)  & UINT64_C(0x5555555555555555));
+	w = (w & UINT64_C(0x3333333333333333)) << 2  | ((w >> 2)  & UINT64_C(0x3333333333333333));
+	w = (w & UINT64_C(0x0F0F0F0F0F0F0F0F)) << 4  | ((w >> 4)  & UINT64_C(0x0F0F0F0F0F0F0F0F));
+	w = (w & UINT64_C(0x00FF00FF00FF00FF)) << 8  | ((w >> 8)  & UINT64_C(0x00FF00FF00FF00FF));
+	w = (w & UINT64_C(0x0000FFFF0000FFFF)) << 16 | ((w >> 16) & UINT64_C(0x0000FFFF0000FFFF));
+	w = w << 32 | w >> 32;
+
+	return w;
+}
+
+/* PBM whitespace, per pnm(5) */
+static bool
+pbm_space(uint8_t c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
 
 /*
- * Read the data contents of a PBM (portable bit map) file.
+ * Skip whitespace and comments, which run from '#' to the end of the line.
  */
 static void
-read_pbm_data(FILE *f, bool *img, bool ascii)
+pbm_skip(const uint8_t **p, const uint8_t *e)
 {
-	int i, c;
-	int v;
-	int k;
+	while (*p < e) {
+		if (**p == '#') {
+			while (*p < e && **p != '\n' && **p != '\r') {
+				(*p)++;
+			}
+		} else if (pbm_space(**p)) {
+			(*p)++;
+		} else {
+			break;
+		}
+	}
+}
 
-	i = 0;
+static bool
+pbm_uint(const uint8_t **p, const uint8_t *e, size_t *v)
+{
+	pbm_skip(p, e);
 
-	/* Read the rest of the PBM file. */
-	while (c = fgetc(f), c != EOF) {
-		ungetc(c, f);
+	if (*p == e || **p < '0' || **p > '9') {
+		return false;
+	}
 
-		if (ascii) {
-			if (fscanf(f, "%d", &v) != 1) return;
-			img[i++] = v;
-		} else {
-			v = fgetc(f);
-			for (k = 0; k < 8; k++) {
-				img[i++] = (v >> (7 - k)) & 0x1;
-			}
+	*v = 0;
+
+	while (*p < e && **p >= '0' && **p <= '9') {
+		if (*v > (SIZE_MAX - 9) / 10) {
+			return false;
 		}
+
+		*v = *v * 10 + (**p - '0');
+		(*p)++;
 	}
 
-	fclose(f);
+	return true;
 }
 
 /*
- * Read the header contents of a PBM (Portable Binary Map) file.
- * An ASCII PBM image file follows the format:
- * P1
- * <X> <Y>
- * <I1> <I2> ... <IMAX>
- * A binary PBM image file uses P4 instead of P1 and
- * the data values are represented in binary.
- * NOTE1: Comment lines start with '#'.
- * NOTE2: < > denote integer values (in decimal).
+ * Parse the header, and for P4 point into the buffer for the rows.
+ * Plain (P1) pixels are packed to *tmp, which the caller frees.
+ * Pixels may run together, and there may be comments between them.
  */
-static void
-read_pbm_header(FILE *f, size_t *width, size_t *height, bool *ascii)
+static bool
+pbm_parse(const uint8_t *p, size_t len, struct pbm *img, uint8_t **tmp)
 {
-	bool flag;
-	size_t x, y;
-	unsigned int i;
-	char magic[MAXLINE];
-	char line[MAXLINE];
-	int n = 0;
-
-	/* Read the PBM file header. */
-	while (fgets(line, MAXLINE, f) != NULL) {
-		flag = false;
-
-		for (i = 0; i < strlen(line); i++) {
-			if (isgraph(line[i])) {
-				if ((line[i] == '#') && !flag) {
-					flag = true;
+	const uint8_t *e = p + len;
+	bool plain;
+
+	*tmp = NULL;
+
+	if (len < 2 || p[0] != 'P' || (p[1] != '1' && p[1] != '4')) {
+		return false;
+	}
+
+	plain = p[1] == '1';
+	p += 2;
+
+	if (!pbm_uint(&p, e, &img->width) || !pbm_uint(&p, e, &img->height)) {
+		return false;
+	}
+
+	if (img->width == 0 || img->height == 0) {
+		return false;
+	}
+
+	img->stride = BM_LEN(img->width);
+
+	if (img->height > SIZE_MAX / img->stride) {
+		return false;
+	}
+
+	if (!plain) {
+		/* exactly one whitespace character before the raster */
+		if (p == e || !pbm_space(*p)) {
+			return false;
+		}
+		p++;
+
+		if ((size_t) (e - p) < img->stride * img->height) {
+			return false;
+		}
+
+		img->rows = p;
+		return true;
+	}
+
+	*tmp = calloc(img->height, img->stride);
+	if (*tmp == NULL) {
+		return false;
+	}
+
+	for (size_t y = 0; y < img->height; y++) {
+		uint8_t *row = *tmp + y * img->stride;
+
+		for (size_t x = 0; x < img->width; x++) {
+			if (p == e || (*p != '0' && *p != '1')) {
+				pbm_skip(&p, e);
+
+				if (p == e || (*p != '0' && *p != '1')) {
+					free(*tmp);
+					*tmp = NULL;
+					return false;
 				}
 			}
+
+			row[x / 8] |= (*p - '0') << (7 - x % 8);
+			p++;
 		}
+	}
 
-		if (!flag) {
-			if (n == 0) {
-				n += sscanf(line, "%s %zu %zu", magic, &x, &y);
-			} else if (n == 1) {
-				n += sscanf(line, "%zu %zu", &x, &y);
-			} else if (n == 2) {
-				n += sscanf(line, "%zu", &y);
-			}
+	img->rows = *tmp;
+	return true;
+}
+
+/*
+ * Pixels [x, x + 64) of row y, as for a QR row word: pixel x + i is bit i.
+ * Pixels past the end of the row are unspecified.
+ */
+static uint64_t
+pbm_word(const struct pbm *img, size_t y, size_t x)
+{
+	const uint8_t *row = img->rows + y * img->stride;
+	const size_t i = x / 8;
+	const unsigned s = x % 8;
+	uint64_t w = 0;
+
+	/* big-endian, so pixel x is the high bit after the shift */
+	if (i + 8 <= img->stride) {
+		for (unsigned k = 0; k < 8; k++) {
+			w = w << 8 | row[i + k];
+		}
+	} else {
+		for (unsigned k = 0; k < 8; k++) {
+			w = w << 8 | (i + k < img->stride ? row[i + k] : 0);
 		}
+	}
 
-		if (n == 3) {
-			break;
+	w <<= s;
+	if (s > 0 && i + 8 < img->stride) {
+		w |= row[i + 8] >> (8 - s);
+	}
+
+	return pbm_reverse64(w);
+}
+
+/* true if pixels [x, x + n) of row y are all light */
+static bool
+pbm_light(const struct pbm *img, size_t y, size_t x, size_t n, bool invert)
+{
+	const uint8_t *row = img->rows + y * img->stride;
+	const uint8_t flip = invert ? 0xFF : 0x00;
+
+	while (n > 0) {
+		const unsigned s = x % 8;
+		const unsigned k = n < 8 - s ? n : 8 - s;
+		const uint8_t m = (0xFF >> s) & (0xFF << (8 - s - k));
+
+		if (((row[x / 8] ^ flip) & m) != 0) {
+			return false;
 		}
+
+		x += k;
+		n -= k;
 	}
 
-	if (strcmp(magic, "P1") == 0) {
-		*ascii = true;
-	} else if (strcmp(magic, "P4") == 0) {
-		*ascii = false;
-	} else {
-		fprintf(stderr, "Error: Input file not in PBM format!\n");
-		exit(1);
+	return true;
+}
+
+/*
+ * The pixels at columns px[0 : n] of row y, for n <= 64,
+ * as for a QR row word: pixel px[i] is bit i.
+ */
+static uint64_t
+pbm_sample(const struct pbm *img, size_t y, const size_t *px, unsigned n)
+{
+	const uint8_t *row = img->rows + y * img->stride;
+	uint64_t w = 0;
+
+	for (unsigned i = 0; i < n; i++) {
+		w |= (uint64_t) ((row[px[i] / 8] >> (7 - px[i] % 8)) & 1) << i;
 	}
 
-	*width  = x;
-	*height = y;
+	return w;
 }
 
+/*
+ * The border is found by walking the diagonal to the first dark pixel,
+ * which is the corner of the top-left finder pattern, and must be light
+ * all round. The finder's top edge is a run of seven dark modules,
+ * which gives the pitch closely enough to find the timing pattern,
+ * and that gives the version exactly. Each module is then read from
+ * the pixel at its centre.
+ */
 static bool
-quiet(size_t width, size_t height, size_t border, const bool *img)
+pbm_load(const struct pbm *img, struct qr *q, bool invert)
 {
-	size_t x, y;
+	size_t border, width, run, size;
+	size_t px[QR_SIZE(QR_VER_MAX)];
+	unsigned ver;
 
-	assert(width == height);
-	assert(border <= width);
-	assert(img != NULL);
+	if (img->width != img->height) {
+		return false;
+	}
 
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < border; x++) {
-			if (img[y * height + x] || img[y * height + (width - 1 - x)]) {
-				return false;
+	for (border = 0; border < img->width; border++) {
+		if (!pbm_light(img, border, border, 1, invert)) {
+			break;
+		}
+	}
+
+	if (border * 2 >= img->width) {
+		return false;
+	}
+
+	width = img->width - border * 2;
+
+	for (run = 0; run < width; run++) {
+		if (pbm_light(img, border, border + run, 1, invert)) {
+			break;
+		}
+	}
+
+	/*
+	 * Module row 6 runs along the bottom edge of both top finders,
+	 * with the timing pattern between them; that's 2 * ver + 3 dark runs.
+	 * Its centre is 6.5 modules down, and the finder is 7 modules wide.
+	 */
+	{
+		size_t y = border + run * 13 / 14;
+		size_t runs = 0;
+		bool prev = false;
+
+		for (size_t x = border; x < border + width; x++) {
+			bool v = !pbm_light(img, y, x, 1, invert);
+
+			if (v && !prev) {
+				runs++;
 			}
+			prev = v;
+		}
+
+		if (runs < 2 * QR_VER_MIN + 3 || runs > 2 * QR_VER_MAX + 3 || runs % 2 == 0) {
+			return false;
 		}
+
+		ver = (runs - 3) / 2;
 	}
 
-	for (y = 0; y < border; y++) {
-		for (x = 0; x < width; x++) {
-			if (img[y * height + x] || img[(height - 1 - y) * height + x]) {
+	size = QR_SIZE(ver);
+	if (size > width) {
+		return false;
+	}
+
+	for (size_t y = 0; y < img->height; y++) {
+		if (y < border || y >= border + width) {
+			if (!pbm_light(img, y, 0, img->width, invert)) {
 				return false;
 			}
+			continue;
+		}
+
+		if (!pbm_light(img, y, 0, border, invert)
+		 || !pbm_light(img, y, border + width, border, invert)) {
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < size; i++) {
+		px[i] = border + ((2 * i + 1) * width) / (2 * size);
+	}
+
+	q->size = size;
+
+	/*
+	 * The rows run on unpadded through q->map, so each word is shifted
+	 * in after the bits left over from the last, and whole bytes stored.
+	 */
+	{
+		uint64_t acc = 0;
+		unsigned n = 0; /* bits pending in acc, < 8 */
+		uint8_t *d = q->map;
+
+		for (size_t y = 0; y < size; y++) {
+			for (size_t x = 0; x < size; x += 64) {
+				const unsigned bits = size - x < 64 ? size - x : 64;
+				uint64_t w, lo, hi;
+				unsigned total;
+
+				if (width == size) {
+					w = pbm_word(img, border + y, border + x);
+				} else {
+					w = pbm_sample(img, px[y], px + x, bits);
+				}
+				if (invert) {
+					w = ~w;
+				}
+				if (bits < 64) {
+					w &= (UINT64_C(1) << bits) - 1;
+				}
+
+				lo = acc | w << n;
+				hi = n > 0 ? w >> (64 - n) : 0;
+				total = n + bits;
+
+				if (total >= 64) {
+					for (unsigned j = 0; j < 8; j++) {
+						*d++ = lo >> (8 * j);
+					}
+					acc = hi;
+					n = total - 64;
+				} else {
+					for (unsigned j = 0; j < total / 8; j++) {
+						*d++ = lo >> (8 * j);
+					}
+					acc = total >= 8 ? lo >> (total / 8 * 8) : lo;
+					n = total % 8;
+				}
+			}
+		}
+
+		if (n > 0) {
+			*d = (*d & ~((1U << n) - 1)) | acc;
 		}
 	}
 
@@ -157,72 +410,115 @@ quiet(size_t width, size_t height, size_t border, const bool *img)
 }
 
 bool
-qr_load_pbm(FILE *f, struct qr *q, bool invert)
+qr_load_pbm_buf(const void *buf, size_t len, struct qr *q, bool invert)
 {
-	bool ascii;
-	size_t width, height;
-	bool *img;
-	size_t border;
+	struct pbm img;
+	uint8_t *tmp;
+	bool r;
 
-	read_pbm_header(f, &width, &height, &ascii);
+	assert(buf != NULL || len == 0);
+	assert(q != NULL);
+	assert(q->map != NULL);
 
-	if (width != height) {
-		return false;
-	}
+	/* calloc(3) sets ENOMEM for itself */
+	errno = EINVAL;
 
-	img = malloc((width * height) * sizeof(int));
-	if (img == NULL) {
+	if (!pbm_parse(buf, len, &img, &tmp)) {
 		return false;
 	}
 
-	read_pbm_data(f, img, ascii);
+	r = pbm_load(&img, q, invert);
 
-	{
-		size_t i;
+	free(tmp);
 
-		border = 0;
+	return r;
+}
 
-		for (i = 0; i < width; i++) {
-			if (img[i * height + i]) {
-				break;
-			}
+bool
+qr_load_pbm_file(const char *path, struct qr *q, bool invert)
+{
+	struct stat st;
+	void *p;
+	bool r;
+	int fd, e;
 
-			border++;
-		}
+	assert(path != NULL);
+	assert(q != NULL);
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		e = errno;
+		close(fd);
+		errno = e;
+		return false;
 	}
 
-	/* XXX: heed invert */
-	(void) invert;
+	/* mmap(2) refuses an empty mapping */
+	if (st.st_size == 0) {
+		close(fd);
+		errno = EINVAL;
+		return false;
+	}
 
-	if (!quiet(width, height, border, img)) {
-		fprintf(stderr, "pixel in quiet zone\n"); /* XXX: error enum */
-		goto error;
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	e = errno;
+	close(fd);
+	if (p == MAP_FAILED) {
+		errno = e;
+		return false;
 	}
 
-	q->size = width - border * 2;
+	r = qr_load_pbm_buf(p, st.st_size, q, invert);
 
-	{
-		size_t x, y;
+	e = errno;
+	munmap(p, st.st_size);
+	errno = e;
+
+	return r;
+}
+
+bool
+qr_load_pbm(FILE *f, struct qr *q, bool invert)
+{
+	uint8_t *buf = NULL;
+	size_t len = 0, max = 0;
+	bool r;
 
-		for (y = border; y < height - border; y++) {
-			for (x = border; x < width - border; x++) {
-				bool v;
+	assert(f != NULL);
+	assert(q != NULL);
 
-				v = img[y * height + x];
+	for (;;) {
+		if (len == max) {
+			uint8_t *tmp;
 
-				qr_set_module(q, x - border, y - border, v);
+			max = max == 0 ? 4096 : max * 2;
+			tmp = realloc(buf, max);
+			if (tmp == NULL) {
+				free(buf);
+				return false;
 			}
+			buf = tmp;
 		}
-	}
 
-	free(img);
+		len += fread(buf + len, 1, max - len, f);
+		if (len < max) {
+			break;
+		}
+	}
 
-	return true;
+	if (ferror(f)) {
+		free(buf);
+		errno = EIO;
+		return false;
+	}
 
-error:
+	r = qr_load_pbm_buf(buf, len, q, invert);
 
-	free(img);
+	free(buf);
 
-	return false;
+	return r;
 }
-
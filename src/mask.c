@@ -42,11 +42,15 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <string.h>
 
 #include <eci.h>
 #include <qr.h>
@@ -78,20 +82,165 @@ mask_bit(enum qr_mask mask, unsigned x, unsigned y)
 	return false;
 }
 
+/*
+ * The mask pattern for row y, as words like QR_ROW(). Every mask repeats
+ * every six columns, so each word is its first six bits replicated,
+ * beginning at the phase where that word starts.
+ */
 void
-qr_apply_mask(struct qr *q, enum qr_mask mask)
+mask_row(enum qr_mask mask, unsigned y, size_t words, uint64_t row[])
 {
-	assert(q != NULL);
-	assert(QR_SIZE(QR_VER_MIN) <= q->size && q->size <= QR_SIZE(QR_VER_MAX));
+	unsigned p = 0;
+
+	for (unsigned x = 0; x < 6; x++) {
+		p |= (unsigned) mask_bit(mask, x, y) << x;
+	}
+
+	for (size_t k = 0; k < words; k++) {
+		unsigned phase = k * 64 % 6;
+		uint64_t w = ((p >> phase) | (p << (6 - phase))) & 0x3F;
+
+		w |= w << 6;
+		w |= w << 12;
+		w |= w << 24;
+		w |= w << 48;
+
+		row[k] = w;
+	}
+}
+
+/*
+ * XOR the mask pattern into every module outside the function patterns,
+ * row by row. This is how the cached planes are made, and the fallback
+ * if they cannot be.
+ */
+static void
+apply_rows(struct qr *q, enum qr_mask mask)
+{
+	const size_t words = QR_ROW_WORDS(q->size);
+	struct qr region;
+
+	region.size = q->size;
+	region.map  = (uint8_t *) qr_data_region(QR_VER(q->size));
 
 	for (unsigned y = 0; y < q->size; y++) {
-		for (unsigned x = 0; x < q->size; x++) {
-			if (reserved_module(q, x, y)) {
-				continue;
-			}
+		uint64_t row[QR_ROW_WORDS_MAX], d[QR_ROW_WORDS_MAX], m[QR_ROW_WORDS_MAX];
+
+		qr_get_row(q, y, row);
+		qr_get_row(&region, y, d);
+		mask_row(mask, y, words, m);
 
-			qr_set_module(q, x, y, qr_get_module(q, x, y) ^ mask_bit(mask, x, y));
+		for (size_t k = 0; k < words; k++) {
+			row[k] ^= m[k] & d[k];
 		}
+
+		qr_set_row(q, y, row);
+	}
+}
+
+/*
+ * The eight mask planes for each version, built on first use and kept for
+ * the life of the process. Each is laid out as the eight planes in rows
+ * (QR_ROWS_LEN(ver) words each) followed by the same eight as bitmaps
+ * (QR_BUF_LEN(ver) bytes each).
+ */
+static pthread_mutex_t planes_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *planes[QR_VER_MAX + 1];
+
+static uint64_t *
+get_planes(unsigned ver)
+{
+	uint64_t *p;
+
+	assert(QR_VER_MIN <= ver && ver <= QR_VER_MAX);
+
+	pthread_mutex_lock(&planes_lock);
+
+	p = planes[ver];
+	if (p != NULL) {
+		goto done;
+	}
+
+	p = malloc(8 * (QR_ROWS_LEN(ver) * sizeof *p + QR_BUF_LEN(ver)));
+	if (p == NULL) {
+		goto done;
+	}
+
+	for (int mask = 0; mask < 8; mask++) {
+		struct qr_rows r;
+		struct qr q;
+
+		q.size = QR_SIZE(ver);
+		q.map  = (uint8_t *) &p[8 * QR_ROWS_LEN(ver)] + mask * QR_BUF_LEN(ver);
+		memset(q.map, 0, QR_BUF_LEN(ver));
+		apply_rows(&q, mask);
+
+		r.words = &p[mask * QR_ROWS_LEN(ver)];
+		qr_get_rows(&q, &r);
+	}
+
+	planes[ver] = p;
+
+done:
+
+	pthread_mutex_unlock(&planes_lock);
+
+	return p;
+}
+
+const uint8_t *
+mask_plane(unsigned ver, enum qr_mask mask)
+{
+	assert(0 <= mask && mask <= 7);
+
+	uint64_t *p = get_planes(ver);
+	if (p == NULL) {
+		return NULL;
+	}
+
+	return (const uint8_t *) &p[8 * QR_ROWS_LEN(ver)] + mask * QR_BUF_LEN(ver);
+}
+
+const uint64_t *
+mask_plane_rows(unsigned ver, enum qr_mask mask)
+{
+	assert(0 <= mask && mask <= 7);
+
+	uint64_t *p = get_planes(ver);
+	if (p == NULL) {
+		return NULL;
 	}
+
+	return &p[mask * QR_ROWS_LEN(ver)];
 }
 
+void
+qr_apply_mask(struct qr *q, enum qr_mask mask)
+{
+	assert(q != NULL);
+	assert(QR_SIZE(QR_VER_MIN) <= q->size && q->size <= QR_SIZE(QR_VER_MAX));
+
+	const size_t len = QR_BUF_LEN(QR_VER(q->size));
+	const uint8_t *plane;
+	size_t i;
+
+	plane = mask_plane(QR_VER(q->size), mask);
+	if (plane == NULL) {
+		apply_rows(q, mask);
+		return;
+	}
+
+	// Bits past the end of the symbol are zero in the plane, so are untouched
+	for (i = 0; i + 8 <= len; i += 8) {
+		uint64_t w, m;
+
+		memcpy(&w, &q->map[i], sizeof w);
+		memcpy(&m, &plane[i], sizeof m);
+		w ^= m;
+		memcpy(&q->map[i], &w, sizeof w);
+	}
+
+	for ( ; i < len; i++) {
+		q->map[i] ^= plane[i];
+	}
+}
@@ -42,7 +42,10 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -53,66 +56,147 @@
 
 #include "internal.h"
 
-bool
-reserved_module(const struct qr *q, unsigned x, unsigned y)
+/* the sum of QR_BUF_LEN(ver) over all versions */
+#define REGIONS_LEN 59700
+
+static pthread_once_t regions_once = PTHREAD_ONCE_INIT;
+static uint8_t regions[REGIONS_LEN];
+static uint8_t templates[REGIONS_LEN];
+static size_t region_offset[QR_VER_MAX + 1];
+
+static void
+regions_init(void)
 {
-	int ax = -1, ay = -1;
-	size_t i;
-	unsigned ver;
+	size_t offset = 0;
 
-	ver = QR_VER(q->size);
+	for (unsigned ver = QR_VER_MIN; ver <= QR_VER_MAX; ver++) {
+		const size_t bits = QR_SIZE(ver) * QR_SIZE(ver);
+		struct qr q;
+
+		assert(offset + QR_BUF_LEN(ver) <= sizeof regions);
+
+		region_offset[ver] = offset;
+		q.map = &templates[offset];
+
+		/* draw_init() marks the function modules, which are everything else */
+		draw_init(ver, &q);
+
+		for (size_t i = 0; i < QR_BUF_LEN(ver); i++) {
+			regions[offset + i] = ~q.map[i];
+		}
+		if (bits % 8 != 0) {
+			regions[offset + BM_BYTE(bits)] &= (1U << BM_BIT(bits)) - 1;
+		}
+
+		draw_white_function_modules(&q, ver);
+
+		offset += QR_BUF_LEN(ver);
+	}
+
+	assert(offset == sizeof regions);
+}
+
+const uint8_t *
+qr_data_region(unsigned ver)
+{
+	assert(ver >= QR_VER_MIN && ver <= QR_VER_MAX);
+
+	pthread_once(&regions_once, regions_init);
+
+	return &regions[region_offset[ver]];
+}
+
+const uint8_t *
+qr_function_template(unsigned ver)
+{
 	assert(ver >= QR_VER_MIN && ver <= QR_VER_MAX);
 
-	/* Finder + format: top left */
-	if (x < 9 && y < 9)
-		return true;
+	pthread_once(&regions_once, regions_init);
 
-	/* Finder + format: bottom left */
-	if (x + 8 >= q->size && y < 9)
-		return true;
+	return &templates[region_offset[ver]];
+}
 
-	/* Finder + format: top right */
-	if (x < 9 && y + 8 >= q->size)
-		return true;
+static pthread_mutex_t placement_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint16_t *placements[QR_VER_MAX + 1];
 
-	/* Exclude timing patterns */
-	if (x == 6 || y == 6)
-		return true;
+size_t
+placement_walk(unsigned ver, void (*f)(void *opaque, size_t i, size_t module), void *opaque)
+{
+	const uint8_t *region = qr_data_region(ver);
+	const unsigned size = QR_SIZE(ver);
+	size_t i = 0;
 
-	/* Exclude ver info, if it exists. Version info sits adjacent to
-	 * the top-right and bottom-left finders in three rows, bounded by
-	 * the timing pattern.
+	/*
+	 * The zigzag: pairs of columns from the right, alternately upwards
+	 * and downwards, skipping the column of the vertical timing pattern.
 	 */
-	if (ver >= 7) {
-		if (x < 6 && y + 11 >= q->size)
-			return true;
-		if (x + 11 >= q->size && y < 6)
-			return true;
-	}
+	for (int right = size - 1; right >= 1; right -= 2) {
+		if (right == 6)
+			right = 5;
+
+		bool upward = ((right + 1) & 2) == 0;
 
-	/* Exclude alignment patterns */
-	unsigned alignPatPos[QR_ALIGN_MAX];
-	size_t n = getAlignmentPatternPositions(ver, alignPatPos);
-	for (i = 0; i < n; i++) {
-		int p = alignPatPos[i];
+		for (unsigned vert = 0; vert < size; vert++) {
+			unsigned y = upward ? size - 1 - vert : vert;
 
-		if (abs(p - x) < 3)
-			ax = i;
-		if (abs(p - y) < 3)
-			ay = i;
+			for (int j = 0; j < 2; j++) {
+				size_t m = (size_t) y * size + right - j;
+
+				if (BM_GET(region, m)) {
+					f(opaque, i++, m);
+				}
+			}
+		}
 	}
 
-	if (ax >= 0 && ay >= 0) {
-		i--;
-		if (ax > 0 && ax < (int) i)
-			return true;
-		if (ay > 0 && ay < (int) i)
-			return true;
-		if (ay == (int) i && ax == (int) i)
-			return true;
+	assert(i == count_data_bits(ver));
+
+	return i;
+}
+
+static void
+placement_store(void *opaque, size_t i, size_t module)
+{
+	uint16_t *t = opaque;
+
+	assert(module <= UINT16_MAX);
+
+	t[i] = module;
+}
+
+const uint16_t *
+placement(unsigned ver)
+{
+	uint16_t *t;
+
+	assert(ver >= QR_VER_MIN && ver <= QR_VER_MAX);
+
+	pthread_mutex_lock(&placement_lock);
+
+	t = placements[ver];
+	if (t == NULL) {
+		t = malloc(count_data_bits(ver) * sizeof *t);
+		if (t != NULL) {
+			placement_walk(ver, placement_store, t);
+			placements[ver] = t;
+		}
 	}
 
-	return false;
+	pthread_mutex_unlock(&placement_lock);
+
+	return t;
+}
+
+bool
+reserved_module(const struct qr *q, unsigned x, unsigned y)
+{
+	unsigned ver;
+
+	ver = QR_VER(q->size);
+	assert(ver >= QR_VER_MIN && ver <= QR_VER_MAX);
+	assert(x < q->size && y < q->size);
+
+	return !BM_GET(qr_data_region(ver), (size_t) y * q->size + x);
 }
 
 bool
@@ -139,6 +223,102 @@ qr_set_module(struct qr *q, unsigned x, unsigned y, bool v)
 	}
 }
 
+void
+qr_get_row(const struct qr *q, unsigned y, uint64_t row[])
+{
+	assert(q != NULL);
+	assert(QR_SIZE(QR_VER_MIN) <= q->size && q->size <= QR_SIZE(QR_VER_MAX));
+	assert(y < q->size);
+	assert(row != NULL);
+
+	const size_t start = (size_t) y * q->size;
+	const size_t last = (start + q->size - 1) / 8; /* the last byte with bits of this row */
+	const unsigned shift = start % 8;
+	const size_t words = QR_ROW_WORDS(q->size);
+
+	// Word k is the 64 bits from byte start / 8 + 8k onwards, less the
+	// leading shift bits; that spans nine bytes unless the row is aligned.
+	for (size_t k = 0, b = start / 8; k < words; k++, b += 8) {
+		uint64_t w = 0;
+
+		for (unsigned j = 0; j < (shift ? 9U : 8U) && b + j <= last; j++) {
+			uint64_t c = q->map[b + j];
+
+			w |= j == 0 ? c >> shift : c << (j * 8 - shift);
+		}
+
+		row[k] = w;
+	}
+
+	if (q->size % 64 != 0) {
+		row[words - 1] &= ((uint64_t) 1 << (q->size % 64)) - 1;
+	}
+}
+
+void
+qr_set_row(struct qr *q, unsigned y, const uint64_t row[])
+{
+	assert(q != NULL);
+	assert(QR_SIZE(QR_VER_MIN) <= q->size && q->size <= QR_SIZE(QR_VER_MAX));
+	assert(y < q->size);
+	assert(row != NULL);
+
+	const size_t start = (size_t) y * q->size;
+	const size_t end = start + q->size;
+	const size_t words = QR_ROW_WORDS(q->size);
+
+	// Byte d holds row bits [8d - start, 8d - start + 8), clipped to the row
+	for (size_t d = start / 8; d <= (end - 1) / 8; d++) {
+		long off = (long) (d * 8) - (long) start;
+		uint8_t m = 0xFF;
+		uint64_t v;
+
+		if (off < 0) {
+			v = row[0] << -off;
+			m &= 0xFF << -off;
+		} else {
+			size_t k = off / 64;
+			unsigned s = off % 64;
+
+			v = row[k] >> s;
+			if (s > 56 && k + 1 < words) {
+				v |= row[k + 1] << (64 - s);
+			}
+		}
+
+		if (d * 8 + 8 > end) {
+			m &= 0xFF >> (d * 8 + 8 - end);
+		}
+
+		q->map[d] = (q->map[d] & ~m) | (v & m);
+	}
+}
+
+void
+qr_get_rows(const struct qr *q, struct qr_rows *r)
+{
+	assert(q != NULL);
+	assert(r != NULL);
+
+	r->size = q->size;
+
+	for (unsigned y = 0; y < q->size; y++) {
+		qr_get_row(q, y, QR_ROW(r, y));
+	}
+}
+
+void
+qr_set_rows(struct qr *q, const struct qr_rows *r)
+{
+	assert(q != NULL);
+	assert(r != NULL);
+	assert(r->size == q->size);
+
+	for (unsigned y = 0; y < q->size; y++) {
+		qr_set_row(q, y, QR_ROW(r, y));
+	}
+}
+
 // Sets the module at the given coordinates, doing nothing if out of bounds.
 void
 set_module_bounded(struct qr *q, unsigned x, unsigned y, bool v)
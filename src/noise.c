@@ -14,20 +14,15 @@ void
 qr_noise(struct qr *q, size_t n, long seed, bool skip_reserved)
 {
 	const size_t bits = q->size * q->size;
-	uint8_t buf[QR_BUF_LEN_MAX] = { 0 };
 	uint8_t noise[QR_BUF_LEN_MAX] = { 0 };
+	const uint8_t *region;
 	pcg32_random_t pcg;
-	struct qr reserved;
 	size_t i;
 
 	const unsigned ver = QR_VER(q->size);
 
-	reserved.size = q->size;
-	reserved.map  = buf;
-
-	/* TODO: merge with reserved_module() */
 	/* TODO: generalise to an enum describing regions; format, ecc, alignments, data, etc. mask together */
-	draw_init(ver, &reserved);
+	region = qr_data_region(ver);
 
 	pcg32_srandom_r(&pcg, seed, 0);
 
@@ -41,7 +36,7 @@ qr_noise(struct qr *q, size_t n, long seed, bool skip_reserved)
 		i = pcg32_boundedrand_r(&pcg, bits + 1);
 
 		if (skip_reserved) {
-			if (BM_GET(reserved.map, i)) {
+			if (!BM_GET(region, i)) {
 				continue;
 			}
 		}
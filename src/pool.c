@@ -0,0 +1,184 @@
+
+/*
+ * A small pool of worker threads for running independent work items,
+ * such as the Reed-Solomon blocks of one symbol, concurrently.
+ *
+ * The pool runs one job at a time. A job is a function called once for
+ * each index in [0, n); workers and the calling thread claim indices in
+ * turn until none remain, and qr_pool_run() returns once every call has
+ * finished. Concurrent callers are serialised.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <eci.h>
+#include <qr.h>
+
+#include "internal.h"
+
+struct qr_pool {
+	pthread_mutex_t run;   /* held for the duration of a job */
+	pthread_mutex_t lock;  /* protects everything below */
+	pthread_cond_t work;   /* a job was posted, or the pool is closing */
+	pthread_cond_t done;   /* the last item of a job finished */
+
+	void (*f)(void *opaque, size_t i);
+	void *opaque;
+	size_t n;       /* number of items in the current job */
+	size_t next;    /* the next item to claim */
+	size_t pending; /* items claimed or unclaimed, but not yet finished */
+	bool quit;
+
+	unsigned threads;
+	pthread_t tid[];
+};
+
+/* call with pool->lock held */
+static void
+drain(struct qr_pool *pool)
+{
+	while (pool->next < pool->n) {
+		void (*f)(void *opaque, size_t i) = pool->f;
+		void *opaque = pool->opaque;
+		size_t i = pool->next++;
+
+		pthread_mutex_unlock(&pool->lock);
+		f(opaque, i);
+		pthread_mutex_lock(&pool->lock);
+
+		assert(pool->pending > 0);
+		if (--pool->pending == 0) {
+			pthread_cond_signal(&pool->done);
+		}
+	}
+}
+
+static void *
+worker(void *arg)
+{
+	struct qr_pool *pool = arg;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (;;) {
+		while (!pool->quit && pool->next == pool->n) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+
+		if (pool->quit) {
+			break;
+		}
+
+		drain(pool);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+struct qr_pool *
+qr_pool_create(unsigned threads)
+{
+	struct qr_pool *pool;
+	int e;
+
+	pool = malloc(sizeof *pool + threads * sizeof *pool->tid);
+	if (pool == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->run, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	pool->f       = NULL;
+	pool->opaque  = NULL;
+	pool->n       = 0;
+	pool->next    = 0;
+	pool->pending = 0;
+	pool->quit    = false;
+	pool->threads = 0;
+
+	for (unsigned i = 0; i < threads; i++) {
+		e = pthread_create(&pool->tid[i], NULL, worker, pool);
+		if (e != 0) {
+			qr_pool_destroy(pool);
+			errno = e;
+			return NULL;
+		}
+
+		pool->threads++;
+	}
+
+	return pool;
+}
+
+void
+qr_pool_destroy(struct qr_pool *pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (unsigned i = 0; i < pool->threads; i++) {
+		pthread_join(pool->tid[i], NULL);
+	}
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_mutex_destroy(&pool->run);
+
+	free(pool);
+}
+
+void
+qr_pool_run(struct qr_pool *pool, size_t n,
+	void (*f)(void *opaque, size_t i), void *opaque)
+{
+	assert(f != NULL);
+
+	if (pool == NULL || pool->threads == 0 || n <= 1) {
+		for (size_t i = 0; i < n; i++) {
+			f(opaque, i);
+		}
+
+		return;
+	}
+
+	pthread_mutex_lock(&pool->run);
+	pthread_mutex_lock(&pool->lock);
+
+	pool->f       = f;
+	pool->opaque  = opaque;
+	pool->n       = n;
+	pool->next    = 0;
+	pool->pending = n;
+
+	pthread_cond_broadcast(&pool->work);
+
+	drain(pool);
+
+	while (pool->pending > 0) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+	pthread_mutex_unlock(&pool->run);
+}
+
@@ -51,6 +51,30 @@ error:
 	exit(1);
 }
 
+/* row y of q, or all white for rows in the border */
+static void
+row_or_blank(const struct qr *q, int y, uint64_t row[])
+{
+	if (y < 0 || y >= (int) q->size) {
+		for (size_t k = 0; k < QR_ROW_WORDS(q->size); k++) {
+			row[k] = 0;
+		}
+		return;
+	}
+
+	qr_get_row(q, y, row);
+}
+
+static uint8_t
+reverse8(uint8_t c)
+{
+	c = (c & 0xF0) >> 4 | (c & 0x0F) << 4;
+	c = (c & 0xCC) >> 2 | (c & 0x33) << 2;
+	c = (c & 0xAA) >> 1 | (c & 0x55) << 1;
+
+	return c;
+}
+
 void
 qr_print_utf8qb(FILE *f, const struct qr *q, enum qr_utf8 uwidth, bool invert)
 {
@@ -62,6 +86,11 @@ qr_print_utf8qb(FILE *f, const struct qr *q, enum qr_utf8 uwidth, bool invert)
 	border = 4; /* per the spec */
 
 	for (int y = -border; y < (int) (q->size + border); y += 2) {
+		uint64_t row[2][QR_ROW_WORDS_MAX];
+
+		row_or_blank(q, y + 0, row[0]);
+		row_or_blank(q, y + 1, row[1]);
+
 		if (uwidth == QR_UTF8_WIDE) {
 			fprintf(f, "\033#6");
 		}
@@ -88,7 +117,7 @@ qr_print_utf8qb(FILE *f, const struct qr *q, enum qr_utf8 uwidth, bool invert)
 					continue;
 				}
 
-				if (qr_get_module(q, a[i].x, a[i].y)) {
+				if (QR_ROW_GET(row[a[i].y - y], a[i].x)) {
 					e |= 1 << i;
 				}
 			}
@@ -132,13 +161,17 @@ qr_print_pbm1(FILE *f, const struct qr *q, bool invert)
 	fprintf(f, "%zu %zu\n", q->size + border * 2, q->size + border * 2);
 
 	for (y = -border; y < (int) (q->size + border); y++) {
+		uint64_t row[QR_ROW_WORDS_MAX];
+
+		row_or_blank(q, y, row);
+
 		for (x = -border; x < (int) (q->size + border); x++) {
 			bool v;
 
-			if (x < 0 || x >= (int) q->size || y < 0 || y >= (int) q->size) {
+			if (x < 0 || x >= (int) q->size) {
 				v = false;
 			} else {
-				v = qr_get_module(q, x, y);
+				v = QR_ROW_GET(row, (unsigned) x);
 			}
 
 			if (invert) {
@@ -159,54 +192,44 @@ qr_print_pbm1(FILE *f, const struct qr *q, bool invert)
 void
 qr_print_pbm4(FILE *f, const struct qr *q, bool invert)
 {
-	size_t border;
-	int x, y;
-	uint8_t c;
+	size_t border, width;
+	int y;
 
 	assert(f != NULL);
 	assert(q != NULL);
 
 	border = 4; /* per the spec */
+	width = q->size + border * 2;
 
 	fprintf(f, "P4\n");
-	fprintf(f, "%zu %zu\n", q->size + border * 2, q->size + border * 2);
-
-	c = 0x00;
+	fprintf(f, "%zu %zu\n", width, width);
 
 	for (y = -border; y < (int) (q->size + border); y++) {
-		for (x = -border; x < (int) (q->size + border); x++) {
-			bool v;
+		uint64_t row[QR_ROW_WORDS_MAX];
+		uint64_t w[QR_ROW_WORDS_MAX + 1] = { 0 };
+		size_t k;
+
+		/* the row, shifted right past the left border */
+		row_or_blank(q, y, row);
+		for (k = 0; k < QR_ROW_WORDS(q->size); k++) {
+			w[k]     |= row[k] << border;
+			w[k + 1] |= row[k] >> (64 - border);
+		}
 
-			if (x < 0 || x >= (int) q->size || y < 0 || y >= (int) q->size) {
-				v = false;
-			} else {
-				v = qr_get_module(q, x, y);
+		if (invert) {
+			for (k = 0; k < QR_ROW_WORDS(width); k++) {
+				w[k] = ~w[k];
 			}
-
-			if (invert) {
-				v = !v;
+			if (width % 64 != 0) {
+				w[k - 1] &= ((uint64_t) 1 << (width % 64)) - 1;
 			}
+		}
 
-			c |= v;
-
-			if (x == (int) (q->size + border) - 1) {
-				/* end of row; pad to byte */
-				c <<= (7 - ((x + border) & 07));
-
-				fwrite(&c, sizeof c, 1, f);
-
-				c = 0x00;
-				continue;
-			}
-
-			if (((x + border) & 07) == 07) {
-				fwrite(&c, sizeof c, 1, f);
-
-				c = 0x00;
-				continue;
-			}
+		/* PBM packs the leftmost pixel into the high bit; rows pad to a byte */
+		for (k = 0; k < BM_LEN(width); k++) {
+			uint8_t c = reverse8(w[k / 8] >> (k % 8 * 8));
 
-			c <<= 1;
+			fwrite(&c, sizeof c, 1, f);
 		}
 	}
 }
@@ -229,13 +252,17 @@ qr_print_svg(FILE *f, const struct qr *q, bool invert)
 		q->size + border * 2);
 
 	for (y = -border; y < (int) (q->size + border); y++) {
+		uint64_t row[QR_ROW_WORDS_MAX];
+
+		row_or_blank(q, y, row);
+
 		for (x = -border; x < (int) (q->size + border); x++) {
 			bool v;
 
-			if (x < 0 || x >= (int) q->size || y < 0 || y >= (int) q->size) {
+			if (x < 0 || x >= (int) q->size) {
 				v = false;
 			} else {
-				v = qr_get_module(q, x, y);
+				v = QR_ROW_GET(row, (unsigned) x);
 			}
 
 			if (v) {
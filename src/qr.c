@@ -135,7 +135,8 @@ encode_fuzz(struct qr *q, uint64_t seed,
 	enum qr_ecl ecl,
 	unsigned min, unsigned max,
 	enum qr_mask mask,
-	bool boost_ecl)
+	bool boost_ecl,
+	const struct qr_options *opt)
 {
 	struct fuzz_instance *o;
 	pcg32_random_t pcg;
@@ -179,7 +180,7 @@ encode_fuzz(struct qr *q, uint64_t seed,
 
 	uint8_t tmp[QR_BUF_LEN_MAX];
 
-	if (!qr_encode(o->a, o->n, o->ecl, o->min, o->max, o->mask, o->boost_ecl, tmp, q)) {
+	if (!qr_encode_opt(o->a, o->n, o->ecl, o->min, o->max, o->mask, o->boost_ecl, opt, tmp, q)) {
 		/* TODO: */
 		exit(EXIT_FAILURE);
 	}
@@ -188,24 +189,14 @@ encode_fuzz(struct qr *q, uint64_t seed,
 static void
 encode_file(struct qr *q, const char *filename)
 {
-	FILE *f;
-
 	assert(q != NULL);
 	assert(filename != NULL);
 
-	f = fopen(filename, "rb");
-	if (f == NULL) {
-		perror(filename);
-		exit(EXIT_FAILURE);
-	}
-
 	/* TODO: separate mechanism to invert from file */
-	if (!qr_load_pbm(f, q, false)) {
-		/* TODO: */
+	if (!qr_load_pbm_file(filename, q, false)) {
+		perror(filename);
 		exit(EXIT_FAILURE);
 	}
-
-	fclose(f);
 }
 
 static void
@@ -214,7 +205,8 @@ encode_argv(struct qr *q, int argc, char * const argv[],
 	enum qr_ecl ecl,
 	unsigned min, unsigned max,
 	enum qr_mask mask,
-	bool boost_ecl)
+	bool boost_ecl,
+	const struct qr_options *opt)
 {
 	struct qr_segment **a;
 	size_t i, n;
@@ -237,7 +229,7 @@ encode_argv(struct qr *q, int argc, char * const argv[],
 	}
 
 	uint8_t tmp[QR_BUF_LEN_MAX];
-	if (!qr_encode(a, n, ecl, min, max, mask, boost_ecl, tmp, q)) {
+	if (!qr_encode_opt(a, n, ecl, min, max, mask, boost_ecl, opt, tmp, q)) {
 		exit(EXIT_FAILURE);
 	}
 
@@ -263,6 +255,7 @@ main(int argc, char * const argv[])
 	unsigned noise;
 	enum img img;
 	uint64_t seed;
+	unsigned threads;
 	const char *filename = NULL;
 	const char *target   = NULL;
 
@@ -278,12 +271,13 @@ main(int argc, char * const argv[])
 	uwidth = QR_UTF8_DOUBLE;
 	noise = 0;
 	seed = 0;
+	threads = 0;
 	img = IMG_UTF8QB;
 
 	{
 		int c;
 
-		while (c = getopt(argc, argv, "drbf:t:l:m:n:e:v:y:swz"), c != -1) {
+		while (c = getopt(argc, argv, "drbf:t:l:m:n:e:v:y:swzj:"), c != -1) {
 			switch (c) {
 			case 'd':
 				decode = true;
@@ -329,6 +323,10 @@ main(int argc, char * const argv[])
 				seed = atoi(optarg); /* XXX */
 				break;
 
+			case 'j':
+				threads = atoi(optarg); /* XXX */
+				break;
+
 			case 'm':
 				if (0 == strcmp(optarg, "auto")) {
 					mask = QR_MASK_AUTO;
@@ -377,6 +375,16 @@ main(int argc, char * const argv[])
 	uint8_t map[QR_BUF_LEN_MAX];
 	q.map = map;
 
+	/* the calling thread works too, so -j 4 starts three more */
+	struct qr_options opt = { NULL };
+	if (threads > 1) {
+		opt.pool = qr_pool_create(threads - 1);
+		if (opt.pool == NULL) {
+			perror("qr_pool_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	if (filename != NULL) {
 		if (argc != 0) {
 			exit(EXIT_FAILURE);
@@ -386,11 +394,11 @@ main(int argc, char * const argv[])
 	} else if (fuzz) {
 		encode_fuzz(&q, seed,
 			eci,
-			ecl, min, max, mask, boost_ecl);
+			ecl, min, max, mask, boost_ecl, &opt);
 	} else {
 		encode_argv(&q, argc, argv,
 			eci,
-			ecl, min, max, mask, boost_ecl);
+			ecl, min, max, mask, boost_ecl, &opt);
 	}
 
 	qr_noise(&q, noise, seed, false);
@@ -409,7 +417,7 @@ main(int argc, char * const argv[])
 
 		uint8_t tmp[QR_BUF_LEN_MAX];
 
-		e = qr_decode(&q, &data, &stats, tmp);
+		e = qr_decode_opt(&q, &opt, &data, &stats, tmp);
 
 		if (e) {
 			printf("  Decoding FAILED: %s\n", qr_strerror(e));
@@ -444,33 +452,31 @@ main(int argc, char * const argv[])
 			hexdump(stdout, (void *) &stats.format_corrected[0], sizeof stats.format_corrected[0]);
 			hexdump(stdout, (void *) &stats.format_corrected[1], sizeof stats.format_corrected[1]);
 			printf("    Format corrections: %u\n", stats.format_corrections);
+			if (stats.ver >= 7) {
+				printf("    Version information: %05lX %05lX\n",
+					(unsigned long) stats.version_raw[0], (unsigned long) stats.version_raw[1]);
+				printf("    Version corrections: %u\n", stats.version_corrections);
+			}
 			printf("    Codeword corrections: %u\n", stats.codeword_corrections);
 			seg_print(stdout, data.n, data.a);
+			qr_data_free(&data);
 		}
 
 		printf("\n");
 	}
 
 	if (target != NULL) {
-		FILE *f;
 		struct qr t;
 		double p;
 
 		uint8_t tmp[QR_BUF_LEN_MAX];
 		t.map = tmp;
 
-		/* Open input file. */
-		f = fopen(target, "rb");
-		if (f == NULL) {
+		if (!qr_load_pbm_file(target, &t, invert)) {
+			perror(target);
 			exit(EXIT_FAILURE);
 		}
 
-		if (!qr_load_pbm(f, &t, invert)) {
-			exit(EXIT_FAILURE);
-		}
-
-		fclose(f);
-
 		YV12_BUFFER_CONFIG a, b;
 
 		qr_yv12(&q, &a);
@@ -486,6 +492,8 @@ main(int argc, char * const argv[])
 		free(b.y_buffer);
 	}
 
+	qr_pool_destroy(opt.pool);
+
 	return 0;
 }
 
@@ -78,6 +78,38 @@ struct qr {
  */
 #define QR_BUF_LEN_MAX QR_BUF_LEN(QR_VER_MAX)
 
+/*
+ * The number of 64-bit words per row of a row-padded bitmap, for a symbol
+ * of the given side length. This is at most 3, for version 40.
+ */
+#define QR_ROW_WORDS(size) (((size_t) (size) + 63) / 64)
+#define QR_ROW_WORDS_MAX QR_ROW_WORDS(QR_SIZE(QR_VER_MAX))
+
+/*
+ * The number of words needed to store a row-padded bitmap of any QR Code
+ * up to and including the given version number, like QR_BUF_LEN().
+ */
+#define QR_ROWS_LEN(ver) (QR_SIZE(ver) * QR_ROW_WORDS(QR_SIZE(ver)))
+#define QR_ROWS_LEN_MAX QR_ROWS_LEN(QR_VER_MAX)
+
+/*
+ * The same modules as struct qr, laid out so that each row starts on
+ * a 64-bit word boundary, for algorithms which work a word at a time.
+ * struct qr remains the canonical representation; convert with
+ * qr_get_rows() and qr_set_rows(), or a row at a time.
+ *
+ * Row y is the words QR_ROW(r, y)[0 : QR_ROW_WORDS(size)], and the module
+ * at x within a row is QR_ROW_GET(row, x), which is bit x % 64 of the word
+ * x / 64. Bits past the end of each row are zero.
+ */
+struct qr_rows {
+	size_t size;
+	uint64_t *words; /* length at least QR_ROWS_LEN(ver) */
+};
+
+#define QR_ROW(r, y) (&(r)->words[(size_t) (y) * QR_ROW_WORDS((r)->size)])
+#define QR_ROW_GET(row, x) (((row)[(x) / 64] >> ((x) % 64)) & 1)
+
 /*
  * The mode field of a segment.
  */
@@ -117,11 +149,49 @@ struct qr_data {
 	/*
 	 * Data payload. For the Kanji mode, payload is encoded as Shift-JIS.
 	 * For all other modes, payload is text encoded per the source.
+	 * A symbol may hold no segments, in which case n is 0 and a may be NULL.
 	 */
 	size_t n;
 	struct qr_segment **a;
 };
 
+/*
+ * The most segments a symbol can hold: every segment costs at least
+ * a 4-bit mode indicator and an 8-bit character count, out of at most
+ * 2956 data codewords (version 40-L).
+ */
+#define QR_SEGMENTS_MAX (2956 * 8 / 12)
+
+/*
+ * A decoded segment, as a range into struct qr_views's .payload.
+ * For ECI segments, .len is 0 and .eci gives the designator.
+ */
+struct qr_segment_view {
+	enum qr_mode mode;
+	enum eci eci;
+	size_t offset;
+	size_t len;
+};
+
+/*
+ * Caller-owned storage for qr_decode_views(). .payload holds .payload_max
+ * bytes and .a holds .max views; the decoder sets .payload_len and .n.
+ * The payload is not nul-terminated. A .payload_max of QR_PAYLOAD_MAX and
+ * a .max of QR_SEGMENTS_MAX are always enough.
+ */
+struct qr_views {
+	enum qr_ecl ecl;
+	enum qr_mask mask;
+
+	char *payload;
+	size_t payload_max;
+	size_t payload_len;
+
+	struct qr_segment_view *a;
+	size_t max;
+	size_t n;
+};
+
 struct qr_stats {
 	unsigned ver;
 	unsigned format_corrections;
@@ -132,28 +202,71 @@ struct qr_stats {
 	struct qr_bytes padding;
 	uint16_t format_raw[2];
 	uint16_t format_corrected[2];
+
+	/*
+	 * Both copies of the version information, as read and as the nearest
+	 * valid version, for version 7 and up; zero otherwise. The decoded
+	 * version is version_corrected[i] >> 12 for the copy i nearest to its
+	 * valid version, which differs by version_corrections bits.
+	 */
+	unsigned version_corrections;
+	uint32_t version_raw[2];
+	uint32_t version_corrected[2];
+};
+
+struct qr_pool;
+
+/*
+ * Options for qr_encode_opt() and qr_decode_opt(). A zeroed struct (or a
+ * NULL pointer) gives the same behaviour as qr_encode() and qr_decode().
+ */
+struct qr_options {
+	/*
+	 * If non-NULL, the independent Reed-Solomon blocks of large symbols
+	 * are computed (when encoding) or corrected (when decoding) by the
+	 * threads of this pool concurrently. See qr_pool_create().
+	 */
+	struct qr_pool *pool;
+
+	/*
+	 * If non-NULL, a bitmap of modules known to be unreliable when decoding,
+	 * laid out as struct qr's .map for the symbol. Codewords with any marked
+	 * module are corrected as erasures, which need one ECC codeword each
+	 * rather than the two for an error at an unknown position, so up to
+	 * twice as many can be recovered. Marking reliable modules costs ECC
+	 * capacity. Ignored when encoding.
+	 */
+	const uint8_t *erasures;
 };
 
 /*
  * A segment of user/application data that a QR Code symbol can convey.
+ * Segments are allocated to fit their contents by the constructors below
+ * (and by qr_decode()), and are freed with free().
  */
 struct qr_segment {
 	enum qr_mode mode;
+	enum eci eci; /* QR_MODE_ECI only */
 
-	union {
-		char s[QR_PAYLOAD_MAX]; // TODO
-		struct qr_bytes m;
-		enum eci eci;
-	} u;
+	/*
+	 * The source data is .len bytes at .s, followed by a nul. For the Kanji
+	 * mode this is Shift-JIS, two bytes per character; for the byte mode it
+	 * may contain nuls. ECI segments have no source data.
+	 */
+	size_t len;
 
 	/*
-	 * Encoded data bits for this segment, packed in bitwise big endian.
-	 * .bits is the number of valid data bits used in the buffer. Requires
-	 * 0 <= count <= 32767, and count <= (capacity of data array) * 8.
+	 * Encoded data bits for this segment, packed in bitwise big endian,
+	 * at QR_SEG_DATA(seg). Requires 0 <= bits <= 32767.
 	 */
-	struct qr_bytes m;
+	size_t bits;
+
+	/* .len + 1 bytes of source data, then BM_LEN(.bits) bytes of encoded data */
+	char s[];
 };
 
+#define QR_SEG_DATA(seg) ((uint8_t *) (seg)->s + (seg)->len + 1)
+
 /*
  * Returns a segment representing the given binary data encoded in byte mode.
  */
@@ -174,6 +287,14 @@ qr_make_numeric(const char *s);
 struct qr_segment *
 qr_make_alnum(const char *s);
 
+/*
+ * Returns a segment representing the given Shift-JIS double-byte characters
+ * encoded in kanji mode. Each character must be in the range 0x8140 to 0x9FFC
+ * or 0xE040 to 0xEBBF.
+ */
+struct qr_segment *
+qr_make_kanji(const void *data, size_t len);
+
 /*
  * Returns a segment representing an Extended Channel Interpretation
  * (ECI) designator with the given assignment value.
@@ -185,11 +306,24 @@ qr_make_eci(long assignVal);
  * Returns a segment of whatever mode seems to suit the string.
  *
  * This is not neccessarily optimal; it may be more compact overall to break a
- * string into multiple segments. This interface is provided for caller simplicity only.
+ * string into multiple segments; see qr_make_optimal(). This interface is provided
+ * for caller simplicity only.
  */
 struct qr_segment *
 qr_make_any(const char *s);
 
+/*
+ * Returns the segments which encode the given data in the fewest bits, for the
+ * smallest version in [min, max] which can hold them at the given ECL.
+ * Kanji mode is used for Shift-JIS double-byte characters only if kanji is true.
+ *
+ * The segments are returned as a newly-allocated array of *n, each to be freed.
+ * Returns NULL with errno set if the data does not fit, or on allocation failure.
+ */
+struct qr_segment **
+qr_make_optimal(const void *data, size_t len, enum qr_ecl ecl,
+	unsigned min, unsigned max, bool kanji, size_t *n);
+
 /*
  * Return the color of the module (pixel) at the given coordinates, which is either
  * false for white or true for v. The top left corner has the coordinates (x=0, y=0).
@@ -203,6 +337,48 @@ qr_get_module(const struct qr *q, unsigned x, unsigned y);
 void
 qr_set_module(struct qr *q, unsigned x, unsigned y, bool v);
 
+/*
+ * Copy row y of a symbol to row[0 : QR_ROW_WORDS(q->size)],
+ * zeroing the bits past the end of the row.
+ */
+void
+qr_get_row(const struct qr *q, unsigned y, uint64_t row[]);
+
+/*
+ * Set row y of a symbol from row[0 : QR_ROW_WORDS(q->size)],
+ * ignoring the bits past the end of the row.
+ */
+void
+qr_set_row(struct qr *q, unsigned y, const uint64_t row[]);
+
+/*
+ * Copy every row of a symbol to the row-padded bitmap r, or back.
+ * The sizes of q and r are set by qr_get_rows() and must match for qr_set_rows().
+ */
+void
+qr_get_rows(const struct qr *q, struct qr_rows *r);
+void
+qr_set_rows(struct qr *q, const struct qr_rows *r);
+
+/*
+ * The modules of a symbol of the given version which are not part of any
+ * function pattern (the finder, separator, timing and alignment patterns,
+ * and the format and version information), as a bitmap like struct qr.
+ * Bits past the end of the symbol are zero. The map is shared and read-only.
+ */
+const uint8_t *
+qr_data_region(unsigned ver);
+
+/*
+ * The function patterns of a symbol of the given version, as the encoder
+ * draws them before placing codewords: every module of qr_data_region()
+ * is white, and the format information is dark until it is drawn.
+ * As a bitmap like struct qr; bits past the end of the symbol are zero.
+ * The map is shared and read-only.
+ */
+const uint8_t *
+qr_function_template(unsigned ver);
+
 /*
  * Flip n randomly-selected modules.
  * Reserved regions are avoided if skip_reserved is true.
@@ -222,6 +398,21 @@ qr_isalnum(const char *s);
 bool
 qr_isnumeric(const char *s);
 
+/*
+ * Start the given number of worker threads, for use by struct qr_options.
+ * One pool may be shared by any number of encoders and decoders; each runs
+ * its work on the pool in turn, joined by the calling thread.
+ * Returns NULL and sets errno on error.
+ */
+struct qr_pool *
+qr_pool_create(unsigned threads);
+
+/*
+ * Stop and join the threads of a pool. The pool must not be in use.
+ */
+void
+qr_pool_destroy(struct qr_pool *pool);
+
 /*
  * XOR the data modules in this QR Code with the given mask pattern.
  *
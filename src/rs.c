@@ -0,0 +1,306 @@
+
+/*
+ * Reed-Solomon remainder kernels for the encoder.
+ *
+ * Each kernel divides a block of data by a fixed generator polynomial,
+ * keeping the whole parity register (up to 30 bytes) as 32 byte lanes,
+ * lane j being the coefficient r[j]. One step of the division is:
+ *
+ *   f = data[i] ^ r[0]
+ *   r = (r shifted down by one lane) ^ f * generator
+ *
+ * Taken one byte at a time, each factor depends on a table lookup from
+ * the step before, which bounds the speed by memory latency no matter
+ * how wide the register is. But the step is linear, so eight steps are:
+ *
+ *   s = data[i : i + 8] ^ r[0 : 8]
+ *   r = (r shifted down by eight lanes) ^ s[0] * v[0] ^ ... ^ s[7] * v[7]
+ *
+ * where v[m] is the register produced by dividing a single 1 at position m
+ * of eight zero bytes. The eight products are independent, and each is
+ * split by the nibbles of s[m]:
+ *
+ *   x * v = (x & 0x0F) * v ^ (x & 0xF0) * v
+ *
+ * so that it is the XOR of two entries from 16-entry tables of whole
+ * register products, built once per generator.
+ *
+ * The portable kernel holds the register in four 64-bit words with lane j
+ * in byte j % 8 of word j / 8. On x86 this is also the layout in memory,
+ * so the vector kernels load the same tables directly.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <eci.h>
+#include <qr.h>
+
+#include "internal.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define RS_X86
+#include <immintrin.h>
+#endif
+
+/* multiply each byte lane of w by x, in GF(2^8 / 0x11D) */
+static uint64_t
+xtime(uint64_t w)
+{
+	uint64_t h = w & 0x8080808080808080;
+
+	return ((w & 0x7F7F7F7F7F7F7F7F) << 1) ^ ((h >> 7) * 0x1D);
+}
+
+/*
+ * The next eight data bytes as lanes of a word. A block whose length
+ * is not a multiple of eight starts with a short chunk, aligned to the
+ * top of the word; the leading zeros do not change the remainder.
+ */
+static uint64_t
+chunk(const uint8_t *p, size_t n)
+{
+	uint64_t s = 0;
+
+	assert(1 <= n && n <= 8);
+
+	for (size_t j = 0; j < n; j++) {
+		s |= (uint64_t) p[j] << ((8 - n + j) * 8);
+	}
+
+	return s;
+}
+
+static void
+store(const uint64_t w[4], size_t degree, uint8_t *r)
+{
+	for (size_t j = 0; j < degree; j++) {
+		r[j] = w[j / 8] >> (j % 8 * 8);
+	}
+}
+
+static void
+remainder_word(const struct rs_encoder *e, const uint8_t *p, size_t len, uint8_t *r)
+{
+	uint64_t w[4] = { 0, 0, 0, 0 };
+
+	for (size_t i = 0, n = (len - 1) % 8 + 1; i < len; i += n, n = 8) {
+		uint64_t s = chunk(&p[i], n) ^ w[0];
+
+		w[0] = w[1];
+		w[1] = w[2];
+		w[2] = w[3];
+		w[3] = 0;
+
+		for (int m = 0; m < 8; m++) {
+			const uint64_t *lo = e->t[m][0][(s >> (m * 8))     & 0x0F];
+			const uint64_t *hi = e->t[m][1][(s >> (m * 8 + 4)) & 0x0F];
+
+			for (int l = 0; l < 4; l++) {
+				w[l] ^= lo[l] ^ hi[l];
+			}
+		}
+	}
+
+	store(w, e->degree, r);
+}
+
+#ifdef RS_X86
+
+__attribute__((target("ssse3")))
+static void
+remainder_ssse3(const struct rs_encoder *e, const uint8_t *p, size_t len, uint8_t *r)
+{
+	__m128i v0 = _mm_setzero_si128();
+	__m128i v1 = _mm_setzero_si128();
+	uint64_t w[4];
+
+	for (size_t i = 0, n = (len - 1) % 8 + 1; i < len; i += n, n = 8) {
+		uint64_t s = chunk(&p[i], n) ^ (uint64_t) _mm_cvtsi128_si64(v0);
+		__m128i a0 = _mm_setzero_si128(), a1 = _mm_setzero_si128();
+		__m128i b0 = _mm_setzero_si128(), b1 = _mm_setzero_si128();
+
+		v0 = _mm_alignr_epi8(v1, v0, 8);
+		v1 = _mm_srli_si128(v1, 8);
+
+		for (int m = 0; m < 8; m++) {
+			const __m128i *lo = (const __m128i *) e->t[m][0][(s >> (m * 8))     & 0x0F];
+			const __m128i *hi = (const __m128i *) e->t[m][1][(s >> (m * 8 + 4)) & 0x0F];
+
+			a0 = _mm_xor_si128(a0, _mm_loadu_si128(&lo[0]));
+			a1 = _mm_xor_si128(a1, _mm_loadu_si128(&lo[1]));
+			b0 = _mm_xor_si128(b0, _mm_loadu_si128(&hi[0]));
+			b1 = _mm_xor_si128(b1, _mm_loadu_si128(&hi[1]));
+		}
+
+		v0 = _mm_xor_si128(v0, _mm_xor_si128(a0, b0));
+		v1 = _mm_xor_si128(v1, _mm_xor_si128(a1, b1));
+	}
+
+	_mm_storeu_si128((__m128i *) &w[0], v0);
+	_mm_storeu_si128((__m128i *) &w[2], v1);
+
+	store(w, e->degree, r);
+}
+
+__attribute__((target("avx2")))
+static void
+remainder_avx2(const struct rs_encoder *e, const uint8_t *p, size_t len, uint8_t *r)
+{
+	__m256i v = _mm256_setzero_si256();
+	uint64_t w[4];
+
+	for (size_t i = 0, n = (len - 1) % 8 + 1; i < len; i += n, n = 8) {
+		uint64_t s = chunk(&p[i], n) ^ (uint64_t) _mm_cvtsi128_si64(_mm256_castsi256_si128(v));
+		__m256i a = _mm256_setzero_si256();
+		__m256i b = _mm256_setzero_si256();
+
+		// PALIGNR shifts within each 128-bit lane, so the high lane's
+		// bottom word is carried down through a lane swap.
+		v = _mm256_alignr_epi8(_mm256_permute2x128_si256(v, v, 0x81), v, 8);
+
+		for (int m = 0; m < 8; m++) {
+			const __m256i *lo = (const __m256i *) e->t[m][0][(s >> (m * 8))     & 0x0F];
+			const __m256i *hi = (const __m256i *) e->t[m][1][(s >> (m * 8 + 4)) & 0x0F];
+
+			a = _mm256_xor_si256(a, _mm256_loadu_si256(lo));
+			b = _mm256_xor_si256(b, _mm256_loadu_si256(hi));
+		}
+
+		v = _mm256_xor_si256(v, _mm256_xor_si256(a, b));
+	}
+
+	_mm256_storeu_si256((__m256i *) w, v);
+
+	store(w, e->degree, r);
+}
+
+#endif
+
+/*
+ * Prepares e to divide by the given generator[0 : degree], in the same form
+ * as reed_solomon_remainder(), using the given kernel. RS_KERNEL_AUTO picks
+ * the fastest kernel this CPU supports. Returns false if the requested
+ * kernel is not available.
+ */
+bool
+rs_encoder_init(struct rs_encoder *e, const uint8_t generator[], size_t degree,
+	enum rs_kernel kernel)
+{
+	uint64_t g[8][4];
+
+	assert(e != NULL);
+	assert(generator != NULL);
+	assert(1 <= degree && degree <= 30);
+
+	switch (kernel) {
+	case RS_KERNEL_AUTO:
+#ifdef RS_X86
+		if (__builtin_cpu_supports("avx2")) {
+			e->remainder = remainder_avx2;
+			break;
+		}
+		if (__builtin_cpu_supports("ssse3")) {
+			e->remainder = remainder_ssse3;
+			break;
+		}
+#endif
+		e->remainder = remainder_word;
+		break;
+
+	case RS_KERNEL_WORD:
+		e->remainder = remainder_word;
+		break;
+
+	case RS_KERNEL_SSSE3:
+#ifdef RS_X86
+		if (__builtin_cpu_supports("ssse3")) {
+			e->remainder = remainder_ssse3;
+			break;
+		}
+#endif
+		return false;
+
+	case RS_KERNEL_AVX2:
+#ifdef RS_X86
+		if (__builtin_cpu_supports("avx2")) {
+			e->remainder = remainder_avx2;
+			break;
+		}
+#endif
+		return false;
+
+	default:
+		assert(!"unreached");
+		return false;
+	}
+
+	e->degree = degree;
+
+	// g[k] = 2^k * generator, lane by lane
+	memset(g[0], 0, sizeof g[0]);
+	for (size_t j = 0; j < degree; j++) {
+		g[0][j / 8] |= (uint64_t) generator[j] << (j % 8 * 8);
+	}
+	for (int k = 1; k < 8; k++) {
+		for (int l = 0; l < 4; l++) {
+			g[k][l] = xtime(g[k - 1][l]);
+		}
+	}
+
+	// v[7] is the generator itself, and each v[m] is one further step
+	// of division over a zero byte from v[m + 1].
+	uint64_t v[4];
+	memcpy(v, g[0], sizeof v);
+
+	for (int m = 7; m >= 0; m--) {
+		uint64_t d[8][4];
+
+		if (m < 7) {
+			unsigned f = v[0] & 0xFF;
+
+			v[0] = (v[0] >> 8) | (v[1] << 56);
+			v[1] = (v[1] >> 8) | (v[2] << 56);
+			v[2] = (v[2] >> 8) | (v[3] << 56);
+			v[3] =  v[3] >> 8;
+
+			// Multiplication distributes over XOR, so the product
+			// f * generator is the sum of g[k] for the bits set in f.
+			for (int k = 0; k < 8; k++) {
+				if (f & (1U << k)) {
+					for (int l = 0; l < 4; l++) {
+						v[l] ^= g[k][l];
+					}
+				}
+			}
+		}
+
+		memcpy(d[0], v, sizeof v);
+
+		// d[k] = 2^k * v[m]
+		for (int k = 1; k < 8; k++) {
+			for (int l = 0; l < 4; l++) {
+				d[k][l] = xtime(d[k - 1][l]);
+			}
+		}
+
+		// Likewise each table entry is the sum of d[k] for its bits.
+		for (int h = 0; h < 2; h++) {
+			memset(e->t[m][h][0], 0, sizeof e->t[m][h][0]);
+
+			for (int k = 0; k < 4; k++) {
+				for (unsigned x = 0; x < 1U << k; x++) {
+					for (int l = 0; l < 4; l++) {
+						e->t[m][h][x | 1U << k][l] = e->t[m][h][x][l] ^ d[h * 4 + k][l];
+					}
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
@@ -54,25 +54,12 @@ seg_len(struct qr_segment * const a[], size_t n)
 	size_t len;
 	size_t j;
 
-	assert(a != NULL);
+	assert(a != NULL || n == 0);
 
 	len = 0;
 
 	for (j = 0; j < n; j++) {
-		switch (a[j]->mode) {
-		case QR_MODE_BYTE:
-			len += a[j]->u.m.bits * 8; // padded to a byte
-			break;
-
-		case QR_MODE_NUMERIC:
-		case QR_MODE_ALNUM:
-		case QR_MODE_KANJI:
-			len += strlen(a[j]->u.s);
-			break;
-
-		case QR_MODE_ECI:
-			break;
-		}
+		len += a[j]->len;
 	}
 
 	return len;
@@ -85,8 +72,8 @@ seg_cmp(
 {
 	size_t j;
 
-	assert(a != NULL);
-	assert(b != NULL);
+	assert(a != NULL || an == 0);
+	assert(b != NULL || bn == 0);
 
 	if (an != bn) {
 		return false;
@@ -101,34 +88,16 @@ seg_cmp(
 			return false;
 		}
 
-		switch (b[j]->mode) {
-		case QR_MODE_BYTE:
-			if (a[j]->u.m.bits != b[j]->u.m.bits) {
-				return false;
-			}
-
-			if (0 != memcmp(a[j]->u.m.data, b[j]->u.m.data, BM_LEN(b[j]->u.m.bits))) {
-				return false;
-			}
-			break;
-
-		case QR_MODE_NUMERIC:
-		case QR_MODE_ALNUM:
-		case QR_MODE_KANJI:
-			if (strlen(a[j]->u.s) != strlen(b[j]->u.s)) {
-				return false;
-			}
+		if (b[j]->mode == QR_MODE_ECI && a[j]->eci != b[j]->eci) {
+			return false;
+		}
 
-			if (0 != strcmp(a[j]->u.s, b[j]->u.s)) {
-				return false;
-			}
-			break;
+		if (a[j]->len != b[j]->len) {
+			return false;
+		}
 
-		case QR_MODE_ECI:
-			if (a[j]->u.eci != b[j]->u.eci) {
-				return false;
-			}
-			break;
+		if (0 != memcmp(a[j]->s, b[j]->s, b[j]->len)) {
+			return false;
 		}
 	}
 
@@ -278,31 +247,16 @@ count_total_bits(struct qr_segment * const a[], size_t n, unsigned ver)
 	assert(QR_VER_MIN <= ver && ver <= QR_VER_MAX);
 
 	for (size_t i = 0; i < n; i++) {
-		assert(a[i]->m.bits <= INT16_MAX);
+		assert(a[i]->bits <= INT16_MAX);
 
 		int ccbits = count_char_bits(a[i]->mode, ver);
 		assert(0 <= ccbits && ccbits <= 16);
 
 		// Fail if segment length value doesn't fit in the length field's bit-width
-		switch (a[i]->mode) {
-		case QR_MODE_BYTE:
-			assert(a[i]->u.m.bits <= INT16_MAX);
-			if (a[i]->u.m.bits * 8 >= (1UL << ccbits))
-				return -1;
-			break;
-
-		case QR_MODE_NUMERIC:
-		case QR_MODE_ALNUM:
-		case QR_MODE_KANJI:
-			if (strlen(a[i]->u.s) >= (1UL << ccbits))
-				return -1;
-			break;
-
-		case QR_MODE_ECI:
-			break;
-		}
+		if (a[i]->mode != QR_MODE_ECI && seg_chars(a[i]) >= (1UL << ccbits))
+			return -1;
 
-		long tmp = 4L + ccbits + a[i]->m.bits;
+		long tmp = 4L + ccbits + a[i]->bits;
 		if (tmp > INT16_MAX - len)
 			return -1;
 
@@ -340,72 +294,98 @@ qr_calcSegmentBufferSize(enum qr_mode mode, size_t len)
 	return BM_LEN((size_t) n);
 }
 
+/*
+ * Allocates a segment with room for len bytes of source data (which are left
+ * for the caller) and the given number of encoded bits, which are zeroed.
+ */
 struct qr_segment *
-qr_make_bytes(const void *data, size_t len)
+seg_alloc(enum qr_mode mode, size_t len, size_t bits)
 {
 	struct qr_segment *seg;
-	int count;
 
-	assert(data != NULL);
-	assert(len <= sizeof seg->u.m.data);
+	assert(bits <= INT16_MAX);
 
-	seg = malloc(sizeof *seg);
+	seg = malloc(sizeof *seg + len + 1 + BM_LEN(bits));
 	if (seg == NULL) {
 		return NULL;
 	}
 
-	memcpy(seg->u.m.data, data, len);
-	seg->u.m.bits = len * 8;
+	seg->mode = mode;
+	seg->eci  = ECI_DEFAULT;
+	seg->len  = len;
+	seg->bits = bits;
+
+	seg->s[len] = '\0';
+	memset(QR_SEG_DATA(seg), 0, BM_LEN(bits));
+
+	return seg;
+}
+
+size_t
+seg_chars(const struct qr_segment *seg)
+{
+	assert(seg != NULL);
+
+	switch (seg->mode) {
+	case QR_MODE_KANJI: return seg->len / 2;
+	case QR_MODE_ECI:   return 0;
+	default:            return seg->len;
+	}
+}
+
+struct qr_segment *
+qr_make_bytes(const void *data, size_t len)
+{
+	struct qr_segment *seg;
+	int count;
+
+	assert(data != NULL || len == 0);
 
 	count = count_seg_bits(QR_MODE_BYTE, len);
 	assert(count != -1);
 
-	seg->mode   = QR_MODE_BYTE;
-	seg->m.bits = count;
-	memcpy(seg->m.data, data, len);
+	seg = seg_alloc(QR_MODE_BYTE, len, count);
+	if (seg == NULL) {
+		return NULL;
+	}
+
+	if (len > 0) {
+		memcpy(seg->s, data, len);
+		memcpy(QR_SEG_DATA(seg), data, len);
+	}
 
 	return seg;
 }
 
-struct qr_segment *
-qr_make_numeric(const char *s)
+static struct qr_segment *
+make_numeric(const char *s, size_t len)
 {
 	struct qr_segment *seg;
-	void *data;
-	const char *p;
+	uint8_t *data;
 	int count;
-	size_t len;
 	size_t rcount;
 
 	assert(s != NULL);
 
-	len = strlen(s);
-	assert(len <= sizeof seg->u.s - 1);
-
 	count = count_seg_bits(QR_MODE_NUMERIC, len);
 	assert(count != -1);
 
-	seg = malloc(sizeof *seg + BM_LEN(count));
+	seg = seg_alloc(QR_MODE_NUMERIC, len, count);
 	if (seg == NULL) {
 		return NULL;
 	}
 
-	data = (char *) seg + sizeof *seg;
-
-	strcpy(seg->u.s, s);
-
-	if (count > 0) {
-		memset(data, 0, BM_LEN(count));
-	}
+	memcpy(seg->s, s, len);
+	data = QR_SEG_DATA(seg);
 
 	rcount = 0;
 
 	unsigned n = 0;
 	int digits = 0;
-	for (p = s; *p != '\0'; p++) {
-		assert('0' <= *p && *p <= '9');
+	for (size_t i = 0; i < len; i++) {
+		assert('0' <= s[i] && s[i] <= '9');
 		n *= 10;
-		n += (*p - '0');
+		n += (s[i] - '0');
 		digits++;
 		if (digits == 3) {
 			append_bits(n, 10, data, &rcount);
@@ -419,45 +399,30 @@ qr_make_numeric(const char *s)
 	}
 
 	assert(rcount == (size_t) count);
-	/* XXX: then why memset at the start? */
-
-	seg->mode   = QR_MODE_NUMERIC;
-	seg->m.bits = rcount;
-	memcpy(seg->m.data, data, BM_LEN(seg->m.bits));
 
 	return seg;
 }
 
-struct qr_segment *
-qr_make_alnum(const char *s)
+static struct qr_segment *
+make_alnum(const char *s, size_t len)
 {
 	struct qr_segment *seg;
-	void *data;
-	const char *p;
+	uint8_t *data;
 	size_t rcount;
-	size_t len;
 	int count;
 
 	assert(s != NULL);
 
-	len = strlen(s);
-	assert(len <= sizeof seg->u.s - 1);
-
 	count = count_seg_bits(QR_MODE_ALNUM, len);
 	assert(count != -1);
 
-	seg = malloc(sizeof *seg + BM_LEN(count));
+	seg = seg_alloc(QR_MODE_ALNUM, len, count);
 	if (seg == NULL) {
 		return NULL;
 	}
 
-	data = (char *) seg + sizeof *seg;
-
-	strcpy(seg->u.s, s);
-
-	if (count > 0) {
-		memset(data, 0, BM_LEN(count));
-	}
+	memcpy(seg->s, s, len);
+	data = QR_SEG_DATA(seg);
 
 /* TODO: centralise with digits encoding; this is just base 45 */
 
@@ -465,8 +430,8 @@ qr_make_alnum(const char *s)
 
 	unsigned accumData = 0;
 	int accumCount = 0;
-	for (p = s; *p != '\0'; p++) {
-		accumData = accumData * 45 + charset_index(ALNUM_CHARSET, *p);
+	for (size_t i = 0; i < len; i++) {
+		accumData = accumData * 45 + charset_index(ALNUM_CHARSET, s[i]);
 		accumCount++;
 		if (accumCount == 2) {
 			append_bits(accumData, 11, data, &rcount);
@@ -480,11 +445,77 @@ qr_make_alnum(const char *s)
 	}
 
 	assert(rcount == (size_t) count);
-	/* XXX: then why memset at the start? */
 
-	seg->mode   = QR_MODE_ALNUM;
-	seg->m.bits = rcount;
-	memcpy(seg->m.data, data, BM_LEN(seg->m.bits));
+	return seg;
+}
+
+struct qr_segment *
+qr_make_numeric(const char *s)
+{
+	assert(s != NULL);
+
+	return make_numeric(s, strlen(s));
+}
+
+struct qr_segment *
+qr_make_alnum(const char *s)
+{
+	assert(s != NULL);
+
+	return make_alnum(s, strlen(s));
+}
+
+/*
+ * Whether p[0] and p[1] are a Shift-JIS double-byte character
+ * in the ranges which the Kanji mode can encode.
+ */
+static bool
+is_kanji(const uint8_t *p)
+{
+	unsigned c = (p[0] << 8) | p[1];
+
+	if (p[1] < 0x40 || p[1] > 0xfc || p[1] == 0x7f) {
+		return false;
+	}
+
+	return (0x8140 <= c && c <= 0x9ffc) || (0xe040 <= c && c <= 0xebbf);
+}
+
+struct qr_segment *
+qr_make_kanji(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	struct qr_segment *seg;
+	size_t rcount;
+	int count;
+
+	assert(data != NULL || len == 0);
+	assert(len % 2 == 0);
+
+	count = count_seg_bits(QR_MODE_KANJI, len / 2);
+	assert(count != -1);
+
+	seg = seg_alloc(QR_MODE_KANJI, len, count);
+	if (seg == NULL) {
+		return NULL;
+	}
+
+	if (len > 0) {
+		memcpy(seg->s, data, len);
+	}
+
+	rcount = 0;
+
+	for (size_t i = 0; i < len; i += 2) {
+		unsigned c = (p[i] << 8) | p[i + 1];
+
+		assert(is_kanji(p + i));
+
+		c -= c <= 0x9ffc ? 0x8140 : 0xc140;
+		append_bits((c >> 8) * 0xc0 + (c & 0xff), 13, QR_SEG_DATA(seg), &rcount);
+	}
+
+	assert(rcount == (size_t) count);
 
 	return seg;
 }
@@ -493,38 +524,49 @@ struct qr_segment *
 qr_make_eci(long assignVal)
 {
 	struct qr_segment *seg;
-	void *data;
+	uint8_t *data;
 	size_t rcount;
+	size_t count;
 
-	seg = malloc(sizeof *seg + 3);
+	if (0 <= assignVal && assignVal < (1 << 7)) {
+		count = 8;
+	} else if ((1 << 7) <= assignVal && assignVal < (1 << 14)) {
+		count = 16;
+	} else if ((1 << 14) <= assignVal && assignVal < 1000000L) {
+		count = 24;
+	} else {
+		assert(false);
+		return NULL;
+	}
+
+	seg = seg_alloc(QR_MODE_ECI, 0, count);
 	if (seg == NULL) {
 		return NULL;
 	}
 
-	data = (char *) seg + sizeof *seg;
+	seg->eci = (enum eci) assignVal;
+	data = QR_SEG_DATA(seg);
 
 	rcount = 0;
 
-	if (0 <= assignVal && assignVal < (1 << 7)) {
-		memset(data, 0, 1);
+	switch (count) {
+	case 8:
 		append_bits(assignVal, 8, data, &rcount);
-	} else if ((1 << 7) <= assignVal && assignVal < (1 << 14)) {
-		memset(data, 0, 2);
+		break;
+
+	case 16:
 		append_bits(2, 2, data, &rcount);
 		append_bits(assignVal, 14, data, &rcount);
-	} else if ((1 << 14) <= assignVal && assignVal < 1000000L) {
-		memset(data, 0, 3);
+		break;
+
+	case 24:
 		append_bits(6, 3, data, &rcount);
 		append_bits(assignVal >> 10, 11, data, &rcount);
 		append_bits(assignVal & 0x3FF, 10, data, &rcount);
-	} else {
-		assert(false);
+		break;
 	}
 
-	seg->mode   = QR_MODE_ECI;
-	seg->u.eci  = (enum eci) assignVal;
-	seg->m.bits = rcount;
-	memcpy(seg->m.data, data, BM_LEN(seg->m.bits));
+	assert(rcount == count);
 
 	return seg;
 }
@@ -547,6 +589,272 @@ qr_make_any(const char *s)
 	return seg;
 }
 
+/*
+ * States for seg_optimal(): the mode of the segment in progress, and
+ * for numeric and alphanumeric segments, how many characters are held
+ * over for the next group (of three digits, or two characters).
+ */
+enum seg_state {
+	SEG_NUMERIC0, SEG_NUMERIC1, SEG_NUMERIC2,
+	SEG_ALNUM0, SEG_ALNUM1,
+	SEG_BYTE,
+	SEG_KANJI,
+	SEG_STATES,
+	SEG_NONE = SEG_STATES /* before the first segment */
+};
+
+/* set in the predecessor for a state which starts a new segment */
+#define SEG_NEW 0x80
+
+static enum qr_mode
+seg_mode(unsigned st)
+{
+	switch (st) {
+	case SEG_NUMERIC0: case SEG_NUMERIC1: case SEG_NUMERIC2: return QR_MODE_NUMERIC;
+	case SEG_ALNUM0: case SEG_ALNUM1: return QR_MODE_ALNUM;
+	case SEG_BYTE:  return QR_MODE_BYTE;
+	case SEG_KANJI: return QR_MODE_KANJI;
+
+	default:
+		assert(false);
+		return QR_MODE_BYTE;
+	}
+}
+
+static struct qr_segment *
+make_mode(enum qr_mode mode, const char *s, size_t len)
+{
+	switch (mode) {
+	case QR_MODE_NUMERIC: return make_numeric(s, len);
+	case QR_MODE_ALNUM:   return make_alnum(s, len);
+	case QR_MODE_KANJI:   return qr_make_kanji(s, len);
+	default:              return qr_make_bytes(s, len);
+	}
+}
+
+/*
+ * Splits data[0 : len] into the segments which take the fewest bits at the
+ * given version (only its version class matters, for the width of the
+ * character count indicators). Kanji mode is used for Shift-JIS double-byte
+ * characters only if kanji is true, because data in other encodings can
+ * contain the same byte pairs.
+ *
+ * This is a shortest path over (position, state), with the cost of each
+ * character in bits: numeric and alphanumeric groups cost their full width
+ * on the first character of the group and the remainder on the rest, so the
+ * cost of every path is exact. The one approximation is for runs longer
+ * than a character count indicator can hold, which are split afterwards.
+ *
+ * Returns a newly-allocated array of *n segments, or NULL with errno set.
+ */
+struct qr_segment **
+seg_optimal(const void *data, size_t len, unsigned ver, bool kanji, size_t *n)
+{
+	const uint8_t *p = data;
+	struct qr_segment **a;
+	uint32_t *cost;
+	uint8_t *prev;
+	unsigned head[SEG_STATES];
+
+	assert(data != NULL || len == 0);
+	assert(QR_VER_MIN <= ver && ver <= QR_VER_MAX);
+	assert(n != NULL);
+
+	for (unsigned st = 0; st < SEG_STATES; st++) {
+		head[st] = 4 + count_char_bits(seg_mode(st), ver);
+	}
+
+	cost = malloc(sizeof *cost * (len + 1) * (SEG_STATES + 1));
+	prev = calloc((len + 1) * (SEG_STATES + 1), sizeof *prev);
+	if (cost == NULL || prev == NULL) {
+		free(cost);
+		free(prev);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < (len + 1) * (SEG_STATES + 1); i++) {
+		cost[i] = UINT32_MAX;
+	}
+
+	cost[SEG_NONE] = 0;
+
+#define RELAX(j, to, from, bits) \
+	do { \
+		uint32_t c = cost[i * (SEG_STATES + 1) + ((from) & ~SEG_NEW)] + (bits); \
+		if (c < cost[(j) * (SEG_STATES + 1) + (to)]) { \
+			cost[(j) * (SEG_STATES + 1) + (to)] = c; \
+			prev[(j) * (SEG_STATES + 1) + (to)] = (from); \
+		} \
+	} while (0)
+
+	for (size_t i = 0; i < len; i++) {
+		bool digit = p[i] >= '0' && p[i] <= '9';
+		bool alnum = p[i] != '\0' && strchr(ALNUM_CHARSET, p[i]) != NULL;
+		bool sjis  = kanji && i + 1 < len && is_kanji(p + i);
+
+		/*
+		 * Continuing a segment is tried first for each state, so ties
+		 * prefer fewer segments.
+		 */
+		for (unsigned from = 0; from <= SEG_STATES; from++) {
+			if (cost[i * (SEG_STATES + 1) + from] == UINT32_MAX) {
+				continue;
+			}
+
+			switch (from) {
+			case SEG_NUMERIC0: if (digit) RELAX(i + 1, SEG_NUMERIC1, from, 4); break;
+			case SEG_NUMERIC1: if (digit) RELAX(i + 1, SEG_NUMERIC2, from, 3); break;
+			case SEG_NUMERIC2: if (digit) RELAX(i + 1, SEG_NUMERIC0, from, 3); break;
+			case SEG_ALNUM0:   if (alnum) RELAX(i + 1, SEG_ALNUM1,   from, 6); break;
+			case SEG_ALNUM1:   if (alnum) RELAX(i + 1, SEG_ALNUM0,   from, 5); break;
+			case SEG_BYTE:                RELAX(i + 1, SEG_BYTE,     from, 8); break;
+			case SEG_KANJI:    if (sjis)  RELAX(i + 2, SEG_KANJI,    from, 13); break;
+			}
+
+			if (digit) RELAX(i + 1, SEG_NUMERIC1, from | SEG_NEW, head[SEG_NUMERIC1] + 4);
+			if (alnum) RELAX(i + 1, SEG_ALNUM1,   from | SEG_NEW, head[SEG_ALNUM1] + 6);
+			if (sjis)  RELAX(i + 2, SEG_KANJI,    from | SEG_NEW, head[SEG_KANJI] + 13);
+			RELAX(i + 1, SEG_BYTE, from | SEG_NEW, head[SEG_BYTE] + 8);
+		}
+	}
+
+#undef RELAX
+
+	/*
+	 * Walk back from the cheapest final state, marking the mode of each
+	 * segment at its first position. Nothing leads to SEG_NONE, so that
+	 * column of prev[] is free for the marks.
+	 */
+	unsigned st = 0;
+	for (unsigned k = 1; k < SEG_STATES; k++) {
+		if (cost[len * (SEG_STATES + 1) + k] < cost[len * (SEG_STATES + 1) + st]) {
+			st = k;
+		}
+	}
+
+	free(cost);
+
+#define START(i) prev[(i) * (SEG_STATES + 1) + SEG_NONE]
+
+	for (size_t j = len; j > 0; ) {
+		unsigned from = prev[j * (SEG_STATES + 1) + st];
+
+		j -= st == SEG_KANJI ? 2 : 1;
+
+		if (from & SEG_NEW) {
+			START(j) = seg_mode(st);
+		}
+
+		st = from & ~SEG_NEW;
+	}
+
+	*n = 0;
+
+	/* non-NULL even for no segments */
+	a = malloc(sizeof *a);
+	if (a == NULL) {
+		goto error;
+	}
+
+	for (size_t i = 0; i < len; ) {
+		enum qr_mode mode = START(i);
+		size_t j, limit;
+		void *tmp;
+
+		assert(mode != 0);
+
+		for (j = i + 1; j < len && START(j) == 0; j++)
+			;
+
+		/* the most bytes a character count indicator can count */
+		limit = ((size_t) 1 << count_char_bits(mode, ver)) - 1;
+		if (mode == QR_MODE_KANJI) {
+			limit *= 2;
+		}
+
+		if (j - i > limit) {
+			j = i + limit;
+			START(j) = mode;
+		}
+
+		tmp = realloc(a, sizeof *a * (*n + 1));
+		if (tmp == NULL) {
+			goto error;
+		}
+		a = tmp;
+
+		a[*n] = make_mode(mode, (const char *) p + i, j - i);
+		if (a[*n] == NULL) {
+			goto error;
+		}
+		(*n)++;
+
+		i = j;
+	}
+
+#undef START
+
+	free(prev);
+
+	return a;
+
+error:
+
+	for (size_t i = 0; i < *n; i++) {
+		seg_free(a[i]);
+	}
+
+	free(a);
+	free(prev);
+
+	return NULL;
+}
+
+struct qr_segment **
+qr_make_optimal(const void *data, size_t len, enum qr_ecl ecl,
+	unsigned min, unsigned max, bool kanji, size_t *n)
+{
+	static const unsigned class_max[] = { 9, 26, 40 };
+
+	assert(data != NULL || len == 0);
+	assert(QR_VER_MIN <= min && min <= max && max <= QR_VER_MAX);
+	assert(n != NULL);
+
+	for (size_t c = 0; c < sizeof class_max / sizeof *class_max; c++) {
+		struct qr_segment **a;
+		unsigned ver;
+		int bits;
+
+		if (class_max[c] < min) {
+			continue;
+		}
+
+		ver = class_max[c] < max ? class_max[c] : max;
+
+		a = seg_optimal(data, len, ver, kanji, n);
+		if (a == NULL) {
+			return NULL;
+		}
+
+		bits = count_total_bits(a, *n, ver);
+		if (bits != -1 && bits <= count_codewords(ver, ecl) * 8) {
+			return a;
+		}
+
+		for (size_t i = 0; i < *n; i++) {
+			seg_free(a[i]);
+		}
+		free(a);
+
+		if (ver == max) {
+			break;
+		}
+	}
+
+	errno = EMSGSIZE;
+	return NULL;
+}
+
 void
 seg_free(struct qr_segment *seg)
 {
@@ -593,7 +901,7 @@ seg_print(FILE *f, size_t n, struct qr_segment * const a[])
 	size_t j;
 
 	assert(f != NULL);
-	assert(a != NULL);
+	assert(a != NULL || n == 0);
 
 	enum eci eci = ECI_DEFAULT;
 
@@ -619,11 +927,11 @@ seg_print(FILE *f, size_t n, struct qr_segment * const a[])
 			/* TODO: iconv here, per eci */
 			(void) eci;
 
-			printf("      source string: len=%zu bytes\n", strlen(a[j]->u.s));
-			if (qr_isalnum(a[j]->u.s) || qr_isnumeric(a[j]->u.s)) {
-				printf("      \"%s\"\n", a[j]->u.s);
+			printf("      source string: len=%zu bytes\n", a[j]->len);
+			if (qr_isalnum(a[j]->s) || qr_isnumeric(a[j]->s)) {
+				printf("      \"%s\"\n", a[j]->s);
 			} else {
-				hexdump(stdout, (void *) a[j]->u.s, strlen(a[j]->u.s));
+				hexdump(stdout, (void *) a[j]->s, a[j]->len);
 			}
 			break;
 
@@ -631,21 +939,21 @@ seg_print(FILE *f, size_t n, struct qr_segment * const a[])
 			/* TODO: iconv here, per eci */
 			(void) eci;
 
-			printf("      source string: len=%zu bytes\n", BM_LEN(a[j]->u.m.bits));
-			hexdump(stdout, (void *) a[j]->u.m.data, BM_LEN(a[j]->u.m.bits));
+			printf("      source string: len=%zu bytes\n", a[j]->len);
+			hexdump(stdout, (void *) a[j]->s, a[j]->len);
 			break;
 
 		case QR_MODE_ECI:
-			printf("      eci: %u\n", a[j]->u.eci);
-			eci = a[j]->u.eci;
+			printf("      eci: %u\n", a[j]->eci);
+			eci = a[j]->eci;
 			break;
 
 		default:
 			break;
 		}
 
-		printf("      encoded data: %zu bits\n", a[j]->m.bits);
-		hexdump(stdout, a[j]->m.data, BM_LEN(a[j]->m.bits));
+		printf("      encoded data: %zu bits\n", a[j]->bits);
+		hexdump(stdout, QR_SEG_DATA(a[j]), BM_LEN(a[j]->bits));
 	}
 	printf("    }\n");
 	printf("    Segments total data length: %zu\n", seg_len(a, n));
@@ -2,6 +2,22 @@
 #ifndef SEG_H
 #define SEG_H
 
+/*
+ * Allocates a segment with room for len bytes of source data and the given
+ * number of encoded bits; see struct qr_segment.
+ */
+struct qr_segment *
+seg_alloc(enum qr_mode mode, size_t len, size_t bits);
+
+/*
+ * The number of characters in a segment, for its character count indicator.
+ */
+size_t
+seg_chars(const struct qr_segment *seg);
+
+struct qr_segment **
+seg_optimal(const void *data, size_t len, unsigned ver, bool kanji, size_t *n);
+
 size_t
 seg_len(struct qr_segment * const a[], size_t n);
 
@@ -111,6 +111,99 @@ AppendBitsToBuffer(void)
 }
 
 
+TEST
+BitWriter(void)
+{
+	for (int iter = 0; iter < 200; iter++) {
+		uint8_t expect[512], result[512], span[16];
+		struct bit_writer w;
+		size_t bitLen = 0;
+
+		memset(expect, 0, sizeof expect);
+		memset(result, 0xA5, sizeof result);
+		bit_writer_init(&w, result);
+
+		// random runs of fields and of spans at every alignment
+		while (bitLen < 3000) {
+			if (rand() % 2) {
+				size_t n = rand() % 33;
+				uint32_t v = ((uint32_t) rand() << 16 ^ rand()) & (uint32_t) ((1ULL << n) - 1);
+
+				append_bits(v, n, expect, &bitLen);
+				bit_writer_put(&w, v, n);
+			} else {
+				size_t n = rand() % (sizeof span * 8 + 1);
+
+				for (size_t i = 0; i < sizeof span; i++) {
+					span[i] = rand();
+				}
+
+				for (size_t i = 0; i < n; i++) {
+					append_bits((span[i / 8] >> (7 - i % 8)) & 1, 1, expect, &bitLen);
+				}
+				bit_writer_span(&w, span, n);
+			}
+
+			if (rand() % 8 == 0) {
+				ASSERT_EQ(bit_writer_flush(&w), bitLen);
+			}
+		}
+
+		ASSERT_EQ(bit_writer_flush(&w), bitLen);
+		ASSERT_EQ(memcmp(result, expect, BM_LEN(bitLen)), 0);
+		ASSERT_EQ(result[BM_LEN(bitLen)], 0xA5);
+	}
+
+	PASS();
+}
+
+
+TEST
+BitReader(void)
+{
+	for (int iter = 0; iter < 200; iter++) {
+		uint8_t buf[512], span[16], expect[16];
+		struct bit_reader r;
+		size_t bits, pos;
+
+		for (size_t i = 0; i < sizeof buf; i++) {
+			buf[i] = rand();
+		}
+
+		bits = rand() % (sizeof buf * 8);
+		pos  = rand() % (bits + 1);
+		bit_reader_init(&r, buf, bits, pos);
+
+		// random runs of fields and of spans, reading off the end
+		while (pos < bits) {
+			if (rand() % 2) {
+				size_t n = rand() % 32; // take_bits() returns int
+
+				ASSERT_EQ((int) bit_reader_take(&r, n), take_bits(buf, bits, n < bits ? n : bits, &pos));
+			} else {
+				size_t n = rand() % (sizeof span * 8 + 1);
+
+				if (n > bits - pos) {
+					n = bits - pos;
+				}
+
+				memset(expect, 0, sizeof expect);
+				for (size_t i = 0; i < n; i++) {
+					expect[i / 8] |= take_bits(buf, bits, 1, &pos) << (7 - i % 8);
+				}
+
+				bit_reader_span(&r, span, n);
+				ASSERT_EQ(memcmp(span, expect, BM_LEN(n)), 0);
+			}
+
+			ASSERT_EQ(r.pos, pos);
+		}
+	}
+
+	PASS();
+}
+
+
 // Ported from the Java version of the code.
 static uint8_t *append_eclReference(const uint8_t *data, int version, enum qr_ecl ecl) {
 	// Calculate parameter numbers
@@ -122,8 +215,7 @@ static uint8_t *append_eclReference(const uint8_t *data, int version, enum qr_ec
 	
 	// Split data into blocks and append ECC to each block
 	uint8_t **blocks = xmalloc(numBlocks * sizeof (uint8_t*));
-	uint8_t *generator = xmalloc(blockEccLen);
-	reed_solomon_generator(blockEccLen, generator);
+	const uint8_t *generator = reed_solomon_generator(blockEccLen);
 	for (int i = 0, k = 0; i < numBlocks; i++) {
 		uint8_t *block = xmalloc(shortBlockLen + 1);
 		int blockDataLen = shortBlockLen - blockEccLen + (i < numShortBlocks ? 0 : 1);
@@ -132,7 +224,6 @@ static uint8_t *append_eclReference(const uint8_t *data, int version, enum qr_ec
 		k += blockDataLen;
 		blocks[i] = block;
 	}
-	free(generator);
 	
 	// Interleave (not concatenate) the bytes from every block into a single sequence
 	uint8_t *result = xmalloc(rawCodewords);
@@ -167,7 +258,7 @@ AppendErrorCorrection(void)
 			uint8_t *paddedData = xmalloc(dataAndEccLen);
 			memcpy(paddedData, pureData, dataLen * sizeof(uint8_t));
 			uint8_t *actualOutput = xmalloc(dataAndEccLen);
-			append_ecl(paddedData, ver, (enum qr_ecl)ecl, actualOutput);
+			append_ecl(paddedData, ver, (enum qr_ecl)ecl, NULL, actualOutput);
 			
 			ASSERT_EQ(memcmp(actualOutput, expectOutput, dataAndEccLen * sizeof(uint8_t)), 0);
 			free(pureData);
@@ -283,23 +374,23 @@ GetNumDataCodewords(void)
 TEST
 CalcReedSolomonGenerator(void)
 {
-	uint8_t generator[30];
+	const uint8_t *generator;
 	
-	reed_solomon_generator(1, generator);
+	generator = reed_solomon_generator(1);
 	ASSERT_EQ(generator[0], 0x01);
 	
-	reed_solomon_generator(2, generator);
+	generator = reed_solomon_generator(2);
 	ASSERT_EQ(generator[0], 0x03);
 	ASSERT_EQ(generator[1], 0x02);
 	
-	reed_solomon_generator(5, generator);
+	generator = reed_solomon_generator(5);
 	ASSERT_EQ(generator[0], 0x1F);
 	ASSERT_EQ(generator[1], 0xC6);
 	ASSERT_EQ(generator[2], 0x3F);
 	ASSERT_EQ(generator[3], 0x93);
 	ASSERT_EQ(generator[4], 0x74);
 	
-	reed_solomon_generator(30, generator);
+	generator = reed_solomon_generator(30);
 	ASSERT_EQ(generator[ 0], 0xD4);
 	ASSERT_EQ(generator[ 1], 0xF6);
 	ASSERT_EQ(generator[ 5], 0xC0);
@@ -313,25 +404,66 @@ CalcReedSolomonGenerator(void)
 }
 
 
+// The bit-serial multiply and generator this library used before switching to tables.
+static uint8_t finiteFieldMulReference(uint8_t x, uint8_t y) {
+	uint8_t z = 0;
+	for (int i = 7; i >= 0; i--) {
+		z = (z << 1) ^ ((z >> 7) * 0x11D);
+		z ^= ((y >> i) & 1) * x;
+	}
+	return z;
+}
+
+static void reed_solomon_generatorReference(int degree, uint8_t *r) {
+	memset(r, 0, degree);
+	r[degree - 1] = 1;
+	uint8_t root = 1;
+	for (int i = 0; i < degree; i++) {
+		for (int j = 0; j < degree; j++) {
+			r[j] = finiteFieldMulReference(r[j], root);
+			if (j + 1 < degree)
+				r[j] ^= r[j + 1];
+		}
+		root = finiteFieldMulReference(root, 0x02);
+	}
+}
+
+
+TEST
+ReedSolomonTables(void)
+{
+	for (int x = 0; x < 256; x++) {
+		for (int y = 0; y < 256; y++)
+			ASSERT_EQ(finiteFieldMul(x, y), finiteFieldMulReference(x, y));
+	}
+
+	for (int degree = 1; degree <= 30; degree++) {
+		uint8_t expect[30];
+		reed_solomon_generatorReference(degree, expect);
+		ASSERT_EQ(memcmp(reed_solomon_generator(degree), expect, degree), 0);
+	}
+
+	PASS();
+}
+
+
 TEST
 CalcReedSolomonRemainder(void)
 {
 	{
 		uint8_t data[1];
-		uint8_t generator[3];
-		uint8_t remainder[ARRAY_LENGTH(generator)];
-		reed_solomon_generator(ARRAY_LENGTH(generator), generator);
-		reed_solomon_remainder(data, 0, generator, ARRAY_LENGTH(generator), remainder);
+		uint8_t remainder[3];
+		const uint8_t *generator = reed_solomon_generator(ARRAY_LENGTH(remainder));
+		reed_solomon_remainder(data, 0, generator, ARRAY_LENGTH(remainder), remainder);
 		ASSERT_EQ(remainder[0], 0);
 		ASSERT_EQ(remainder[1], 0);
 		ASSERT_EQ(remainder[2], 0);
 	}
 	{
 		uint8_t data[2] = {0, 1};
-		uint8_t generator[4];
-		uint8_t remainder[ARRAY_LENGTH(generator)];
-		reed_solomon_generator(ARRAY_LENGTH(generator), generator);
-		reed_solomon_remainder(data, ARRAY_LENGTH(data), generator, ARRAY_LENGTH(generator), remainder);
+		uint8_t remainder[4];
+		const uint8_t *generator = reed_solomon_generator(ARRAY_LENGTH(remainder));
+		reed_solomon_remainder(data, ARRAY_LENGTH(data), generator, ARRAY_LENGTH(remainder), remainder);
 		ASSERT_EQ(remainder[0], generator[0]);
 		ASSERT_EQ(remainder[1], generator[1]);
 		ASSERT_EQ(remainder[2], generator[2]);
@@ -339,10 +471,9 @@ CalcReedSolomonRemainder(void)
 	}
 	{
 		uint8_t data[5] = {0x03, 0x3A, 0x60, 0x12, 0xC7};
-		uint8_t generator[5];
-		uint8_t remainder[ARRAY_LENGTH(generator)];
-		reed_solomon_generator(ARRAY_LENGTH(generator), generator);
-		reed_solomon_remainder(data, ARRAY_LENGTH(data), generator, ARRAY_LENGTH(generator), remainder);
+		uint8_t remainder[5];
+		const uint8_t *generator = reed_solomon_generator(ARRAY_LENGTH(remainder));
+		reed_solomon_remainder(data, ARRAY_LENGTH(data), generator, ARRAY_LENGTH(remainder), remainder);
 		ASSERT_EQ(remainder[0], 0xCB);
 		ASSERT_EQ(remainder[1], 0x36);
 		ASSERT_EQ(remainder[2], 0x16);
@@ -357,10 +488,9 @@ CalcReedSolomonRemainder(void)
 			0xB0, 0x8B, 0x78, 0x6B, 0x49, 0xD0, 0x1A, 0xAD, 0xF3, 0xEF,
 			0x52, 0x7D, 0x9A,
 		};
-		uint8_t generator[30];
-		uint8_t remainder[ARRAY_LENGTH(generator)];
-		reed_solomon_generator(ARRAY_LENGTH(generator), generator);
-		reed_solomon_remainder(data, ARRAY_LENGTH(data), generator, ARRAY_LENGTH(generator), remainder);
+		uint8_t remainder[30];
+		const uint8_t *generator = reed_solomon_generator(ARRAY_LENGTH(remainder));
+		reed_solomon_remainder(data, ARRAY_LENGTH(data), generator, ARRAY_LENGTH(remainder), remainder);
 		ASSERT_EQ(remainder[ 0], 0xCE);
 		ASSERT_EQ(remainder[ 1], 0xF0);
 		ASSERT_EQ(remainder[ 2], 0x31);
@@ -378,6 +508,171 @@ CalcReedSolomonRemainder(void)
 }
 
 
+TEST
+ReedSolomonKernels(void)
+{
+	const enum rs_kernel kernels[] = {
+		RS_KERNEL_AUTO, RS_KERNEL_WORD, RS_KERNEL_SSSE3, RS_KERNEL_AVX2
+	};
+
+	for (size_t k = 0; k < ARRAY_LENGTH(kernels); k++) {
+		struct rs_encoder e;
+
+		// Not every CPU has every kernel
+		if (!rs_encoder_init(&e, reed_solomon_generator(1), 1, kernels[k])) {
+			continue;
+		}
+
+		// The same cases as CalcReedSolomonRemainder
+		{
+			uint8_t data[1];
+			uint8_t remainder[3];
+			ASSERT(rs_encoder_init(&e, reed_solomon_generator(3), 3, kernels[k]));
+			e.remainder(&e, data, 0, remainder);
+			ASSERT_EQ(remainder[0], 0);
+			ASSERT_EQ(remainder[1], 0);
+			ASSERT_EQ(remainder[2], 0);
+		}
+		{
+			uint8_t data[2] = {0, 1};
+			uint8_t remainder[4];
+			const uint8_t *generator = reed_solomon_generator(ARRAY_LENGTH(remainder));
+			ASSERT(rs_encoder_init(&e, generator, ARRAY_LENGTH(remainder), kernels[k]));
+			e.remainder(&e, data, ARRAY_LENGTH(data), remainder);
+			ASSERT_EQ(memcmp(remainder, generator, ARRAY_LENGTH(remainder)), 0);
+		}
+		{
+			uint8_t data[5] = {0x03, 0x3A, 0x60, 0x12, 0xC7};
+			uint8_t remainder[5];
+			ASSERT(rs_encoder_init(&e, reed_solomon_generator(5), 5, kernels[k]));
+			e.remainder(&e, data, ARRAY_LENGTH(data), remainder);
+			ASSERT_EQ(remainder[0], 0xCB);
+			ASSERT_EQ(remainder[1], 0x36);
+			ASSERT_EQ(remainder[2], 0x16);
+			ASSERT_EQ(remainder[3], 0xFA);
+			ASSERT_EQ(remainder[4], 0x9D);
+		}
+
+		// Every degree, and lengths around each multiple of the chunk size
+		for (size_t degree = 1; degree <= 30; degree++) {
+			const uint8_t *generator = reed_solomon_generator(degree);
+			ASSERT(rs_encoder_init(&e, generator, degree, kernels[k]));
+
+			for (size_t len = 0; len <= 130; len++) {
+				uint8_t data[130];
+				uint8_t expect[30], remainder[30];
+
+				for (size_t i = 0; i < len; i++) {
+					data[i] = rand() % 256;
+				}
+
+				reed_solomon_remainder(data, len, generator, degree, expect);
+				e.remainder(&e, data, len, remainder);
+				ASSERT_EQ(memcmp(remainder, expect, degree), 0);
+			}
+		}
+	}
+
+	PASS();
+}
+
+
+// The syndromes as the decoder computed them before switching to Horner's rule.
+static void block_syndromesReference(const uint8_t *data, int bs, int npar, uint8_t *s) {
+	memset(s, 0, MAX_POLY);
+	for (int i = 0; i < npar; i++) {
+		for (int j = 0; j < bs; j++) {
+			uint8_t c = data[bs - j - 1];
+			if (c)
+				s[i] ^= gf256_exp[((int) gf256_log[c] + i * j) % 255];
+		}
+	}
+}
+
+
+TEST
+CorrectBlock(void)
+{
+	for (int npar = 2; npar <= 30; npar++) {
+		for (int dw = 1; dw <= 122; dw += 11) {
+			uint8_t block[152], orig[152];
+			uint8_t s[MAX_POLY], expect[MAX_POLY];
+			unsigned corrections;
+			int bs = dw + npar;
+
+			for (int i = 0; i < dw; i++) {
+				block[i] = rand() % 256;
+			}
+			reed_solomon_remainder(block, dw, reed_solomon_generator(npar), npar, &block[dw]);
+			memcpy(orig, block, bs);
+
+			ASSERT_FALSE(block_syndromes(block, bs, npar, s));
+			ASSERT_EQ(correct_block(block, NULL, bs, dw, 0, &corrections), QR_SUCCESS);
+			ASSERT_EQ(corrections, 0);
+
+			// Correctable errors at distinct positions
+			int t = rand() % (npar / 2 + 1);
+			for (int i = 0; i < t; ) {
+				int pos = rand() % bs;
+				if (block[pos] != orig[pos])
+					continue;
+				block[pos] ^= 1 + rand() % 255;
+				i++;
+			}
+
+			block_syndromesReference(block, bs, npar, expect);
+			ASSERT_EQ(block_syndromes(block, bs, npar, s), t > 0);
+			ASSERT_EQ(memcmp(s, expect, MAX_POLY), 0);
+
+			ASSERT_EQ(correct_block(block, NULL, bs, dw, 0, &corrections), QR_SUCCESS);
+			ASSERT_EQ(corrections, (unsigned) t);
+			ASSERT_EQ(memcmp(block, orig, bs), 0);
+
+			// Erasures, some of which were read correctly, and errors
+			// in the parity they leave
+			uint8_t erased[152] = { 0 };
+			int f = rand() % (npar + 1);
+			for (int i = 0; i < f; ) {
+				int pos = rand() % bs;
+				if (erased[pos])
+					continue;
+				erased[pos] = 1;
+				if (rand() % 4)
+					block[pos] ^= rand() % 256;
+				i++;
+			}
+			t = rand() % ((npar - f) / 2 + 1);
+			for (int i = 0; i < t; ) {
+				int pos = rand() % bs;
+				if (erased[pos] || block[pos] != orig[pos])
+					continue;
+				block[pos] ^= 1 + rand() % 255;
+				i++;
+			}
+
+			ASSERT_EQ(correct_block(block, erased, bs, dw, 0, &corrections), QR_SUCCESS);
+			ASSERT(corrections <= (unsigned) (f + t));
+			ASSERT_EQ(memcmp(block, orig, bs), 0);
+
+			// Too many errors: any block accepted must be a codeword,
+			// and a block rejected is left as it was
+			for (int i = 0; i < npar; i++) {
+				block[rand() % bs] ^= 1 + rand() % 255;
+			}
+			memcpy(orig, block, bs);
+			if (correct_block(block, NULL, bs, dw, 0, &corrections) == QR_SUCCESS) {
+				ASSERT_FALSE(block_syndromes(block, bs, npar, s));
+				ASSERT(corrections <= (unsigned) npar / 2);
+			} else {
+				ASSERT_EQ(memcmp(block, orig, bs), 0);
+			}
+		}
+	}
+
+	PASS();
+}
+
+
 TEST
 FiniteFieldMultiply(void)
 {
@@ -474,6 +769,38 @@ GetAlignmentPatternPositions(void)
 }
 
 
+TEST
+DataRegion(void)
+{
+	for (unsigned ver = QR_VER_MIN; ver <= QR_VER_MAX; ver++) {
+		const uint8_t *region = qr_data_region(ver);
+		uint8_t map[QR_BUF_LEN_MAX];
+		struct qr q = { QR_SIZE(ver), map };
+
+		draw_init(ver, &q);
+
+		for (unsigned y = 0; y < q.size; y++) {
+			for (unsigned x = 0; x < q.size; x++) {
+				size_t i = y * q.size + x;
+				ASSERT_EQ(BM_GET(region, i), !qr_get_module(&q, x, y));
+				ASSERT_EQ(reserved_module(&q, x, y), qr_get_module(&q, x, y));
+			}
+		}
+
+		for (size_t i = q.size * q.size; i < QR_BUF_LEN(ver) * 8; i++)
+			ASSERT_EQ(BM_GET(region, i), 0);
+
+		// The template is the function patterns drawn, and white elsewhere
+		draw_white_function_modules(&q, ver);
+		ASSERT_EQ(memcmp(qr_function_template(ver), map, QR_BUF_LEN(ver)), 0);
+		for (size_t i = 0; i < QR_BUF_LEN(ver); i++)
+			ASSERT_EQ(qr_function_template(ver)[i] & region[i], 0);
+	}
+
+	PASS();
+}
+
+
 TEST
 GetSetModule(void)
 {
@@ -562,6 +889,235 @@ GetSetModuleRandomly(void)
 }
 
 
+TEST
+GetSetRows(void)
+{
+	for (unsigned ver = QR_VER_MIN; ver <= QR_VER_MAX; ver++) {
+		uint8_t map[QR_BUF_LEN_MAX], expect[QR_BUF_LEN_MAX];
+		uint64_t words[QR_ROWS_LEN_MAX];
+		struct qr q = { QR_SIZE(ver), map };
+		struct qr_rows r;
+		r.words = words;
+
+		for (size_t i = 0; i < QR_BUF_LEN(ver); i++)
+			map[i] = rand() % 256;
+
+		qr_get_rows(&q, &r);
+		ASSERT_EQ(r.size, q.size);
+		for (unsigned y = 0; y < q.size; y++) {
+			const uint64_t *row = QR_ROW(&r, y);
+			for (unsigned x = 0; x < QR_ROW_WORDS(q.size) * 64; x++)
+				ASSERT_EQ(QR_ROW_GET(row, x), x < q.size && qr_get_module(&q, x, y));
+		}
+
+		// Setting a row changes only that row, and ignores the padding
+		for (int i = 0; i < 20; i++) {
+			unsigned y = rand() % q.size;
+			uint64_t row[QR_ROW_WORDS_MAX];
+
+			for (size_t k = 0; k < QR_ROW_WORDS_MAX; k++)
+				row[k] = (uint64_t) rand() << 32 ^ rand();
+
+			memcpy(expect, map, QR_BUF_LEN(ver));
+			struct qr e = { q.size, expect };
+			for (unsigned x = 0; x < q.size; x++)
+				qr_set_module(&e, x, y, QR_ROW_GET(row, x));
+
+			qr_set_row(&q, y, row);
+			ASSERT_EQ(memcmp(map, expect, QR_BUF_LEN(ver)), 0);
+		}
+
+		qr_get_rows(&q, &r);
+		memset(map, 0, QR_BUF_LEN(ver));
+		qr_set_rows(&q, &r);
+		for (unsigned y = 0; y < q.size; y++) {
+			for (unsigned x = 0; x < q.size; x++)
+				ASSERT_EQ(qr_get_module(&q, x, y), QR_ROW_GET(QR_ROW(&r, y), x));
+		}
+	}
+
+	PASS();
+}
+
+
+static bool
+mask_bitReference(int mask, unsigned x, unsigned y)
+{
+	switch (mask) {
+	case 0: return (x + y) % 2 == 0;
+	case 1: return y % 2 == 0;
+	case 2: return x % 3 == 0;
+	case 3: return (x + y) % 3 == 0;
+	case 4: return (x / 3 + y / 2) % 2 == 0;
+	case 5: return x * y % 2 + x * y % 3 == 0;
+	case 6: return (x * y % 2 + x * y % 3) % 2 == 0;
+	case 7: return ((x + y) % 2 + x * y % 3) % 2 == 0;
+	default: return false;
+	}
+}
+
+
+TEST
+ApplyMask(void)
+{
+	for (unsigned ver = QR_VER_MIN; ver <= QR_VER_MAX; ver++) {
+		for (int mask = 0; mask < 8; mask++) {
+			uint8_t map[QR_BUF_LEN_MAX], orig[QR_BUF_LEN_MAX];
+			struct qr q = { QR_SIZE(ver), map };
+			struct qr o = { QR_SIZE(ver), orig };
+
+			for (size_t i = 0; i < QR_BUF_LEN(ver); i++)
+				map[i] = orig[i] = rand() % 256;
+
+			qr_apply_mask(&q, mask);
+
+			for (unsigned y = 0; y < q.size; y++) {
+				for (unsigned x = 0; x < q.size; x++) {
+					bool flip = !reserved_module(&q, x, y) && mask_bitReference(mask, x, y);
+					ASSERT_EQ(qr_get_module(&q, x, y), qr_get_module(&o, x, y) ^ flip);
+				}
+			}
+
+			// Bits past the end of the symbol are untouched
+			for (size_t i = q.size * q.size; i < QR_BUF_LEN(ver) * 8; i++)
+				ASSERT_EQ(BM_GET(map, i), BM_GET(orig, i));
+		}
+	}
+
+	PASS();
+}
+
+
+static long
+penaltyReference(const struct qr *q)
+{
+	long result = 0;
+
+	// Adjacent modules in row having same color
+	for (unsigned y = 0; y < q->size; y++) {
+		bool colorX;
+		for (unsigned x = 0, runX; x < q->size; x++) {
+			if (x == 0 || qr_get_module(q, x, y) != colorX) {
+				colorX = qr_get_module(q, x, y);
+				runX = 1;
+			} else {
+				runX++;
+				if (runX == 5)
+					result += PENALTY_N1;
+				else if (runX > 5)
+					result++;
+			}
+		}
+	}
+	// Adjacent modules in column having same color
+	for (unsigned x = 0; x < q->size; x++) {
+		bool colorY;
+		for (unsigned y = 0, runY; y < q->size; y++) {
+			if (y == 0 || qr_get_module(q, x, y) != colorY) {
+				colorY = qr_get_module(q, x, y);
+				runY = 1;
+			} else {
+				runY++;
+				if (runY == 5)
+					result += PENALTY_N1;
+				else if (runY > 5)
+					result++;
+			}
+		}
+	}
+
+	// 2*2 blocks of modules having same color
+	for (unsigned y = 0; y < q->size - 1; y++) {
+		for (unsigned x = 0; x < q->size - 1; x++) {
+			bool  color = qr_get_module(q, x, y);
+			if (  color == qr_get_module(q, x + 1, y) &&
+			      color == qr_get_module(q, x, y + 1) &&
+			      color == qr_get_module(q, x + 1, y + 1))
+				result += PENALTY_N2;
+		}
+	}
+
+	// Finder-like pattern in rows
+	for (unsigned y = 0; y < q->size; y++) {
+		for (unsigned x = 0, bits = 0; x < q->size; x++) {
+			bits = ((bits << 1) & 0x7FF) | (qr_get_module(q, x, y) ? 1 : 0);
+			if (x >= 10 && (bits == 0x05D || bits == 0x5D0))  // Needs 11 bits accumulated
+				result += PENALTY_N3;
+		}
+	}
+	// Finder-like pattern in columns
+	for (unsigned x = 0; x < q->size; x++) {
+		for (unsigned y = 0, bits = 0; y < q->size; y++) {
+			bits = ((bits << 1) & 0x7FF) | (qr_get_module(q, x, y) ? 1 : 0);
+			if (y >= 10 && (bits == 0x05D || bits == 0x5D0))  // Needs 11 bits accumulated
+				result += PENALTY_N3;
+		}
+	}
+
+	// Balance of dark and light modules
+	unsigned v = 0;
+	for (unsigned y = 0; y < q->size; y++) {
+		for (unsigned x = 0; x < q->size; x++) {
+			if (qr_get_module(q, x, y))
+				v++;
+		}
+	}
+
+	size_t total = q->size * q->size;
+	// Find smallest k such that (45-5k)% <= dark/total <= (55+5k)%
+	for (unsigned k = 0; v * 20L < (9L - k) * total || v * 20L > (11L + k) * total; k++)
+		result += PENALTY_N4;
+
+	return result;
+}
+
+
+TEST
+PenaltyScore(void)
+{
+	for (unsigned ver = QR_VER_MIN; ver <= QR_VER_MAX; ver++) {
+		for (int i = 0; i < 4; i++) {
+			uint8_t map[QR_BUF_LEN_MAX], orig[QR_BUF_LEN_MAX];
+			struct qr q = { QR_SIZE(ver), map };
+			long score[8];
+
+			// Modules copying their neighbour with varying likelihood,
+			// to make long runs and finder-like patterns
+			memset(map, 0, sizeof map);
+			for (unsigned y = 0; y < q.size; y++) {
+				for (unsigned x = 0; x < q.size; x++) {
+					bool v;
+					if (rand() % 4 < i)
+						v = x > 0 ? qr_get_module(&q, x - 1, y) : false;
+					else if (rand() % 4 < i)
+						v = y > 0 ? qr_get_module(&q, x, y - 1) : false;
+					else
+						v = rand() % 2;
+					qr_set_module(&q, x, y, v);
+				}
+			}
+
+			if (i % 2 == 1) {
+				draw_init(ver, &q);
+				draw_white_function_modules(&q, ver);
+			}
+
+			enum qr_ecl ecl = rand() % 4;
+			penalty_masks(&q, ecl, score);
+			memcpy(orig, map, sizeof map);
+
+			for (int mask = 0; mask < 8; mask++) {
+				memcpy(map, orig, sizeof map);
+				draw_format(ecl, mask, &q);
+				qr_apply_mask(&q, mask);
+				ASSERT_EQ(score[mask], penaltyReference(&q));
+			}
+		}
+	}
+
+	PASS();
+}
+
 TEST
 IsAlphanumeric(void)
 {
@@ -889,19 +1445,19 @@ MakeBytes(void)
 	{
 		const uint8_t data[] = {0x00};
 		struct qr_segment *seg = qr_make_bytes(data, 1);
-		ASSERT_EQ(seg->u.m.bits, 8);
-		ASSERT_EQ(seg->m.bits, 8);
-		ASSERT_EQ(seg->m.data[0], 0x00);
+		ASSERT_EQ(seg->len, 1);
+		ASSERT_EQ(seg->bits, 8);
+		ASSERT_EQ(QR_SEG_DATA(seg)[0], 0x00);
 		seg_free(seg);
 	}
 	{
 		const uint8_t data[] = {0xEF, 0xBB, 0xBF};
 		struct qr_segment *seg = qr_make_bytes(data, 3);
-		ASSERT_EQ(seg->u.m.bits, 3 * 8);
-		ASSERT_EQ(seg->m.bits, 24);
-		ASSERT_EQ(seg->m.data[0], 0xEF);
-		ASSERT_EQ(seg->m.data[1], 0xBB);
-		ASSERT_EQ(seg->m.data[2], 0xBF);
+		ASSERT_EQ(seg->len, 3);
+		ASSERT_EQ(seg->bits, 24);
+		ASSERT_EQ(QR_SEG_DATA(seg)[0], 0xEF);
+		ASSERT_EQ(QR_SEG_DATA(seg)[1], 0xBB);
+		ASSERT_EQ(QR_SEG_DATA(seg)[2], 0xBF);
 		seg_free(seg);
 	}
 
@@ -914,35 +1470,35 @@ MakeNumeric(void)
 {
 	{
 		struct qr_segment *seg = qr_make_numeric("9");
-		ASSERT_EQ(strlen(seg->u.s), 1);
-		ASSERT_EQ(seg->m.bits, 4);
-		ASSERT_EQ(seg->m.data[0], 0x90);
+		ASSERT_EQ(seg->len, 1);
+		ASSERT_EQ(seg->bits, 4);
+		ASSERT_EQ(QR_SEG_DATA(seg)[0], 0x90);
 		seg_free(seg);
 	}
 	{
 		struct qr_segment *seg = qr_make_numeric("81");
-		ASSERT_EQ(strlen(seg->u.s), 2);
-		ASSERT_EQ(seg->m.bits, 7);
-		ASSERT_EQ(seg->m.data[0], 0xA2);
+		ASSERT_EQ(seg->len, 2);
+		ASSERT_EQ(seg->bits, 7);
+		ASSERT_EQ(QR_SEG_DATA(seg)[0], 0xA2);
 		seg_free(seg);
 	}
 	{
 		struct qr_segment *seg = qr_make_numeric("673");
-		ASSERT_EQ(strlen(seg->u.s), 3);
-		ASSERT_EQ(seg->m.bits, 10);
-		ASSERT_EQ(seg->m.data[0], 0xA8);
-		ASSERT_EQ(seg->m.data[1], 0x40);
+		ASSERT_EQ(seg->len, 3);
+		ASSERT_EQ(seg->bits, 10);
+		ASSERT_EQ(QR_SEG_DATA(seg)[0], 0xA8);
+		ASSERT_EQ(QR_SEG_DATA(seg)[1], 0x40);
 		seg_free(seg);
 	}
 	{
 		struct qr_segment *seg = qr_make_numeric("3141592653");
-		ASSERT_EQ(strlen(seg->u.s), 10);
-		ASSERT_EQ(seg->m.bits, 34);
-		ASSERT_EQ(seg->m.data[0], 0x4E);
-		ASSERT_EQ(seg->m.data[1], 0x89);
-		ASSERT_EQ(seg->m.data[2], 0xF4);
-		ASSERT_EQ(seg->m.data[3], 0x24);
-		ASSERT_EQ(seg->m.data[4], 0xC0);
+		ASSERT_EQ(seg->len, 10);
+		ASSERT_EQ(seg->bits, 34);
+		ASSERT_EQ(QR_SEG_DATA(seg)[0], 0x4E);
+		ASSERT_EQ(QR_SEG_DATA(seg)[1], 0x89);
+		ASSERT_EQ(QR_SEG_DATA(seg)[2], 0xF4);
+		ASSERT_EQ(QR_SEG_DATA(seg)[3], 0x24);
+		ASSERT_EQ(QR_SEG_DATA(seg)[4], 0xC0);
 		seg_free(seg);
 	}
 
@@ -955,26 +1511,26 @@ MakeAlphanumeric(void)
 {
 	{
 		struct qr_segment *seg = qr_make_alnum("A");
-		ASSERT_EQ(strlen(seg->u.s), 1);
-		ASSERT_EQ(seg->m.bits, 6);
-		ASSERT_EQ(seg->m.data[0], 0x28);
+		ASSERT_EQ(seg->len, 1);
+		ASSERT_EQ(seg->bits, 6);
+		ASSERT_EQ(QR_SEG_DATA(seg)[0], 0x28);
 		seg_free(seg);
 	}
 	{
 		struct qr_segment *seg = qr_make_alnum("%:");
-		ASSERT_EQ(strlen(seg->u.s), 2);
-		ASSERT_EQ(seg->m.bits, 11);
-		ASSERT_EQ(seg->m.data[0], 0xDB);
-		ASSERT_EQ(seg->m.data[1], 0x40);
+		ASSERT_EQ(seg->len, 2);
+		ASSERT_EQ(seg->bits, 11);
+		ASSERT_EQ(QR_SEG_DATA(seg)[0], 0xDB);
+		ASSERT_EQ(QR_SEG_DATA(seg)[1], 0x40);
 		seg_free(seg);
 	}
 	{
 		struct qr_segment *seg = qr_make_alnum("Q R");
-		ASSERT_EQ(strlen(seg->u.s), 3);
-		ASSERT_EQ(seg->m.bits, 17);
-		ASSERT_EQ(seg->m.data[0], 0x96);
-		ASSERT_EQ(seg->m.data[1], 0xCD);
-		ASSERT_EQ(seg->m.data[2], 0x80);
+		ASSERT_EQ(seg->len, 3);
+		ASSERT_EQ(seg->bits, 17);
+		ASSERT_EQ(QR_SEG_DATA(seg)[0], 0x96);
+		ASSERT_EQ(QR_SEG_DATA(seg)[1], 0xCD);
+		ASSERT_EQ(QR_SEG_DATA(seg)[2], 0x80);
 		seg_free(seg);
 	}
 
@@ -988,23 +1544,23 @@ MakeEci(void)
 	{
 		struct qr_segment *seg = qr_make_eci(127);
 		ASSERT_EQ(seg->mode, QR_MODE_ECI);
-		ASSERT_EQ(seg->m.bits, 8);
-		ASSERT_EQ(seg->m.data[0], 0x7F);
+		ASSERT_EQ(seg->bits, 8);
+		ASSERT_EQ(QR_SEG_DATA(seg)[0], 0x7F);
 		seg_free(seg);
 	}
 	{
 		struct qr_segment *seg = qr_make_eci(10345);
-		ASSERT_EQ(seg->m.bits, 16);
-		ASSERT_EQ(seg->m.data[0], 0xA8);
-		ASSERT_EQ(seg->m.data[1], 0x69);
+		ASSERT_EQ(seg->bits, 16);
+		ASSERT_EQ(QR_SEG_DATA(seg)[0], 0xA8);
+		ASSERT_EQ(QR_SEG_DATA(seg)[1], 0x69);
 		seg_free(seg);
 	}
 	{
 		struct qr_segment *seg = qr_make_eci(999999);
-		ASSERT_EQ(seg->m.bits, 24);
-		ASSERT_EQ(seg->m.data[0], 0xCF);
-		ASSERT_EQ(seg->m.data[1], 0x42);
-		ASSERT_EQ(seg->m.data[2], 0x3F);
+		ASSERT_EQ(seg->bits, 24);
+		ASSERT_EQ(QR_SEG_DATA(seg)[0], 0xCF);
+		ASSERT_EQ(QR_SEG_DATA(seg)[1], 0x42);
+		ASSERT_EQ(QR_SEG_DATA(seg)[2], 0x3F);
 		seg_free(seg);
 	}
 
@@ -1012,6 +1568,188 @@ MakeEci(void)
 }
 
 
+TEST
+MakeKanji(void)
+{
+	{
+		// QR 2005 6.4.6: 点 and 茗 in Shift-JIS
+		const uint8_t data[] = { 0x93, 0x5F, 0xE4, 0xAA };
+		struct qr_segment *seg = qr_make_kanji(data, sizeof data);
+		ASSERT_EQ(seg->mode, QR_MODE_KANJI);
+		ASSERT_EQ(seg->len, 4);
+		ASSERT_EQ(seg_chars(seg), 2);
+		ASSERT_EQ(seg->bits, 26);
+		ASSERT_EQ(QR_SEG_DATA(seg)[0], 0x6C);
+		ASSERT_EQ(QR_SEG_DATA(seg)[1], 0xFE);
+		ASSERT_EQ(QR_SEG_DATA(seg)[2], 0xAA);
+		ASSERT_EQ(QR_SEG_DATA(seg)[3], 0x80);
+		seg_free(seg);
+	}
+
+	PASS();
+}
+
+/*
+ * The fewest bits for data[0 : len] at a version, by trying every
+ * segment for every prefix.
+ */
+static long
+optimalReference(const uint8_t *p, size_t len, unsigned ver, bool kanji)
+{
+	const enum qr_mode modes[] = { QR_MODE_NUMERIC, QR_MODE_ALNUM, QR_MODE_BYTE, QR_MODE_KANJI };
+	long f[64 + 1];
+
+	assert(len <= 64);
+
+	f[0] = 0;
+
+	for (size_t j = 1; j <= len; j++) {
+		f[j] = LONG_MAX;
+
+		for (size_t i = 0; i < j; i++) {
+			for (size_t m = 0; m < ARRAY_LENGTH(modes); m++) {
+				size_t chars = j - i;
+				bool ok = true;
+
+				for (size_t k = i; k < j && ok; k++) {
+					switch (modes[m]) {
+					case QR_MODE_NUMERIC: ok = isdigit(p[k]);                          break;
+					case QR_MODE_ALNUM:   ok = p[k] && strchr(ALNUM_CHARSET, p[k]);    break;
+					case QR_MODE_KANJI:   ok = kanji && (j - i) % 2 == 0 && ((k - i) % 2 || is_kanji(p + k)); break;
+					default:              ok = true;                                   break;
+					}
+				}
+
+				if (!ok || f[i] == LONG_MAX) {
+					continue;
+				}
+
+				if (modes[m] == QR_MODE_KANJI) {
+					chars /= 2;
+				}
+
+				long c = f[i] + 4 + count_char_bits(modes[m], ver) + count_seg_bits(modes[m], chars);
+				if (c < f[j]) {
+					f[j] = c;
+				}
+			}
+		}
+	}
+
+	return f[len];
+}
+
+TEST
+MakeOptimal(void)
+{
+	static const char *pieces[] = {
+		"0", "7", "12345", "A", "Z", "HELLO ", "$%*+-./:", "a", "hello", "\xff", "\x93\x5f", "\xe4\xaa"
+	};
+
+	for (int iter = 0; iter < 200; iter++) {
+		char s[64 + 1];
+		size_t len = 0;
+
+		while (len < 48) {
+			const char *piece = pieces[rand() % ARRAY_LENGTH(pieces)];
+			memcpy(s + len, piece, strlen(piece));
+			len += strlen(piece);
+		}
+		s[len] = '\0';
+
+		struct qr_segment *any = qr_make_any(s);
+
+		for (unsigned ver = 1; ver <= QR_VER_MAX; ver += ver == 1 ? 9 : 17) {
+			for (int kanji = 0; kanji <= 1; kanji++) {
+				struct qr_segment **a;
+				size_t n, total;
+
+				a = seg_optimal(s, len, ver, kanji, &n);
+				ASSERT(a != NULL);
+
+				// exactly the fewest bits, and never more than a single segment
+				int bits = count_total_bits(a, n, ver);
+				ASSERT_EQ(bits, optimalReference((const uint8_t *) s, len, ver, kanji));
+				ASSERT(bits <= count_total_bits(&any, 1, ver));
+
+				total = 0;
+				for (size_t i = 0; i < n; i++) {
+					ASSERT(kanji || a[i]->mode != QR_MODE_KANJI);
+					ASSERT_EQ(memcmp(a[i]->s, s + total, a[i]->len), 0);
+					total += a[i]->len;
+					seg_free(a[i]);
+				}
+				ASSERT_EQ(total, len);
+				free(a);
+			}
+		}
+
+		seg_free(any);
+	}
+
+	{
+		struct qr_segment **a;
+		struct qr_data data;
+		struct qr_stats stats;
+		struct qr q;
+		size_t n;
+
+		uint8_t map[QR_BUF_LEN_MAX];
+		uint8_t tmp[QR_BUF_LEN_MAX];
+		q.map = map;
+
+		const char s[] = "\x93\x5f\xe4\xaa" "0123456789012345678901234567890123456789"
+			"The quick brown fox" "HTTP://EXAMPLE.COM/ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+		a = qr_make_optimal(s, sizeof s - 1, QR_ECL_MEDIUM, QR_VER_MIN, QR_VER_MAX, true, &n);
+		ASSERT(a != NULL);
+		ASSERT(n > 1);
+
+		ASSERT(qr_encode(a, n, QR_ECL_MEDIUM, QR_VER_MIN, QR_VER_MAX, QR_MASK_AUTO, false, tmp, &q));
+		ASSERT_EQ(qr_decode(&q, &data, &stats, tmp), QR_SUCCESS);
+		ASSERT(seg_cmp(data.a, data.n, a, n));
+		qr_data_free(&data);
+
+		for (size_t i = 0; i < n; i++) {
+			seg_free(a[i]);
+		}
+		free(a);
+
+		// too big for version 1 in any segmentation
+		errno = 0;
+		ASSERT(qr_make_optimal(s, sizeof s - 1, QR_ECL_HIGH, 1, 1, true, &n) == NULL);
+		ASSERT_EQ(errno, EMSGSIZE);
+	}
+
+	PASS();
+}
+
+
+/*
+ * A segment of the given mode with len bytes of source data and the given
+ * number of encoded bits, neither of which are meaningful.
+ */
+static struct qr_segment *
+fake_seg(enum qr_mode mode, size_t len, size_t bits)
+{
+	struct qr_segment *seg;
+
+	seg = seg_alloc(mode, len, bits);
+	assert(seg != NULL);
+
+	memset(seg->s, 'x', len);
+
+	return seg;
+}
+
+static void
+free_segs(struct qr_segment *a[], size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		seg_free(a[i]);
+	}
+}
+
 TEST
 GetTotalBits(void)
 {
@@ -1021,90 +1759,64 @@ GetTotalBits(void)
 	}
 	{
 		struct qr_segment *segs[] = {
-			& (struct qr_segment) { QR_MODE_BYTE, .u.m = { { 'x', 'y', 'z' }, 3 }, { { 0 }, 24 } },
+			fake_seg(QR_MODE_BYTE, 3, 24),
 		};
 		ASSERT_EQ(count_total_bits(segs, ARRAY_LENGTH(segs), 2), 36);
 		ASSERT_EQ(count_total_bits(segs, ARRAY_LENGTH(segs), 10), 44);
 		ASSERT_EQ(count_total_bits(segs, ARRAY_LENGTH(segs), 39), 44);
+		free_segs(segs, ARRAY_LENGTH(segs));
 	}
 	{
 		struct qr_segment *segs[] = {
-			& (struct qr_segment) { QR_MODE_ECI,     .u.eci = ECI_DEFAULT, { { 0 },  8 } },
-			& (struct qr_segment) { QR_MODE_NUMERIC, .u.s   = "abcdxyz",   { { 0 }, 24 } },
-			& (struct qr_segment) { QR_MODE_ALNUM,   .u.s   = "X",         { { 0 },  6 } },
-			& (struct qr_segment) { QR_MODE_KANJI,   .u.s   = "xxyy",      { { 0 }, 52 } },
+			fake_seg(QR_MODE_ECI,     0,  8),
+			fake_seg(QR_MODE_NUMERIC, 7, 24),
+			fake_seg(QR_MODE_ALNUM,   1,  6),
+			fake_seg(QR_MODE_KANJI,   8, 52), /* two bytes per character */
 		};
 		ASSERT_EQ(count_total_bits(segs, ARRAY_LENGTH(segs), 9), 133);
 		ASSERT_EQ(count_total_bits(segs, ARRAY_LENGTH(segs), 21), 139);
 		ASSERT_EQ(count_total_bits(segs, ARRAY_LENGTH(segs), 27), 145);
+		free_segs(segs, ARRAY_LENGTH(segs));
 	}
 	{
 		struct qr_segment *segs[] = {
-			& (struct qr_segment) { QR_MODE_BYTE, .u.m = { "...", 4093 }, { { 0 }, 32744 } },
+			fake_seg(QR_MODE_BYTE, 4093, 32744),
 		};
 		ASSERT_EQ(count_total_bits(segs, ARRAY_LENGTH(segs), 1), -1);
 		ASSERT_EQ(count_total_bits(segs, ARRAY_LENGTH(segs), 10), 32764);
 		ASSERT_EQ(count_total_bits(segs, ARRAY_LENGTH(segs), 27), 32764);
+		free_segs(segs, ARRAY_LENGTH(segs));
 	}
 	{
-		char a[2047 + 1];
-		memset(a, 'x', sizeof a - 1);
-		a[sizeof a - 1] = '\0';
-
-		char b[1617 + 1];
-		memset(b, 'x', sizeof b - 1);
-		b[sizeof b - 1] = '\0';
-
 		struct qr_segment *segs[] = {
-			& (struct qr_segment) { QR_MODE_NUMERIC, { .s = "" }, { { 0 }, 6824 } },
-			& (struct qr_segment) { QR_MODE_NUMERIC, { .s = "" }, { { 0 }, 6824 } },
-			& (struct qr_segment) { QR_MODE_NUMERIC, { .s = "" }, { { 0 }, 6824 } },
-			& (struct qr_segment) { QR_MODE_NUMERIC, { .s = "" }, { { 0 }, 6824 } },
-			& (struct qr_segment) { QR_MODE_NUMERIC, { .s = "" }, { { 0 }, 5390 } },
+			fake_seg(QR_MODE_NUMERIC, 2047, 6824),
+			fake_seg(QR_MODE_NUMERIC, 2047, 6824),
+			fake_seg(QR_MODE_NUMERIC, 2047, 6824),
+			fake_seg(QR_MODE_NUMERIC, 2047, 6824),
+			fake_seg(QR_MODE_NUMERIC, 1617, 5390),
 		};
-		strcpy(segs[0]->u.s, a);
-		strcpy(segs[1]->u.s, a);
-		strcpy(segs[2]->u.s, a);
-		strcpy(segs[3]->u.s, a);
-		strcpy(segs[4]->u.s, b);
 		ASSERT_EQ(count_total_bits(segs, ARRAY_LENGTH(segs), 1), -1);
 		ASSERT_EQ(count_total_bits(segs, ARRAY_LENGTH(segs), 10), 32766);
 		ASSERT_EQ(count_total_bits(segs, ARRAY_LENGTH(segs), 27), -1);
+		free_segs(segs, ARRAY_LENGTH(segs));
 	}
 	{
-		char a[255 + 1];
-		memset(a, 'x', sizeof a - 1);
-		a[sizeof a - 1] = '\0';
-
-		char b[511 + 1];
-		memset(b, 'x', sizeof b - 1);
-		b[sizeof b - 1] = '\0';
-
 		struct qr_segment *segs[] = {
-			& (struct qr_segment) { QR_MODE_KANJI, { .s = "" }, { { 0 }, 3315 } },
-			& (struct qr_segment) { QR_MODE_KANJI, { .s = "" }, { { 0 }, 3315 } },
-			& (struct qr_segment) { QR_MODE_KANJI, { .s = "" }, { { 0 }, 3315 } },
-			& (struct qr_segment) { QR_MODE_KANJI, { .s = "" }, { { 0 }, 3315 } },
-			& (struct qr_segment) { QR_MODE_KANJI, { .s = "" }, { { 0 }, 3315 } },
-			& (struct qr_segment) { QR_MODE_KANJI, { .s = "" }, { { 0 }, 3315 } },
-			& (struct qr_segment) { QR_MODE_KANJI, { .s = "" }, { { 0 }, 3315 } },
-			& (struct qr_segment) { QR_MODE_KANJI, { .s = "" }, { { 0 }, 3315 } },
-			& (struct qr_segment) { QR_MODE_KANJI, { .s = "" }, { { 0 }, 3315 } },
-			& (struct qr_segment) { QR_MODE_ALNUM, { .s = "" }, { { 0 }, 2811 } },
+			fake_seg(QR_MODE_KANJI, 255 * 2, 3315),
+			fake_seg(QR_MODE_KANJI, 255 * 2, 3315),
+			fake_seg(QR_MODE_KANJI, 255 * 2, 3315),
+			fake_seg(QR_MODE_KANJI, 255 * 2, 3315),
+			fake_seg(QR_MODE_KANJI, 255 * 2, 3315),
+			fake_seg(QR_MODE_KANJI, 255 * 2, 3315),
+			fake_seg(QR_MODE_KANJI, 255 * 2, 3315),
+			fake_seg(QR_MODE_KANJI, 255 * 2, 3315),
+			fake_seg(QR_MODE_KANJI, 255 * 2, 3315),
+			fake_seg(QR_MODE_ALNUM, 511, 2811),
 		};
-		strcpy(segs[0]->u.s, a);
-		strcpy(segs[1]->u.s, a);
-		strcpy(segs[2]->u.s, a);
-		strcpy(segs[3]->u.s, a);
-		strcpy(segs[4]->u.s, a);
-		strcpy(segs[5]->u.s, a);
-		strcpy(segs[6]->u.s, a);
-		strcpy(segs[7]->u.s, a);
-		strcpy(segs[8]->u.s, a);
-		strcpy(segs[9]->u.s, b);
 		ASSERT_EQ(count_total_bits(segs, ARRAY_LENGTH(segs), 9), 32767);
 		ASSERT_EQ(count_total_bits(segs, ARRAY_LENGTH(segs), 26), -1);
 		ASSERT_EQ(count_total_bits(segs, ARRAY_LENGTH(segs), 40), -1);
+		free_segs(segs, ARRAY_LENGTH(segs));
 	}
 
 	PASS();
@@ -1127,51 +1839,51 @@ Examples(void)
 		const char *name;
 		enum qr_mask mask;
 		enum qr_ecl ecl;
-		size_t n;
-		struct qr_segment * const *a;
+		enum qr_mode mode;
+		const char *s;
 	} a[] = {
 		{
 			"../examples/fig1.pbm",
 			QR_MASK_5,
 			QR_ECL_MEDIUM,
-			1, (struct qr_segment *[]) {
-				& (struct qr_segment) { QR_MODE_BYTE, { .m = { "QR Code Symbol", 14 * 8 } }, { { 0 }, 0 } }
-			}
+			QR_MODE_BYTE, "QR Code Symbol"
 		},
 		{
 			"../examples/figG2.pbm",
 			QR_MASK_3,
 			QR_ECL_MEDIUM,
-			1, (struct qr_segment *[]) {
-				& (struct qr_segment) { QR_MODE_NUMERIC, { .s = "01234567" }, { { 0 }, 0 } }
-			}
+			QR_MODE_NUMERIC, "01234567"
 		},
 		{
 			"../examples/figI1.pbm",
 			QR_MASK_2,
 			QR_ECL_MEDIUM,
-			1, (struct qr_segment *[]) {
-				& (struct qr_segment) { QR_MODE_NUMERIC, { .s = "01234567" }, { { 0 }, 0 } }
-			}
+			QR_MODE_NUMERIC, "01234567"
 		},
 		{
 			"../examples/a37.pbm",
 			QR_MASK_6,
 			QR_ECL_MEDIUM,
-			1, (struct qr_segment *[]) {
-				& (struct qr_segment) { QR_MODE_ALNUM, { .s =
-					"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-					"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-					"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-					"ABCDEFGHIJKLMNOPQRSTUV" }, { { 0 }, 0 } }
-			}
+			QR_MODE_ALNUM,
+				"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+				"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+				"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+				"ABCDEFGHIJKLMNOPQRSTUV"
 		}
 	};
 
 	for (i = 0; i < ARRAY_LENGTH(a); i++) {
+		struct qr_segment *seg;
 		FILE *f;
 		uint8_t dtmp[QR_BUF_LEN_MAX];
 
+		switch (a[i].mode) {
+		case QR_MODE_NUMERIC: seg = qr_make_numeric(a[i].s);                break;
+		case QR_MODE_ALNUM:   seg = qr_make_alnum(a[i].s);                  break;
+		case QR_MODE_BYTE:    seg = qr_make_bytes(a[i].s, strlen(a[i].s)); break;
+		default: FAIL();
+		}
+
 		f = fopen(a[i].name, "rb");
 		if (f == NULL) {
 			perror(a[i].name);
@@ -1197,13 +1909,135 @@ Examples(void)
 			FAIL();
 		}
 
-		if (!seg_cmp(data.a, data.n, a[i].a, a[i].n)) {
+		if (!seg_cmp(data.a, data.n, &seg, 1)) {
 			FAIL();
 		}
 
+		qr_data_free(&data);
+		seg_free(seg);
+
+		fclose(f);
+	}
+
+	PASS();
+}
+
+
+/*
+ * q as a P1 or P4 image, scaled to w pixels across, with the given border.
+ * P1 has comments between rows.
+ */
+static size_t
+pbmWrite(const struct qr *q, size_t w, size_t border, bool plain, bool invert, char *buf)
+{
+	size_t width = w + border * 2;
+	char *p = buf;
+
+	p += sprintf(p, "%s\n# a comment\n%zu %zu\n", plain ? "P1" : "P4", width, width);
+
+	for (size_t y = 0; y < width; y++) {
+		for (size_t x = 0; x < width; x++) {
+			bool v = x >= border && x < border + w
+				&& y >= border && y < border + w
+				&& qr_get_module(q, (x - border) * q->size / w, (y - border) * q->size / w);
+
+			v ^= invert;
+
+			if (plain) {
+				*p++ = v ? '1' : '0';
+			} else {
+				if (x % 8 == 0)  // Junk in the padding bits
+					*p++ = 0x5a & (0xff >> (width - x < 8 ? width - x : 8));
+				p[-1] |= v << (7 - x % 8);
+			}
+		}
+
+		if (plain)
+			p += sprintf(p, "\n#%zu\n", y);
+	}
+
+	return p - buf;
+}
+
+
+TEST
+LoadPbm(void)
+{
+	static char buf[1 << 20];
+	uint8_t map[QR_BUF_LEN_MAX], tmp[QR_BUF_LEN_MAX], etmp[QR_BUF_LEN_MAX];
+	struct qr_segment *a[1];
+	struct qr q, t;
+	size_t len;
+
+	q.map = map;
+	t.map = tmp;
+
+	a[0] = qr_make_alnum("HELLO WORLD");
+
+	for (unsigned ver = QR_VER_MIN; ver <= QR_VER_MAX; ver += 13) {
+		ASSERT(qr_encode(a, 1, QR_ECL_MEDIUM, ver, ver, QR_MASK_AUTO, false, etmp, &q));
+
+		for (size_t border = 1; border <= 12; border += 5) {
+			for (int i = 0; i < 4; i++) {
+				bool plain = i & 1, invert = i & 2;
+
+				len = pbmWrite(&q, q.size, border, plain, invert, buf);
+
+				memset(tmp, 0, sizeof tmp);
+				ASSERT(qr_load_pbm_buf(buf, len, &t, invert));
+				ASSERT_EQ(t.size, q.size);
+				ASSERT_MEM_EQ(map, tmp, BM_LEN(q.size * q.size));
+
+				// Truncated
+				errno = 0;
+				ASSERT(!qr_load_pbm_buf(buf, plain ? len / 2 : len - 1, &t, invert));
+				ASSERT_EQ(errno, EINVAL);
+			}
+		}
+
+		// Scaled up, by whole and fractional pixels per module
+		const size_t scale[][2] = { { 2, 1 }, { 4, 1 }, { 10, 1 }, { 11, 2 }, { 10, 3 } };
+		for (size_t i = 0; i < ARRAY_LENGTH(scale); i++) {
+			size_t w = q.size * scale[i][0] / scale[i][1];
+			bool plain = (w + 8) * (w + 8) < sizeof buf / 2;
+
+			len = pbmWrite(&q, w, 4 * scale[i][0] / scale[i][1], plain, false, buf);
+
+			memset(tmp, 0, sizeof tmp);
+			ASSERT(qr_load_pbm_buf(buf, len, &t, false));
+			ASSERT_EQ(t.size, q.size);
+			ASSERT_MEM_EQ(map, tmp, BM_LEN(q.size * q.size));
+		}
+
+		// Something in the quiet zone
+		len = pbmWrite(&q, q.size, 4, true, false, buf);
+		buf[len - 7] = '1';
+		ASSERT(!qr_load_pbm_buf(buf, len, &t, false));
+	}
+
+	ASSERT(!qr_load_pbm_buf("P2\n29 29\n", 9, &t, false));
+	ASSERT(!qr_load_pbm_buf("P4\n", 3, &t, false));
+	ASSERT(!qr_load_pbm_buf("P1\n3 3\n010\n111\n010\n", 19, &t, false));
+
+	seg_free(a[0]);
+
+	// The loaders agree on the examples
+	const char *name[] = { "../examples/fig1.pbm", "../examples/a37.pbm" };
+	for (size_t i = 0; i < ARRAY_LENGTH(name); i++) {
+		FILE *f = fopen(name[i], "rb");
+		ASSERT(f != NULL);
+		ASSERT(qr_load_pbm(f, &q, false));
 		fclose(f);
+
+		ASSERT(qr_load_pbm_file(name[i], &t, false));
+		ASSERT_EQ(t.size, q.size);
+		ASSERT_MEM_EQ(map, tmp, BM_LEN(q.size * q.size));
 	}
 
+	errno = 0;
+	ASSERT(!qr_load_pbm_file("../examples/nonexistent.pbm", &t, false));
+	ASSERT_EQ(errno, ENOENT);
+
 	PASS();
 }
 
@@ -1271,6 +2105,8 @@ Decode(void)
 			FAIL();
 		}
 
+		qr_data_free(&data);
+
 		for (j = 0; j < n; j++) {
 			seg_free(a[j]);
 		}
@@ -1281,6 +2117,565 @@ Decode(void)
 	PASS();
 }
 
+TEST
+DecodeViews(void)
+{
+	struct qr_segment *a[4];
+	struct qr_data data;
+	struct qr_stats stats;
+	struct qr_views views;
+	struct qr q;
+
+	static struct qr_segment_view v[QR_SEGMENTS_MAX];
+	static char payload[QR_PAYLOAD_MAX];
+
+	uint8_t map[QR_BUF_LEN_MAX];
+	uint8_t tmp[QR_BUF_LEN_MAX];
+	q.map = map;
+
+	const uint8_t bytes[] = { 0x00, 0xff, 'h', 'i' };
+
+	a[0] = qr_make_numeric("0123456789");
+	a[1] = qr_make_alnum("HELLO WORLD");
+	a[2] = qr_make_bytes(bytes, sizeof bytes);
+	a[3] = qr_make_numeric("42");
+
+	for (enum qr_ecl ecl = QR_ECL_LOW; ecl <= QR_ECL_HIGH; ecl++) {
+		ASSERT(qr_encode(a, ARRAY_LENGTH(a), ecl, QR_VER_MIN, QR_VER_MAX, QR_MASK_AUTO, false, tmp, &q));
+
+		ASSERT_EQ(qr_decode(&q, &data, &stats, tmp), QR_SUCCESS);
+
+		views.payload     = payload;
+		views.payload_max = sizeof payload;
+		views.a   = v;
+		views.max = ARRAY_LENGTH(v);
+
+		ASSERT_EQ(qr_decode_views(&q, NULL, &views, &stats, tmp), QR_SUCCESS);
+		ASSERT_EQ(views.ecl, data.ecl);
+		ASSERT_EQ(views.mask, data.mask);
+		ASSERT_EQ(views.n, data.n);
+		ASSERT_EQ(views.n, ARRAY_LENGTH(a));
+		ASSERT_EQ(views.payload_len, 10 + 11 + sizeof bytes + 2);
+
+		for (size_t i = 0; i < views.n; i++) {
+			ASSERT_EQ(v[i].mode, data.a[i]->mode);
+
+			if (v[i].mode == QR_MODE_ECI) {
+				ASSERT_EQ(v[i].eci, data.a[i]->eci);
+			}
+
+			ASSERT_EQ(v[i].len, data.a[i]->len);
+			ASSERT_EQ(memcmp(payload + v[i].offset, data.a[i]->s, v[i].len), 0);
+		}
+
+		qr_data_free(&data);
+
+		/* too little room for the payload, or for the segments */
+		views.payload_max = 20;
+		ASSERT_EQ(qr_decode_views(&q, NULL, &views, &stats, tmp), QR_ERROR_DATA_OVERFLOW);
+
+		views.payload_max = sizeof payload;
+		views.max = 3;
+		ASSERT_EQ(qr_decode_views(&q, NULL, &views, &stats, tmp), QR_ERROR_DATA_OVERFLOW);
+	}
+
+	/* ECI segments, which qr_encode() doesn't emit, by hand */
+	{
+		const unsigned ver = 2;
+		const enum qr_ecl ecl = QR_ECL_MEDIUM;
+		uint8_t ds[QR_BUF_LEN_MAX];
+		struct bit_writer w;
+		size_t bits;
+
+		bit_writer_init(&w, ds);
+		bit_writer_put(&w, QR_MODE_ECI, 4);
+		bit_writer_put(&w, ECI_UTF8, 8);
+		bit_writer_put(&w, QR_MODE_BYTE, 4);
+		bit_writer_put(&w, 2, 8);
+		bit_writer_put(&w, 'h', 8);
+		bit_writer_put(&w, 'i', 8);
+		bit_writer_put(&w, QR_MODE_ECI, 4);
+		bit_writer_put(&w, 0x80 | 1000 >> 8, 8); /* two-byte designator */
+		bit_writer_put(&w, 1000 & 0xff, 8);
+		bit_writer_put(&w, QR_MODE_NUMERIC, 4);
+		bit_writer_put(&w, 2, 10);
+		bit_writer_put(&w, 42, 7);
+		bit_writer_put(&w, 0, 4);
+		bits = bit_writer_flush(&w);
+
+		for (size_t i = (bits + 7) / 8; i < (size_t) count_codewords(ver, ecl); i++) {
+			ds[i] = (i - (bits + 7) / 8) % 2 == 0 ? 0xEC : 0x11;
+		}
+
+		append_ecl(ds, ver, ecl, NULL, tmp);
+		q.size = QR_SIZE(ver);
+		memcpy(q.map, qr_function_template(ver), QR_BUF_LEN(ver));
+		draw_codewords(tmp, count_data_bits(ver) / 8, &q);
+		encode_mask(&q, ecl, QR_MASK_2);
+
+		views.payload_max = sizeof payload;
+		views.max = ARRAY_LENGTH(v);
+
+		ASSERT_EQ(qr_decode_views(&q, NULL, &views, &stats, tmp), QR_SUCCESS);
+		ASSERT_EQ(views.n, 4);
+		ASSERT_EQ(views.payload_len, 4);
+		ASSERT_EQ(memcmp(payload, "hi42", 4), 0);
+
+		ASSERT_EQ(v[0].mode, QR_MODE_ECI);
+		ASSERT_EQ(v[0].eci, ECI_UTF8);
+		ASSERT_EQ(v[0].offset, 0);
+		ASSERT_EQ(v[0].len, 0);
+
+		ASSERT_EQ(v[1].mode, QR_MODE_BYTE);
+		ASSERT_EQ(v[1].offset, 0);
+		ASSERT_EQ(v[1].len, 2);
+
+		ASSERT_EQ(v[2].mode, QR_MODE_ECI);
+		ASSERT_EQ(v[2].eci, 1000);
+		ASSERT_EQ(v[2].offset, 2);
+		ASSERT_EQ(v[2].len, 0);
+
+		ASSERT_EQ(v[3].mode, QR_MODE_NUMERIC);
+		ASSERT_EQ(v[3].offset, 2);
+		ASSERT_EQ(v[3].len, 2);
+	}
+
+	for (size_t i = 0; i < ARRAY_LENGTH(a); i++) {
+		seg_free(a[i]);
+	}
+
+	PASS();
+}
+
+
+TEST
+DecodeEmpty(void)
+{
+	struct qr_data data;
+	struct qr_stats stats;
+	struct qr_views views;
+	struct qr q;
+
+	static struct qr_segment_view v[QR_SEGMENTS_MAX];
+	static char payload[QR_PAYLOAD_MAX];
+
+	uint8_t map[QR_BUF_LEN_MAX];
+	uint8_t tmp[QR_BUF_LEN_MAX];
+	q.map = map;
+
+	for (enum qr_ecl ecl = QR_ECL_LOW; ecl <= QR_ECL_HIGH; ecl++) {
+		ASSERT(qr_encode(NULL, 0, ecl, QR_VER_MIN, QR_VER_MAX, QR_MASK_AUTO, false, tmp, &q));
+		ASSERT_EQ(q.size, QR_SIZE(QR_VER_MIN));
+
+		ASSERT_EQ(qr_decode(&q, &data, &stats, tmp), QR_SUCCESS);
+		ASSERT_EQ(data.n, 0);
+		ASSERT_EQ(data.ecl, ecl);
+		ASSERT(seg_cmp(data.a, data.n, NULL, 0));
+		ASSERT_EQ(seg_len(data.a, data.n), 0);
+		qr_data_free(&data);
+		ASSERT_EQ(data.n, 0);
+		ASSERT_EQ(data.a, NULL);
+
+		views.payload     = payload;
+		views.payload_max = sizeof payload;
+		views.a   = v;
+		views.max = ARRAY_LENGTH(v);
+
+		ASSERT_EQ(qr_decode_views(&q, NULL, &views, &stats, tmp), QR_SUCCESS);
+		ASSERT_EQ(views.n, 0);
+		ASSERT_EQ(views.payload_len, 0);
+	}
+
+	PASS();
+}
+
+
+TEST
+FormatVersionInfo(void)
+{
+	struct qr_segment *a[1];
+	struct qr_data data;
+	struct qr_stats stats;
+	struct qr q;
+	unsigned d;
+
+	uint8_t map[QR_BUF_LEN_MAX];
+	uint8_t tmp[QR_BUF_LEN_MAX];
+	q.map = map;
+
+	// Every format, with up to three bits wrong
+	for (uint32_t f = 0; f < 32; f++) {
+		for (uint32_t e = 0; e < 1 << 15; e++) {
+			if (popcount64(e) > FORMAT_MAX_ERROR)
+				continue;
+
+			ASSERT_EQ(nearest_codeword(format_codewords[f] ^ e, format_codewords, 32, &d), f);
+			ASSERT_EQ(d, popcount64(e));
+		}
+	}
+
+	a[0] = qr_make_alnum("HELLO WORLD");
+
+	for (unsigned ver = QR_VER_MIN; ver <= QR_VER_MAX; ver++) {
+		ASSERT(qr_encode(a, 1, QR_ECL_MEDIUM, ver, ver, QR_MASK_5, false, tmp, &q));
+
+		// Damage the first copy of each beyond repair, and the second a little
+		for (int i = 0; i < 4; i++) {
+			qr_set_module(&q, 8, i, !qr_get_module(&q, 8, i));
+			if (ver >= 7)
+				qr_set_module(&q, q.size - 11, i, !qr_get_module(&q, q.size - 11, i));
+		}
+		for (int i = 0; i < 3; i++) {
+			qr_set_module(&q, q.size - 1 - i, 8, !qr_get_module(&q, q.size - 1 - i, 8));
+			if (ver >= 7)
+				qr_set_module(&q, i, q.size - 11, !qr_get_module(&q, i, q.size - 11));
+		}
+
+		ASSERT_EQ(qr_decode(&q, &data, &stats, tmp), QR_SUCCESS);
+		ASSERT_EQ(data.ecl, QR_ECL_MEDIUM);
+		ASSERT_EQ(data.mask, QR_MASK_5);
+		ASSERT_EQ(stats.format_corrections, 3);
+		ASSERT_EQ(stats.format_corrected[1], format_codewords[0 << 3 | 5]);
+
+		if (ver >= 7) {
+			ASSERT_EQ(stats.version_corrections, 3);
+			ASSERT_EQ(stats.version_corrected[1] >> 12, ver);
+		} else {
+			ASSERT_EQ(stats.version_corrected[0], 0);
+			ASSERT_EQ(stats.version_corrected[1], 0);
+		}
+
+		qr_data_free(&data);
+
+		// The version information of the next version up, as when a grid
+		// is sampled one size too small
+		if (ver >= 7 && ver < QR_VER_MAX) {
+			uint32_t u = version_codewords[ver + 1 - 7];
+
+			for (int i = 0; i < 18; i++) {
+				unsigned k = q.size - 11 + i % 3;
+
+				qr_set_module(&q, k, i / 3, (u >> i) & 1);
+				qr_set_module(&q, i / 3, k, (u >> i) & 1);
+			}
+
+			ASSERT_EQ(qr_decode(&q, &data, &stats, tmp), QR_ERROR_VERSION_MISMATCH);
+			ASSERT_EQ(stats.version_corrections, 0);
+			ASSERT_EQ(stats.version_corrected[0] >> 12, ver + 1);
+			qr_data_free(&data);
+		}
+	}
+
+	seg_free(a[0]);
+
+	PASS();
+}
+
+
+static void
+codeword_module(void *opaque, size_t i, size_t module)
+{
+	size_t *m = opaque;
+
+	m[i] = module;
+}
+
+
+TEST
+DecodeErasures(void)
+{
+	struct qr_segment *a[1];
+	struct qr_data data;
+	struct qr_stats stats;
+	struct qr q;
+
+	uint8_t map[QR_BUF_LEN_MAX];
+	uint8_t erasures[QR_BUF_LEN_MAX] = { 0 };
+	uint8_t tmp[QR_BUF_LEN_MAX];
+	size_t module[26 * 8];
+	q.map = map;
+
+	struct qr_options opt = { NULL };
+	opt.erasures = erasures;
+
+	// Version 1-L is a single block of 19 data and 7 ECC codewords,
+	// which can correct 3 errors, or 7 erasures
+	a[0] = qr_make_alnum("HELLO WORLD");
+	ASSERT(qr_encode(a, 1, QR_ECL_LOW, 1, 1, QR_MASK_0, false, tmp, &q));
+
+	placement_walk(1, codeword_module, module);
+
+	// Invert every module of seven codewords
+	for (size_t i = 0; i < 7; i++) {
+		for (size_t j = 0; j < 8; j++) {
+			size_t m = module[i * 3 * 8 + j];
+
+			map[BM_BYTE(m)] ^= 1 << BM_BIT(m);
+			erasures[BM_BYTE(m)] |= 1 << BM_BIT(m);
+		}
+	}
+
+	ASSERT_EQ(qr_decode_opt(&q, &opt, &data, &stats, tmp), QR_SUCCESS);
+	ASSERT_EQ(stats.codeword_corrections, 7);
+	ASSERT(seg_cmp(data.a, data.n, a, 1));
+	qr_data_free(&data);
+
+	// One erasure too many
+	size_t m = module[1 * 8];
+	erasures[BM_BYTE(m)] |= 1 << BM_BIT(m);
+	ASSERT(qr_decode_opt(&q, &opt, &data, &stats, tmp) != QR_SUCCESS || !seg_cmp(data.a, data.n, a, 1));
+	qr_data_free(&data);
+
+	seg_free(a[0]);
+
+	PASS();
+}
+
+TEST
+DecodeSoft(void)
+{
+	struct qr_segment *a[1];
+	struct qr_data data;
+	struct qr_stats stats;
+	struct qr q;
+
+	uint8_t map[QR_BUF_LEN_MAX];
+	uint8_t tmp[QR_BUF_LEN_MAX];
+	uint8_t y[21 * 21];
+	size_t module[26 * 8];
+	q.map = map;
+
+	// Version 1-L can correct 3 errors
+	a[0] = qr_make_alnum("HELLO WORLD");
+	ASSERT(qr_encode(a, 1, QR_ECL_LOW, 1, 1, QR_MASK_0, false, tmp, &q));
+
+	for (size_t i = 0; i < sizeof y; i++) {
+		y[i] = BM_GET(map, i) ? 255 : 0;
+	}
+
+	ASSERT_EQ(qr_decode_soft(y, 21, 21, NULL, &data, &stats, tmp), QR_SUCCESS);
+	ASSERT_EQ(stats.codeword_corrections, 0);
+	ASSERT(seg_cmp(data.a, data.n, a, 1));
+	qr_data_free(&data);
+
+	placement_walk(1, codeword_module, module);
+
+	// One module of each of five codewords just the wrong side of the threshold
+	for (size_t i = 0; i < 5; i++) {
+		size_t m = module[(i * 5 + 1) * 8 + i];
+
+		map[BM_BYTE(m)] ^= 1 << BM_BIT(m);
+		y[m] = BM_GET(map, m) ? 130 + i : 125 - i;
+	}
+
+	ASSERT(qr_decode(&q, &data, &stats, tmp) != QR_SUCCESS || !seg_cmp(data.a, data.n, a, 1));
+	qr_data_free(&data);
+
+	ASSERT_EQ(qr_decode_soft(y, 21, 21, NULL, &data, &stats, tmp), QR_SUCCESS);
+	ASSERT_EQ(stats.codeword_corrections, 5);
+	ASSERT(seg_cmp(data.a, data.n, a, 1));
+	qr_data_free(&data);
+
+	seg_free(a[0]);
+
+	PASS();
+}
+
+TEST
+SelectVersion(void)
+{
+	// Capacity increases with the version, for the binary search
+	for (unsigned ver = QR_VER_MIN; ver < QR_VER_MAX; ver++) {
+		for (enum qr_ecl ecl = QR_ECL_LOW; ecl <= QR_ECL_HIGH; ecl++)
+			ASSERT(count_codewords(ver, ecl) < count_codewords(ver + 1, ecl));
+	}
+
+	for (int k = 0; k < 200; k++) {
+		struct qr_segment *a[3];
+		size_t n = 1 + rand() % 3;
+		char s[8000];
+
+		// Lengths across all the classes, and some too long for any count field
+		for (size_t i = 0; i < n; i++) {
+			size_t len = rand() % (k < 100 ? 1200 : sizeof s - 1);
+			for (size_t j = 0; j < len; j++)
+				s[j] = '0' + rand() % 10;
+			s[len] = '\0';
+			a[i] = rand() % 2 ? qr_make_numeric(s) : qr_make_bytes(s, len / 3);
+		}
+
+		unsigned min = QR_VER_MIN + rand() % QR_VER_MAX;
+		unsigned max = min + rand() % (QR_VER_MAX - min + 1);
+		enum qr_ecl ecl = rand() % 4;
+
+		// The linear probe this replaced
+		unsigned expect = 0;
+		for (unsigned ver = min; ver <= max; ver++) {
+			int bits = count_total_bits(a, n, ver);
+			if (bits != -1 && bits <= count_codewords(ver, ecl) * 8) {
+				expect = ver;
+				break;
+			}
+		}
+
+		enum qr_ecl e = ecl;
+		unsigned ver = 0;
+		errno = 0;
+		ASSERT_EQ(encode_version(a, n, &e, min, max, false, &ver), expect != 0);
+		if (expect != 0) {
+			ASSERT_EQ(ver, expect);
+			ASSERT_EQ(e, ecl);
+		} else {
+			ASSERT_EQ(errno, EMSGSIZE);
+		}
+
+		for (size_t i = 0; i < n; i++)
+			seg_free(a[i]);
+	}
+
+	PASS();
+}
+
+
+TEST
+EncodeBatch(void)
+{
+	static uint8_t maps[64][QR_BUF_LEN_MAX];
+	struct qr_segment *segs[64][2];
+	struct qr_segment * const *a[64];
+	size_t n[64];
+	struct qr q[64], r;
+
+	uint8_t map[QR_BUF_LEN_MAX];
+	uint8_t tmp[QR_BUF_LEN_MAX];
+	r.map = map;
+
+	// Enough symbols of a few versions to reuse and replace templates
+	for (size_t i = 0; i < 64; i++) {
+		char s[200];
+		size_t len = rand() % sizeof s;
+
+		for (size_t j = 0; j < len; j++) {
+			s[j] = ALNUM_CHARSET[rand() % (sizeof ALNUM_CHARSET - 1)];
+		}
+		s[len] = '\0';
+
+		segs[i][0] = qr_make_alnum(s);
+		segs[i][1] = qr_make_numeric("0123");
+		a[i] = segs[i];
+		n[i] = 1 + rand() % 2;
+		q[i].map = maps[i];
+	}
+
+	for (int boost = 0; boost <= 1; boost++) {
+		ASSERT_EQ(qr_encode_batch(a, n, 64, QR_ECL_MEDIUM, 1, 10, QR_MASK_AUTO, boost, NULL, tmp, q), 64);
+
+		for (size_t i = 0; i < 64; i++) {
+			ASSERT(qr_encode(a[i], n[i], QR_ECL_MEDIUM, 1, 10, QR_MASK_AUTO, boost, tmp, &r));
+			ASSERT_EQ(q[i].size, r.size);
+			ASSERT_EQ(memcmp(q[i].map, r.map, QR_BUF_LEN(QR_VER(r.size))), 0);
+		}
+	}
+
+	// Stops at the first symbol which does not fit
+	{
+		struct qr_segment *small = qr_make_numeric("1");
+		struct qr_segment *big = qr_make_numeric("123456789012345678901234567890123456789012345678901234567890"
+			"123456789012345678901234567890123456789012345678901234567890");
+		struct qr_segment * const *b[3] = { &small, &big, &small };
+		size_t m[3] = { 1, 1, 1 };
+
+		errno = 0;
+		ASSERT_EQ(qr_encode_batch(b, m, 3, QR_ECL_HIGH, 1, 3, QR_MASK_0, false, NULL, tmp, q), 1);
+		ASSERT_EQ(errno, EMSGSIZE);
+
+		seg_free(small);
+		seg_free(big);
+	}
+
+	for (size_t i = 0; i < 64; i++) {
+		seg_free(segs[i][0]);
+		seg_free(segs[i][1]);
+	}
+
+	PASS();
+}
+
+
+TEST
+ThreadPool(void)
+{
+	struct qr_pool *pool;
+	struct qr_options opt = { NULL };
+	struct qr_segment *a[1];
+	struct qr q;
+
+	uint8_t map[QR_BUF_LEN_MAX];
+	uint8_t tmp[QR_BUF_LEN_MAX];
+	q.map = map;
+
+	pool = qr_pool_create(4);
+	ASSERT(pool != NULL);
+	opt.pool = pool;
+
+	for (unsigned ver = QR_VER_MIN; ver <= QR_VER_MAX; ver++) {
+		for (enum qr_ecl ecl = QR_ECL_LOW; ecl <= QR_ECL_HIGH; ecl++) {
+			uint8_t data[2][QR_BUF_LEN_MAX];
+			uint8_t expect[QR_BUF_LEN_MAX], result[QR_BUF_LEN_MAX];
+			int rawCodewords = count_data_bits(ver) / 8;
+
+			for (int i = 0; i < count_codewords(ver, ecl); i++) {
+				data[0][i] = data[1][i] = rand() % 256;
+			}
+
+			append_ecl(data[0], ver, ecl, NULL, expect);
+			append_ecl(data[1], ver, ecl, pool, result);
+			ASSERT_EQ(memcmp(result, expect, rawCodewords), 0);
+		}
+	}
+
+	a[0] = qr_make_any("HELLO");
+
+	for (unsigned ver = QR_VER_MIN; ver <= QR_VER_MAX; ver++) {
+		struct qr_data data[2];
+		struct qr_stats stats[2];
+		uint8_t dtmp[QR_BUF_LEN_MAX];
+
+		ASSERT(qr_encode_opt(a, 1, QR_ECL_HIGH, ver, ver, QR_MASK_AUTO, false, &opt, tmp, &q));
+
+		// An undamaged symbol needs no corrections
+		ASSERT_EQ(qr_decode_opt(&q, &opt, &data[0], &stats[0], dtmp), QR_SUCCESS);
+		ASSERT_EQ(stats[0].codeword_corrections, 0);
+		qr_data_free(&data[0]);
+
+		// A few flipped data modules, within what ECL H can correct
+		for (int n = 0; n < 8; ) {
+			unsigned x = rand() % q.size;
+			unsigned y = rand() % q.size;
+
+			if (!reserved_module(&q, x, y)) {
+				qr_set_module(&q, x, y, !qr_get_module(&q, x, y));
+				n++;
+			}
+		}
+
+		ASSERT_EQ(qr_decode_opt(&q, NULL, &data[0], &stats[0], dtmp), QR_SUCCESS);
+		ASSERT_EQ(qr_decode_opt(&q, &opt, &data[1], &stats[1], dtmp), QR_SUCCESS);
+		ASSERT(stats[0].codeword_corrections > 0);
+		ASSERT_EQ(stats[1].codeword_corrections, stats[0].codeword_corrections);
+		ASSERT_EQ(stats[1].corrected.bits, stats[0].corrected.bits);
+		ASSERT_EQ(memcmp(stats[1].corrected.data, stats[0].corrected.data, BM_LEN(stats[0].corrected.bits)), 0);
+		ASSERT(seg_cmp(data[1].a, data[1].n, data[0].a, data[0].n));
+		qr_data_free(&data[0]);
+		qr_data_free(&data[1]);
+	}
+
+	seg_free(a[0]);
+	qr_pool_destroy(pool);
+
+	PASS();
+}
+
 GREATEST_MAIN_DEFS();
 
 int
@@ -1289,17 +2684,26 @@ main(int argc, char *argv[])
 	GREATEST_MAIN_BEGIN();
 
 	RUN_TEST(AppendBitsToBuffer);
+	RUN_TEST(BitWriter);
+	RUN_TEST(BitReader);
 	RUN_TEST(AppendErrorCorrection);
 	RUN_TEST(ErrorCorrectionBlockLengths);
 	RUN_TEST(GetNumRawDataModules);
 	RUN_TEST(GetNumDataCodewords);
 	RUN_TEST(CalcReedSolomonGenerator);
+	RUN_TEST(ReedSolomonTables);
 	RUN_TEST(CalcReedSolomonRemainder);
+	RUN_TEST(ReedSolomonKernels);
+	RUN_TEST(CorrectBlock);
 	RUN_TEST(FiniteFieldMultiply);
 	RUN_TEST(InitializeFunctionModulesEtc);
 	RUN_TEST(GetAlignmentPatternPositions);
+	RUN_TEST(DataRegion);
 	RUN_TEST(GetSetModule);
 	RUN_TEST(GetSetModuleRandomly);
+	RUN_TEST(GetSetRows);
+	RUN_TEST(ApplyMask);
+	RUN_TEST(PenaltyScore);
 	RUN_TEST(IsAlphanumeric);
 	RUN_TEST(IsNumeric);
 	RUN_TEST(CalcSegmentBufferSize);
@@ -1308,9 +2712,20 @@ main(int argc, char *argv[])
 	RUN_TEST(MakeNumeric);
 	RUN_TEST(MakeAlphanumeric);
 	RUN_TEST(MakeEci);
+	RUN_TEST(MakeKanji);
+	RUN_TEST(MakeOptimal);
 	RUN_TEST(GetTotalBits);
 	RUN_TEST(Examples);
+	RUN_TEST(LoadPbm);
 	RUN_TEST(Decode);
+	RUN_TEST(DecodeViews);
+	RUN_TEST(DecodeEmpty);
+	RUN_TEST(FormatVersionInfo);
+	RUN_TEST(DecodeErasures);
+	RUN_TEST(DecodeSoft);
+	RUN_TEST(SelectVersion);
+	RUN_TEST(EncodeBatch);
+	RUN_TEST(ThreadPool);
 
 	GREATEST_MAIN_END();
 }